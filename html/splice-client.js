@@ -0,0 +1,93 @@
+// Replace the client module of ../src/index.html with src/client.js, keeping the other
+// modules of the bundle (webpack runtime, xterm, zmodem.js, polyfills and style).
+// It is for the client changes made where the build dependencies can not be installed:
+// the module is src/client.js as is, so it can be compared to the source, and the next
+// `yarn run build` produces the same client from it. A change of the dependencies or of
+// the style still needs `yarn run build`.
+//
+// node splice-client.js
+
+'use strict'
+
+const fs = require('fs')
+const path = require('path')
+
+const BUNDLE = path.join(__dirname, '..', 'src', 'index.html')
+const CLIENT = path.join(__dirname, 'src', 'client.js')
+
+// webpack ids of the modules client.js requires in the last yarn run build
+const MODULES = {
+  './style.scss': 108,
+  'core-js/fn/array': 111,
+  'core-js/fn/object': 139,
+  'core-js/fn/promise': 173,
+  'core-js/fn/typed': 182,
+  'fast-text-encoding': 194,
+  'zmodem.js/src/zmodem_browser': 196,
+  'xterm': 205,
+  'xterm/lib/addons/fit/fit': 239,
+  'xterm/lib/addons/winptyCompat/winptyCompat': 240,
+  './overlay': 241
+}
+
+const HEAD = 'function(module,exports,__webpack_require__){"use strict";'
+const BEGIN = '/* begin html/src/client.js */'
+const END = '/* end html/src/client.js */'
+// the client module as built by webpack, before it was first spliced
+const BUILT = 'function(e,t,r){"use strict";r(108),r(111),r(139),r(173),r(182),r(194);'
+
+// End of the function starting at start: the brace closing its body, skipping strings
+function functionEnd (text, start) {
+  let depth = 0
+  let quote = null
+  for (let i = text.indexOf('{', start); i < text.length; i++) {
+    const c = text[i]
+    if (quote !== null) {
+      if (c === '\\') i++
+      else if (c === quote) quote = null
+    } else if (c === '"' || c === "'" || c === '`') {
+      quote = c
+    } else if (c === '{') {
+      depth++
+    } else if (c === '}' && --depth === 0) {
+      return i
+    }
+  }
+  throw new Error('unterminated client module')
+}
+
+function main () {
+  const html = fs.readFileSync(BUNDLE, 'utf8')
+  const client = fs.readFileSync(CLIENT, 'utf8')
+
+  const required = client.match(/require\('[^']+'\)/g).map(r => r.slice(9, -2))
+  const unknown = required.filter(name => !(name in MODULES))
+  if (unknown.length > 0) {
+    throw new Error('not in the bundle: ' + unknown.join(', ') + ', run yarn run build')
+  }
+  if (client.includes('</script')) {
+    throw new Error('src/client.js can not be inlined, it contains </script')
+  }
+
+  let start = html.indexOf(BEGIN)
+  let end
+  if (start >= 0) {
+    start = html.lastIndexOf(HEAD, start)
+    end = html.indexOf(END, start) + END.length + 1
+  } else {
+    start = html.indexOf(BUILT)
+    if (start < 0 || html.indexOf(BUILT, start + 1) >= 0) {
+      throw new Error('client module not found in ' + BUNDLE)
+    }
+    end = functionEnd(html, start) + 1
+  }
+
+  // strict like the module webpack builds, require resolves to the modules of the bundle
+  const spliced = HEAD +
+    'var require=function(name){return __webpack_require__(' + JSON.stringify(MODULES) + '[name])};' +
+    BEGIN + '\n' + client + END + '}'
+  fs.writeFileSync(BUNDLE, html.slice(0, start) + spliced + html.slice(end))
+  console.log('spliced ' + CLIENT + ' into ' + BUNDLE)
+}
+
+main()
@@ -25,9 +25,27 @@ var authToken = (typeof tty_auth_token !== 'undefined') ? tty_auth_token : null
 var autoReconnect = -1
 var reconnectTimer, title
 
+// zmodem headers start with ZDLE and are at most 21 bytes long
+var ZDLE = 0x18
+var ZMODEM_HEADER_MAX = 21
+// write the pending output right away past this size, e.g. when animation frames are paused in a hidden tab
+var OUTPUT_FLUSH_SIZE = 262144
+
+// output statistics, read window.ttyStats from the browser console to compare the throughput
+var stats = window.ttyStats = { bytes: 0, messages: 0, writes: 0, rate: 0 }
+
+// file transfers: upload frames and the most upload data the socket may buffer
+var FILE_CHUNK_SIZE = 65536
+var UPLOAD_BUFFERED_MAX = 1048576
+// upload and download actions of the session, set when its service has file transfers
+var fileActions = null
+
 var term = new Terminal()
-var socketPath = ''
-var service = ''
+// the server inlines the websocket config into the page, it is fetched otherwise
+/* eslint-disable-next-line */
+var socketPath = (typeof tty_config !== 'undefined') ? tty_config.socketPath : ''
+/* eslint-disable-next-line */
+var service = (typeof tty_config !== 'undefined') ? tty_config.service : ''
 
 function init () {
   // Attach 'Shift + Ctrl + C' key event handler
@@ -37,12 +55,30 @@ function init () {
       document.execCommand('copy')
       return false
     }
+    // 'Shift + Ctrl + U' uploads files, 'Shift + Ctrl + D' downloads a file
+    if (e.shiftKey && e.ctrlKey && fileActions !== null && (e.keyCode === 85 || e.keyCode === 68)) {
+      e.preventDefault()
+      if (e.type === 'keydown') {
+        e.keyCode === 85 ? fileActions.upload() : fileActions.download()
+      }
+      return false
+    }
     return true
   })
 
   var terminalContainer = document.createElement('div')
   terminalContainer.className = 'terminal-container'
   document.body.appendChild(terminalContainer)
+  // files dropped on the terminal are uploaded
+  terminalContainer.addEventListener('dragover', e => {
+    if (fileActions !== null) e.preventDefault()
+  })
+  terminalContainer.addEventListener('drop', e => {
+    if (fileActions !== null) {
+      e.preventDefault()
+      fileActions.upload(e.dataTransfer.files)
+    }
+  })
 
   term.open(terminalContainer)
   term.winptyCompatInit()
@@ -141,6 +177,7 @@ function connect () {
 function startTerminal () {
   term.hideModal()
   var wsError = false
+  var queued = false
   var serviceRoot = document.location.pathname.replace(/[^/]+$/g, '')
   var httpsEnabled = window.location.protocol === 'https:'
   var url = (httpsEnabled ? 'wss://' : 'ws://') + window.location.host + serviceRoot + socketPath + document.location.search
@@ -171,6 +208,9 @@ function startTerminal () {
   }
 
   function disconnect (reason) {
+    flushOutput()
+    clearInterval(statsTimer)
+    fileActions = null
     term.off()
     window.removeEventListener('resize', resizeWindow, false)
     window.removeEventListener('beforeunload', unloadHandler, false)
@@ -193,11 +233,170 @@ function startTerminal () {
     // connect()
   }
 
+  // the output is decoded as it arrives and written to the terminal once per animation frame
+  var outputDecoder = new TextDecoder()
+  var streamDecode = true
+  var pendingOutput = ''
+  var flushRequested = false
+  var zmodemBytes = 0
+  var lastBytes = stats.bytes
+  var statsTimer = setInterval(function () {
+    stats.rate = stats.bytes - lastBytes
+    lastBytes = stats.bytes
+  }, 1000)
+
+  function flushOutput () {
+    flushRequested = false
+    if (pendingOutput.length > 0) {
+      term.write(pendingOutput)
+      pendingOutput = ''
+      stats.writes++
+    }
+  }
+
+  function writeOutput (data) {
+    var text
+    if (streamDecode) {
+      try {
+        text = outputDecoder.decode(data, { stream: true })
+      } catch (e) {
+        // the polyfill can not decode streams, the server ends the frames on character boundaries anyway
+        streamDecode = false
+      }
+    }
+    if (!streamDecode) {
+      text = outputDecoder.decode(data)
+    }
+    pendingOutput += text
+    if (pendingOutput.length >= OUTPUT_FLUSH_SIZE) {
+      flushOutput()
+    } else if (!flushRequested) {
+      flushRequested = true
+      window.requestAnimationFrame(flushOutput)
+    }
+  }
+
+  function consumeOutput (data) {
+    stats.bytes += data.length
+    stats.messages++
+    // no zmodem when the service has file transfers
+    if (fileActions !== null) {
+      writeOutput(data)
+      return
+    }
+    // the sentry copies its input, only hand it the output that may contain a zmodem header
+    var zdle = data.lastIndexOf(ZDLE)
+    var detect = zdle >= 0 || zmodemBytes > 0 || zsentry.get_confirmed_session() !== null
+    zmodemBytes = zdle >= 0 ? ZMODEM_HEADER_MAX - (data.length - zdle - 1) : zmodemBytes - data.length
+    if (!detect) {
+      writeOutput(data)
+      return
+    }
+    try {
+      zsentry.consume(data)
+    } catch (e) {
+      console.error(e)
+      resetTerm()
+    }
+  }
+
+  // file transfers run one at a time: a FILE_REQUEST message asks for a file, the server
+  // answers with FILE_STATUS messages and the data goes in FILE_UPLOAD/FILE_DOWNLOAD messages
+  var download = null
+  var upload = null
+  var uploads = []
+
+  function showTransferProgress (transfer, offset) {
+    var percent = transfer.size > 0 ? Math.floor(100 * offset / transfer.size) : 100
+    if (percent !== transfer.percent) {
+      transfer.percent = percent
+      term.showFlash(transfer.name + ' ' + percent + '%', 1000)
+    }
+  }
+
+  function requestDownload () {
+    var name = window.prompt('Download file')
+    if (name) {
+      sendMessage('2' + JSON.stringify({ download: name }))
+    }
+  }
+
+  function requestUpload (files) {
+    if (!files) {
+      var input = document.createElement('input')
+      input.type = 'file'
+      input.multiple = true
+      input.onchange = () => requestUpload(input.files)
+      input.click()
+      return
+    }
+    for (var i = 0; i < files.length; i++) {
+      uploads.push(files[i])
+    }
+    if (upload === null) {
+      nextUpload()
+    }
+  }
+
+  function nextUpload () {
+    var file = uploads.shift()
+    upload = file ? { file: file, name: file.name, size: file.size } : null
+    if (upload !== null) {
+      sendMessage('2' + JSON.stringify({ upload: upload.name, size: upload.size }))
+    }
+  }
+
+  function sendUpload (transfer, offset) {
+    // the browser reads the file slices as it sends them, keep the socket buffer bounded
+    while (upload === transfer && offset < transfer.size && ws.bufferedAmount < UPLOAD_BUFFERED_MAX) {
+      var end = Math.min(offset + FILE_CHUNK_SIZE, transfer.size)
+      ws.send(new Blob(['3', transfer.file.slice(offset, end)]))
+      offset = end
+      showTransferProgress(transfer, offset)
+    }
+    if (upload === transfer && offset < transfer.size) {
+      setTimeout(() => sendUpload(transfer, offset), 10)
+    }
+  }
+
+  function fileStatus (status) {
+    if (status.error) {
+      term.showFlash(status.error, 3000)
+      download = null
+      if (upload !== null) {
+        nextUpload()
+      }
+    } else if (status.download !== undefined) {
+      if (!status.done) {
+        download = { name: status.download, size: status.size, offset: 0, chunks: [] }
+      } else if (download !== null) {
+        Zmodem.Browser.save_to_disk(download.chunks, download.name.replace(/^.*\//, ''))
+        term.showFlash('Downloaded ' + download.name, 1000)
+        download = null
+      }
+    } else if (status.upload !== undefined && upload !== null) {
+      if (!status.done) {
+        sendUpload(upload, 0)
+      } else {
+        term.showFlash('Uploaded ' + upload.name, 1000)
+        nextUpload()
+      }
+    }
+  }
+
+  function fileData (data) {
+    if (download !== null) {
+      // keep the views on the messages, they are only copied into the saved file
+      download.chunks.push(data)
+      download.offset += data.length
+      showTransferProgress(download, download.offset)
+    }
+  }
+
   var zsentry = new Zmodem.Sentry({
     /* eslint-disable-next-line */
     to_terminal: function _to_terminal (octets) {
-      var buffer = new Uint8Array(octets).buffer
-      term.write(textDecoder.decode(buffer))
+      writeOutput(new Uint8Array(octets))
     },
 
     /* eslint-disable-next-line */
@@ -234,43 +433,71 @@ function startTerminal () {
     term.showFlash('Connected', 500)
     term.fit()
     sendMessage('1' + JSON.stringify({ columns: term.cols, rows: term.rows }))
-    sendMessage(JSON.stringify({ AuthToken: authToken, ServicePath: service }))
+    sendMessage(JSON.stringify({ AuthToken: authToken, ServicePath: service, Handshake: true }))
     window.addEventListener('resize', resizeWindow, false)
     window.addEventListener('beforeunload', unloadHandler, false)
     term.focus()
   }
 
+  var setPreferences = function (preferences) {
+    Object.keys(preferences).forEach(function (key) {
+      console.log('Setting ' + key + ': ' + preferences[key])
+      term.setOption(key, preferences[key])
+    })
+  }
+
+  var setReconnect = function (reconnect) {
+    autoReconnect = reconnect
+    if (autoReconnect <= 0) {
+      console.log('Reconnect: disabled')
+    } else {
+      console.log('Enabling reconnect: ' + autoReconnect + ' seconds')
+    }
+  }
+
   ws.onmessage = function (event) {
     var rawData = new Uint8Array(event.data)
     var cmd = String.fromCharCode(rawData[0])
-    var data = rawData.slice(1).buffer
+    // a view on the message, the payload is not copied
+    var data = rawData.subarray(1)
     switch (cmd) {
       case '0':
-        try {
-          zsentry.consume(data)
-        } catch (e) {
-          console.error(e)
-          resetTerm()
-        }
+        consumeOutput(data)
         break
       case '1':
         title = textDecoder.decode(data)
         document.title = title
         break
       case '2':
-        var preferences = JSON.parse(textDecoder.decode(data))
-        Object.keys(preferences).forEach(function (key) {
-          console.log('Setting ' + key + ': ' + preferences[key])
-          term.setOption(key, preferences[key])
-        })
+        setPreferences(JSON.parse(textDecoder.decode(data)))
         break
       case '3':
-        autoReconnect = JSON.parse(textDecoder.decode(data))
-        if (autoReconnect <= 0) {
-          console.log('Reconnect: disabled')
-        } else {
-          console.log('Enabling reconnect: ' + autoReconnect + ' seconds')
+        setReconnect(JSON.parse(textDecoder.decode(data)))
+        break
+      case '4':
+        var handshake = JSON.parse(textDecoder.decode(data))
+        title = handshake.title
+        document.title = title
+        setReconnect(handshake.reconnect)
+        setPreferences(handshake.preferences)
+        if (handshake.files) {
+          fileActions = { upload: requestUpload, download: requestDownload }
         }
+        if (queued) {
+          queued = false
+          term.showFlash('Connected', 500)
+        }
+        break
+      case '5':
+        fileStatus(JSON.parse(textDecoder.decode(data)))
+        break
+      case '6':
+        fileData(data)
+        break
+      case '8':
+        // the server is full, the session starts when our turn comes
+        queued = true
+        term.showFlash('Waiting for a free session, position ' + textDecoder.decode(data), null)
         break
       default:
         console.log('Unknown command: ' + cmd)
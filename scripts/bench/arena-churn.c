@@ -0,0 +1,100 @@
+// Heap of session churn with the arenas of src/arena.c, with and without the chunk
+// cache of the server. Sessions are opened and closed in random order, each one
+// allocates its argument fragments and command arguments from its arena next to the
+// other buffers of a connection (receive buffer, output buffer), like a session does.
+// The RSS is sampled every 100000 sessions.
+//
+// cc -O2 -Isrc -o arena-churn scripts/bench/arena-churn.c src/arena.c && ./arena-churn
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+#define SLOTS 500
+#define SESSIONS 1000000
+#define SAMPLE 100000
+
+static long mallocs = 0;
+
+void *
+xmalloc(size_t size) {
+    mallocs++;
+    void *p = malloc(size);
+    if (p == NULL)
+        abort();
+    return p;
+}
+
+struct session {
+    struct arena arena;
+    char *buffer;
+    char *output;
+};
+
+static long
+rss_kb() {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL)
+        return -1;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = -1;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+session_open(struct session *s, struct arena_cache *cache) {
+    char arg[300];
+    arena_init(&s->arena, cache);
+    int fragments = rand() % 8;
+    for (int i = 0; i < fragments; i++) {
+        int len = 8 + rand() % 200;
+        memset(arg, 'a', len);
+        arg[len] = '\0';
+        arena_strdup(&s->arena, arg);
+    }
+    arena_alloc(&s->arena, sizeof(char *) * (2 + fragments));
+    s->buffer = malloc(1024 + rand() % 4096);
+    s->output = malloc(32768);
+    s->buffer[0] = s->output[0] = 1;
+}
+
+static void
+session_close(struct session *s) {
+    arena_free(&s->arena);
+    free(s->buffer);
+    free(s->output);
+}
+
+static void
+run(const char *name, struct arena_cache *cache) {
+    static struct session slots[SLOTS];
+    srand(1);
+    mallocs = 0;
+    for (int i = 0; i < SLOTS; i++)
+        session_open(&slots[i], cache);
+    for (long n = 1; n <= SESSIONS; n++) {
+        struct session *s = &slots[rand() % SLOTS];
+        session_close(s);
+        session_open(s, cache);
+        if (n % SAMPLE == 0)
+            printf("%-8s %8ld sessions %6ld kB rss %9ld chunk mallocs\n", name, n, rss_kb(), mallocs);
+    }
+    for (int i = 0; i < SLOTS; i++)
+        session_close(&slots[i]);
+}
+
+int
+main(int argc, char **argv) {
+    struct arena_cache cache = {NULL, 0};
+    if (argc < 2 || strcmp(argv[1], "cache") == 0)
+        run("cache", &cache);
+    if (argc < 2 || strcmp(argv[1], "nocache") == 0)
+        run("nocache", NULL);
+    arena_cache_free(&cache);
+    return 0;
+}
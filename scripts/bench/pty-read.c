@@ -0,0 +1,128 @@
+// Syscalls spent reading a pty with the strategies of the session thread, see
+// thread_run_command() in src/protocol.c:
+//
+//   select   select() before every read()
+//   filled   read() again right away only after a read that filled the buffer
+//   drain    read() until EAGAIN, select() only once the pty is drained
+//
+// The child writes a stream (64 MiB in 4K writes) or sparse output (lines with a
+// pause in between), the parent reads it into a 32K buffer like a session does.
+//
+// cc -O2 -o pty-read scripts/bench/pty-read.c -lutil && ./pty-read
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pty.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#define BUF_SIZE 32768
+
+enum strategy {
+    SELECT, FILLED, DRAIN
+};
+
+static const char *names[] = {"select", "filled", "drain"};
+
+static void
+child_stream() {
+    char buf[4096];
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < 64 * 256; i++) {
+        if (write(STDOUT_FILENO, buf, sizeof(buf)) < 0)
+            break;
+    }
+}
+
+static void
+child_sparse() {
+    char line[82];
+    memset(line, 'y', 80);
+    line[80] = '\r';
+    line[81] = '\n';
+    for (int i = 0; i < 2000; i++) {
+        if (write(STDOUT_FILENO, line, sizeof(line)) < 0)
+            break;
+        usleep(500);
+    }
+}
+
+static void
+run(enum strategy strategy, const char *mode) {
+    struct termios tio;
+    cfmakeraw(&tio);
+    int pty;
+    pid_t pid = forkpty(&pty, NULL, &tio, NULL);
+    if (pid < 0) {
+        perror("forkpty");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (strcmp(mode, "stream") == 0)
+            child_stream();
+        else
+            child_sparse();
+        _exit(0);
+    }
+
+    fcntl(pty, F_SETFL, fcntl(pty, F_GETFL) | O_NONBLOCK);
+    char *buf = malloc(BUF_SIZE);
+    long selects = 0, reads = 0, empty = 0;
+    size_t total = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int readable = 0;
+    while (1) {
+        if (!readable || strategy == SELECT) {
+            fd_set set;
+            FD_ZERO(&set);
+            FD_SET(pty, &set);
+            selects++;
+            if (select(pty + 1, &set, NULL, NULL, NULL) < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            readable = 1;
+        }
+        ssize_t n = read(pty, buf, BUF_SIZE);
+        reads++;
+        if (n < 0 && errno == EAGAIN) {
+            empty++;
+            readable = 0;
+            continue;
+        }
+        if (n <= 0)
+            break;
+        total += (size_t) n;
+        if (strategy == FILLED)
+            readable = n == BUF_SIZE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    waitpid(pid, NULL, 0);
+    close(pty);
+    free(buf);
+
+    double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    long syscalls = selects + reads;
+    printf("%-6s %-6s %10zu bytes %7ld reads (%6ld EAGAIN) %7ld selects %7ld syscalls %7.0f bytes/syscall %6.3fs\n",
+           mode, names[strategy], total, reads, empty, selects, syscalls, (double) total / (double) syscalls, elapsed);
+}
+
+int
+main(int argc, char **argv) {
+    const char *modes[] = {"stream", "sparse"};
+    for (int m = 0; m < 2; m++) {
+        if (argc > 1 && strcmp(argv[1], modes[m]) != 0)
+            continue;
+        for (int s = SELECT; s <= DRAIN; s++)
+            run((enum strategy) s, modes[m]);
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# Open and close sessions of a running ttyd in a loop and sample its memory, to
+# check that session churn does not grow the heap:
+#
+#   ttyd -p 7681 cat &
+#   scripts/churn.py --pid $! --sessions 20000 --concurrency 50 --query 'arg=x'
+#
+# Each session connects a "tty" websocket, starts the command of the service, waits
+# for its first output (or --wait seconds) and closes. VmRSS and VmHWM of the ttyd
+# process are printed every --every sessions. Only the python standard library is
+# used, the websocket framing is the minimum a client needs.
+
+import argparse
+import base64
+import json
+import os
+import select
+import socket
+import struct
+import threading
+import time
+import urllib.parse
+import urllib.request
+
+
+def memory(pid):
+    fields = {}
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            key, _, value = line.partition(':')
+            if key in ('VmRSS', 'VmHWM'):
+                fields[key] = int(value.split()[0])
+    return fields
+
+
+def socket_url(base, path):
+    with urllib.request.urlopen(urllib.parse.urljoin(base, path) + '?q=config') as r:
+        config = json.load(r)
+    return urllib.parse.urljoin(urllib.parse.urljoin(base, path), config['socketPath'])
+
+
+def frame(payload, opcode=0x2):
+    # client frames are masked
+    mask = os.urandom(4)
+    header = bytes([0x80 | opcode])
+    if len(payload) < 126:
+        header += bytes([0x80 | len(payload)])
+    else:
+        header += bytes([0x80 | 126]) + struct.pack('!H', len(payload))
+    return header + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+
+
+def session(url, query, service, token, wait):
+    u = urllib.parse.urlparse(url)
+    sock = socket.create_connection((u.hostname, u.port or 80), timeout=10)
+    try:
+        key = base64.b64encode(os.urandom(16)).decode()
+        target = u.path + ('?' + query if query else '')
+        sock.sendall(('GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+                      'Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: tty\r\n\r\n'
+                      % (target, u.netloc, key)).encode())
+        response = b''
+        while b'\r\n\r\n' not in response:
+            data = sock.recv(4096)
+            if not data:
+                return False
+            response += data
+        if not response.startswith(b'HTTP/1.1 101'):
+            return False
+        start = {'AuthToken': token, 'ServicePath': service, 'Handshake': True}
+        sock.sendall(frame(json.dumps(start).encode()))
+        # wait for the output of the command, the handshake comes first
+        deadline = time.monotonic() + wait
+        received = len(response) - response.index(b'\r\n\r\n') - 4
+        while time.monotonic() < deadline and received < 256:
+            ready, _, _ = select.select([sock], [], [], deadline - time.monotonic())
+            if not ready:
+                break
+            data = sock.recv(65536)
+            if not data:
+                break
+            received += len(data)
+        sock.sendall(frame(struct.pack('!H', 1000), 0x8))
+        return True
+    except OSError:
+        return False
+    finally:
+        sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='open and close ttyd sessions in a loop')
+    parser.add_argument('--url', default='http://127.0.0.1:7681/', help='base url of ttyd')
+    parser.add_argument('--service', default='/', help='service path')
+    parser.add_argument('--pid', type=int, required=True, help='pid of the ttyd process')
+    parser.add_argument('--sessions', type=int, default=10000, help='sessions to open')
+    parser.add_argument('--concurrency', type=int, default=20, help='sessions open at once')
+    parser.add_argument('--every', type=int, default=1000, help='sessions between two samples')
+    parser.add_argument('--wait', type=float, default=0.5, help='time to wait for the output of a session (s)')
+    parser.add_argument('--query', default='', help='query string of the websocket url (the argument fragments)')
+    parser.add_argument('--token', default='', help='base64 username:password for basic authentication')
+    args = parser.parse_args()
+
+    url = socket_url(args.url, args.service)
+    lock = threading.Lock()
+    counts = {'started': 0, 'done': 0, 'failed': 0}
+    first = memory(args.pid)
+    print('%8s %8s %10s %10s' % ('sessions', 'failed', 'VmRSS kB', 'VmHWM kB'))
+    print('%8d %8d %10d %10d' % (0, 0, first['VmRSS'], first['VmHWM']))
+
+    def worker():
+        while True:
+            with lock:
+                if counts['started'] == args.sessions:
+                    return
+                counts['started'] += 1
+            ok = session(url, args.query, args.service, args.token, args.wait)
+            with lock:
+                counts['done'] += 1
+                counts['failed'] += 0 if ok else 1
+                if counts['done'] % args.every == 0:
+                    m = memory(args.pid)
+                    print('%8d %8d %10d %10d' % (counts['done'], counts['failed'], m['VmRSS'], m['VmHWM']), flush=True)
+
+    threads = [threading.Thread(target=worker) for _ in range(args.concurrency)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    last = memory(args.pid)
+    print('VmRSS grew by %d kB over %d sessions (%d failed)' % (last['VmRSS'] - first['VmRSS'], counts['done'],
+                                                                counts['failed']))
+
+
+if __name__ == '__main__':
+    main()
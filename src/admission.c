@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <libwebsockets.h>
+
+#include "admission.h"
+#include "utils.h"
+
+static double
+now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a, the kind keeps an address and a credential with the same text apart
+static uint64_t
+hash_source(char kind, const char *str) {
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ (unsigned char) kind) * 1099511628211ULL;
+    for (; *str != '\0'; str++)
+        hash = (hash ^ (unsigned char) *str) * 1099511628211ULL;
+    return hash != 0 ? hash : 1;
+}
+
+static bool
+limit_enabled(const struct admission_limit *limit) {
+    return limit->rate > 0 || limit->max_sessions > 0;
+}
+
+void
+admission_init(struct admission *adm) {
+    if (!limit_enabled(&adm->address) && !limit_enabled(&adm->credential))
+        return;
+    adm->entries = xmalloc(ADMISSION_ENTRIES * sizeof(struct admission_entry));
+    adm->buckets = xmalloc(ADMISSION_ENTRIES * sizeof(int));
+    for (int i = 0; i < ADMISSION_ENTRIES; i++) {
+        adm->buckets[i] = -1;
+        adm->entries[i].next = i + 1 < ADMISSION_ENTRIES ? i + 1 : -1;
+    }
+    adm->free = 0;
+    adm->lru_head = adm->lru_tail = -1;
+}
+
+void
+admission_free(struct admission *adm) {
+    free(adm->entries);
+    free(adm->buckets);
+    adm->entries = NULL;
+    adm->buckets = NULL;
+}
+
+void
+admission_source_init(struct admission_source *source, const char *address, const char *credential) {
+    source->address = address != NULL && address[0] != '\0' ? hash_source('a', address) : 0;
+    source->credential = credential != NULL && credential[0] != '\0' ? hash_source('c', credential) : 0;
+}
+
+static void
+lru_unlink(struct admission *adm, int i) {
+    struct admission_entry *entry = &adm->entries[i];
+    if (entry->lru_prev >= 0)
+        adm->entries[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        adm->lru_head = entry->lru_next;
+    if (entry->lru_next >= 0)
+        adm->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        adm->lru_tail = entry->lru_prev;
+}
+
+static void
+lru_push(struct admission *adm, int i) {
+    struct admission_entry *entry = &adm->entries[i];
+    entry->lru_prev = -1;
+    entry->lru_next = adm->lru_head;
+    if (adm->lru_head >= 0)
+        adm->entries[adm->lru_head].lru_prev = i;
+    adm->lru_head = i;
+    if (adm->lru_tail < 0)
+        adm->lru_tail = i;
+}
+
+// Remove the least recently seen source without sessions, returns its entry or -1
+static int
+evict(struct admission *adm) {
+    int i = adm->lru_tail;
+    for (int n = 0; i >= 0 && adm->entries[i].sessions > 0; n++) {
+        if (n == ADMISSION_EVICT_SCAN)
+            return -1;
+        i = adm->entries[i].lru_prev;
+    }
+    if (i < 0)
+        return -1;
+
+    int *link = &adm->buckets[adm->entries[i].key % ADMISSION_ENTRIES];
+    while (*link != i)
+        link = &adm->entries[*link].next;
+    *link = adm->entries[i].next;
+    lru_unlink(adm, i);
+    adm->evicted++;
+    return i;
+}
+
+// Find the entry of a source and mark it as recently seen, add it if create is set
+static struct admission_entry *
+entry_find(struct admission *adm, uint64_t key, bool create) {
+    int bucket = (int) (key % ADMISSION_ENTRIES);
+    int i;
+    for (i = adm->buckets[bucket]; i >= 0; i = adm->entries[i].next) {
+        if (adm->entries[i].key == key)
+            break;
+    }
+    if (i >= 0) {
+        lru_unlink(adm, i);
+        lru_push(adm, i);
+        return &adm->entries[i];
+    }
+    if (!create)
+        return NULL;
+
+    if (adm->free >= 0) {
+        i = adm->free;
+        adm->free = adm->entries[i].next;
+    } else if ((i = evict(adm)) < 0) {
+        return NULL;
+    }
+    struct admission_entry *entry = &adm->entries[i];
+    entry->key = key;
+    entry->tokens = -1;
+    entry->updated = 0;
+    entry->sessions = 0;
+    entry->next = adm->buckets[bucket];
+    adm->buckets[bucket] = i;
+    lru_push(adm, i);
+    return entry;
+}
+
+static enum admission_result
+check_limit(struct admission *adm, const struct admission_limit *limit, uint64_t key, double t) {
+    if (key == 0 || !limit_enabled(limit))
+        return ADMISSION_OK;
+    struct admission_entry *entry = entry_find(adm, key, true);
+    if (entry == NULL)
+        return ADMISSION_FULL;
+    if (limit->max_sessions > 0 && entry->sessions >= limit->max_sessions)
+        return ADMISSION_CONCURRENCY;
+    if (limit->rate > 0) {
+        // a new source starts with a full bucket
+        if (entry->tokens < 0)
+            entry->tokens = limit->burst;
+        else
+            entry->tokens += (t - entry->updated) * limit->rate;
+        if (entry->tokens > limit->burst)
+            entry->tokens = limit->burst;
+        entry->updated = t;
+        if (entry->tokens < 1)
+            return ADMISSION_RATE;
+        entry->tokens -= 1;
+    }
+    return ADMISSION_OK;
+}
+
+enum admission_result
+admission_check(struct admission *adm, const struct admission_source *source) {
+    if (adm->entries == NULL)
+        return ADMISSION_OK;
+
+    double t = now();
+    enum admission_result result = check_limit(adm, &adm->address, source->address, t);
+    if (result == ADMISSION_OK)
+        result = check_limit(adm, &adm->credential, source->credential, t);
+    switch (result) {
+        case ADMISSION_OK:
+            adm->admitted++;
+            break;
+        case ADMISSION_RATE:
+            adm->refused_rate++;
+            break;
+        case ADMISSION_CONCURRENCY:
+            adm->refused_sessions++;
+            break;
+        case ADMISSION_FULL:
+            adm->refused_full++;
+            break;
+    }
+    return result;
+}
+
+static void
+count_session(struct admission *adm, const struct admission_limit *limit, uint64_t key, int delta) {
+    if (key == 0 || !limit_enabled(limit))
+        return;
+    struct admission_entry *entry = entry_find(adm, key, delta > 0);
+    if (entry != NULL && entry->sessions + delta >= 0)
+        entry->sessions += delta;
+}
+
+void
+admission_hold(struct admission *adm, const struct admission_source *source) {
+    if (adm->entries == NULL)
+        return;
+    count_session(adm, &adm->address, source->address, 1);
+    count_session(adm, &adm->credential, source->credential, 1);
+}
+
+void
+admission_release(struct admission *adm, const struct admission_source *source) {
+    if (adm->entries == NULL)
+        return;
+    count_session(adm, &adm->address, source->address, -1);
+    count_session(adm, &adm->credential, source->credential, -1);
+}
+
+void
+admission_log(struct admission *adm) {
+    if (adm->entries == NULL)
+        return;
+    lwsl_notice("admission: %llu admitted, refused: %llu rate, %llu sessions, %llu table full, %llu evicted\n",
+                (unsigned long long) adm->admitted, (unsigned long long) adm->refused_rate,
+                (unsigned long long) adm->refused_sessions, (unsigned long long) adm->refused_full,
+                (unsigned long long) adm->evicted);
+}
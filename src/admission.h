@@ -0,0 +1,88 @@
+#ifndef TTYD_ADMISSION_H
+#define TTYD_ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// sources the admission table tracks, a new source evicts the least recently seen idle one
+#define ADMISSION_ENTRIES 4096
+
+// idle entries looked at from the end of the LRU list before giving up on a new source
+#define ADMISSION_EVICT_SCAN 64
+
+enum admission_result {
+    ADMISSION_OK,
+    ADMISSION_RATE,                 // the source opens connections too fast
+    ADMISSION_CONCURRENCY,          // the source has too many sessions
+    ADMISSION_FULL                  // no room left to track the source
+};
+
+// Limits applied to each source of a kind, 0 for no limit
+struct admission_limit {
+    double rate;                    // connections per second
+    double burst;                   // connections allowed at once after an idle time
+    int max_sessions;               // sessions open at the same time
+};
+
+// A connection source: the hashes of the client address and of its credential, 0 if unknown
+struct admission_source {
+    uint64_t address;
+    uint64_t credential;
+};
+
+struct admission_entry {
+    uint64_t key;                   // hash of the source
+    double tokens;                  // connections the source may open right now
+    double updated;                 // last refill of the tokens
+    int sessions;                   // sessions of the source
+    int next;                       // next entry of the hash chain or of the free list, -1 at the end
+    int lru_prev;
+    int lru_next;
+};
+
+// Per source connection rate (token buckets) and session limits. The entries are kept in
+// a fixed size hash table with LRU eviction, a source with sessions is never evicted.
+// It is not thread safe, it is only used from the service thread.
+struct admission {
+    struct admission_limit address;
+    struct admission_limit credential;
+    struct admission_entry *entries;  // NULL when no limit is set
+    int *buckets;
+    int free;
+    int lru_head;                     // most recently seen
+    int lru_tail;                     // least recently seen
+
+    uint64_t admitted;
+    uint64_t refused_rate;
+    uint64_t refused_sessions;
+    uint64_t refused_full;
+    uint64_t evicted;
+};
+
+// Allocate the table if a limit is set
+void
+admission_init(struct admission *adm);
+
+void
+admission_free(struct admission *adm);
+
+// Hash the address and the credential, any of them may be NULL
+void
+admission_source_init(struct admission_source *source, const char *address, const char *credential);
+
+// Check a new connection of the source against the limits, it takes a token from the buckets
+enum admission_result
+admission_check(struct admission *adm, const struct admission_source *source);
+
+// Count a session of the source, until it is released
+void
+admission_hold(struct admission *adm, const struct admission_source *source);
+
+void
+admission_release(struct admission *adm, const struct admission_source *source);
+
+// Log the counters
+void
+admission_log(struct admission *adm);
+
+#endif //TTYD_ADMISSION_H
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utils.h"
+
+#define ARENA_CHUNK_SIZE 2048
+#define ARENA_ALIGN sizeof(void *)
+
+// chunks of the default size kept by a cache
+#define ARENA_CACHE_MAX 64
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static struct arena_chunk *
+chunk_new(struct arena_cache *cache, size_t size) {
+    struct arena_chunk *chunk;
+    if (size == ARENA_CHUNK_SIZE && cache != NULL && cache->chunks != NULL) {
+        chunk = cache->chunks;
+        cache->chunks = chunk->next;
+        cache->len--;
+    } else {
+        chunk = xmalloc(sizeof(struct arena_chunk) + size);
+        chunk->size = size;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    return chunk;
+}
+
+void
+arena_init(struct arena *arena, struct arena_cache *cache) {
+    arena->head = NULL;
+    arena->cache = cache;
+}
+
+void *
+arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    struct arena_chunk *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        chunk = chunk_new(arena->cache, size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+void
+arena_free(struct arena *arena) {
+    struct arena_cache *cache = arena->cache;
+    while (arena->head != NULL) {
+        struct arena_chunk *chunk = arena->head;
+        arena->head = chunk->next;
+        if (chunk->size == ARENA_CHUNK_SIZE && cache != NULL && cache->len < ARENA_CACHE_MAX) {
+            chunk->next = cache->chunks;
+            cache->chunks = chunk;
+            cache->len++;
+        } else {
+            free(chunk);
+        }
+    }
+}
+
+void
+arena_cache_free(struct arena_cache *cache) {
+    while (cache->chunks != NULL) {
+        struct arena_chunk *chunk = cache->chunks;
+        cache->chunks = chunk->next;
+        free(chunk);
+    }
+    cache->len = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef TTYD_ARENA_H
+#define TTYD_ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+// Chunks released by the arenas of a server, kept for its next sessions
+struct arena_cache {
+    struct arena_chunk *chunks;
+    int len;
+};
+
+// A bump allocator for the small allocations of a session (argument fragments,
+// command arguments...), everything is released at once with arena_free.
+// It is not thread safe, an arena and its chunk cache are only used from the
+// lws service thread of their server.
+struct arena {
+    struct arena_chunk *head;
+    struct arena_cache *cache;                // NULL to free the chunks
+};
+
+// Initialize an empty arena taking its chunks from cache
+void
+arena_init(struct arena *arena, struct arena_cache *cache);
+
+// Allocate size bytes from the arena, aligned for pointers
+void *
+arena_alloc(struct arena *arena, size_t size);
+
+// Copy a string into the arena
+char *
+arena_strdup(struct arena *arena, const char *str);
+
+// Release all the memory of the arena, the arena can be used again afterwards
+void
+arena_free(struct arena *arena);
+
+// Free the chunks of a cache
+void
+arena_cache_free(struct arena_cache *cache);
+
+#endif //TTYD_ARENA_H
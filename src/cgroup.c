@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "cgroup.h"
+#include "utils.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_CONTROLLERS "+cpu +memory +pids"
+
+// ttyd moves itself from its cgroup into "<cgroup>/ttyd", the sessions are
+// created under "<cgroup>/sessions", cgroup v2 only allows controllers to be
+// enabled for the children of a cgroup without processes. The sessions of the
+// services without limits share "sessions/.default", a name no service maps to.
+// The cgroup of a process is process-wide, so is this state.
+static char sessions_dir[1024];
+static char default_dir[1100];
+static bool cgroup_ready = false;
+static pthread_mutex_t cgroup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int session_count = 0;
+
+static int
+write_file(const char *dir, const char *file, const char *value) {
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n == (ssize_t) strlen(value) ? 0 : -1;
+}
+
+static int
+make_dir(const char *dir) {
+    return mkdir(dir, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+int
+cgroup_setup() {
+    char line[1024], base[1024], dir[1100];
+    if (__atomic_load_n(&cgroup_ready, __ATOMIC_ACQUIRE))
+        return 0;
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        lwsl_err("cgroup: can not open /proc/self/cgroup: %s\n", strerror(errno));
+        return -1;
+    }
+    base[0] = '\0';
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        // the cgroup v2 hierarchy is the "0::<path>" line
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(base, sizeof(base), "%s%s", CGROUP_ROOT, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+            break;
+        }
+    }
+    fclose(fp);
+    if (base[0] == '\0') {
+        lwsl_err("cgroup: no cgroup v2 hierarchy found\n");
+        return -1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/ttyd", base);
+    if (make_dir(dir) != 0 || write_file(dir, "cgroup.procs", "0") != 0) {
+        lwsl_err("cgroup: can not move ttyd to %s: %s, is the cgroup delegated?\n", dir, strerror(errno));
+        return -1;
+    }
+    if (write_file(base, "cgroup.subtree_control", CGROUP_CONTROLLERS) != 0) {
+        lwsl_err("cgroup: can not enable the controllers in %s: %s\n", base, strerror(errno));
+        return -1;
+    }
+    // the sessions share the cpu with ttyd at a tenth of its weight
+    if (write_file(dir, "cpu.weight", "1000") != 0)
+        lwsl_warn("cgroup: can not set the cpu weight of %s: %s\n", dir, strerror(errno));
+    snprintf(sessions_dir, sizeof(sessions_dir), "%s/sessions", base);
+    if (make_dir(sessions_dir) != 0 || write_file(sessions_dir, "cgroup.subtree_control", CGROUP_CONTROLLERS) != 0) {
+        lwsl_err("cgroup: can not create %s: %s\n", sessions_dir, strerror(errno));
+        return -1;
+    }
+    snprintf(default_dir, sizeof(default_dir), "%s/.default", sessions_dir);
+    if (make_dir(default_dir) != 0) {
+        lwsl_err("cgroup: can not create %s: %s\n", default_dir, strerror(errno));
+        return -1;
+    }
+    lwsl_notice("cgroup: sessions are created under %s\n", sessions_dir);
+    // the pty threads of the sessions starting meanwhile read it
+    __atomic_store_n(&cgroup_ready, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+struct cgroup_config *
+cgroup_config_parse(struct json_object *obj, const char *path) {
+    struct json_object *o = NULL;
+    if (!json_object_is_type(obj, json_type_object)) {
+        fprintf(stderr, "ttyd: invalid cgroup option for service: %s\n", path);
+        return NULL;
+    }
+    struct cgroup_config *config = xmalloc(sizeof(struct cgroup_config));
+    memset(config, 0, sizeof(struct cgroup_config));
+
+    // "/" is the "root" cgroup, "/a/b/" is "a-b"
+    char *name = xmalloc(strlen(path) + 5);
+    char *ptr = name;
+    for (const char *c = path; *c != '\0'; c++) {
+        if (*c == '/') {
+            if (ptr != name && ptr[-1] != '-')
+                *ptr++ = '-';
+        } else if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_') {
+            *ptr++ = *c;
+        }
+    }
+    if (ptr != name && ptr[-1] == '-')
+        ptr--;
+    *ptr = '\0';
+    if (name[0] == '\0')
+        strcpy(name, "root");
+    config->name = name;
+
+    if (json_object_object_get_ex(obj, "per", &o)) {
+        const char *per = json_object_get_string(o);
+        if (per != NULL && !strcmp(per, "session")) {
+            config->per_session = true;
+        } else if (per == NULL || strcmp(per, "service") != 0) {
+            fprintf(stderr, "ttyd: invalid cgroup per option for service: %s, it must be session or service\n", path);
+            cgroup_config_free(config);
+            return NULL;
+        }
+    }
+    if (json_object_object_get_ex(obj, "cpu.max", &o))
+        config->cpu_max = strdup(json_object_get_string(o));
+    if (json_object_object_get_ex(obj, "memory.max", &o))
+        config->memory_max = strdup(json_object_get_string(o));
+    if (json_object_object_get_ex(obj, "pids.max", &o))
+        config->pids_max = strdup(json_object_get_string(o));
+
+    return config;
+}
+
+void
+cgroup_config_free(struct cgroup_config *config) {
+    if (config == NULL)
+        return;
+    free(config->name);
+    free(config->cpu_max);
+    free(config->memory_max);
+    free(config->pids_max);
+    free(config);
+}
+
+char *
+cgroup_create(const struct cgroup_config *config) {
+    char dir[1200];
+
+    if (!__atomic_load_n(&cgroup_ready, __ATOMIC_ACQUIRE))
+        return NULL;
+    if (config == NULL)
+        return strdup(default_dir);
+
+    if (config->per_session) {
+        pthread_mutex_lock(&cgroup_mutex);
+        unsigned int id = ++session_count;
+        pthread_mutex_unlock(&cgroup_mutex);
+        snprintf(dir, sizeof(dir), "%s/%s.%u", sessions_dir, config->name, id);
+    } else {
+        snprintf(dir, sizeof(dir), "%s/%s", sessions_dir, config->name);
+    }
+    if (make_dir(dir) != 0) {
+        lwsl_err("cgroup: can not create %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    const char *files[] = {"cpu.max", "memory.max", "pids.max"};
+    const char *values[] = {config->cpu_max, config->memory_max, config->pids_max};
+    for (int i = 0; i < 3; i++) {
+        if (values[i] != NULL && write_file(dir, files[i], values[i]) != 0) {
+            lwsl_err("cgroup: can not set %s to %s in %s: %s\n", files[i], values[i], dir, strerror(errno));
+            if (config->per_session)
+                rmdir(dir);
+            return NULL;
+        }
+    }
+
+    return strdup(dir);
+}
+
+int
+cgroup_enter(const char *cgroup) {
+    char path[1200];
+    size_t len = strlen(cgroup);
+    if (len + sizeof("/cgroup.procs") > sizeof(path))
+        return -1;
+    memcpy(path, cgroup, len);
+    memcpy(path + len, "/cgroup.procs", sizeof("/cgroup.procs"));
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = write(fd, "0", 1);
+    close(fd);
+    return n == 1 ? 0 : -1;
+}
+
+// Retry to remove a cgroup until the killed processes have left it
+static void *
+cgroup_remove_thread(void *arg) {
+    char *cgroup = arg;
+    int i;
+    for (i = 0; i < 10; i++) {
+        struct timespec delay = {0, 10 * 1000 * 1000};
+        nanosleep(&delay, NULL);
+        if (rmdir(cgroup) == 0 || errno != EBUSY)
+            break;
+    }
+    if (i == 10)
+        lwsl_warn("cgroup: can not remove %s: %s\n", cgroup, strerror(errno));
+    free(cgroup);
+    return NULL;
+}
+
+void
+cgroup_remove(const char *cgroup) {
+    // cgroup.kill needs linux 5.14, the background processes of the session are left otherwise
+    write_file(cgroup, "cgroup.kill", "1");
+    if (rmdir(cgroup) == 0 || errno != EBUSY)
+        return;
+    // the killed processes leave the cgroup asynchronously, wait for them on a thread
+    // of its own rather than on the caller (the lws service thread)
+    char *dir = strdup(cgroup);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, cgroup_remove_thread, dir);
+    if (err != 0) {
+        lwsl_warn("cgroup: can not remove %s: %s\n", cgroup, strerror(err));
+        free(dir);
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,49 @@
+#ifndef TTYD_CGROUP_H
+#define TTYD_CGROUP_H
+
+#include <stdbool.h>
+
+struct cgroup_config {
+    char *name;                 // cgroup name of the service
+    bool per_session;           // one cgroup per session instead of one per service
+    char *cpu_max;              // value of cpu.max, NULL to keep the default
+    char *memory_max;           // value of memory.max
+    char *pids_max;             // value of pids.max
+};
+
+struct json_object;
+
+// Parse the "cgroup" option of a service, the object holds the "cpu.max",
+// "memory.max" and "pids.max" limits and "per": "session" or "service"
+struct cgroup_config *
+cgroup_config_parse(struct json_object *obj, const char *path);
+
+// Free the cgroup config
+void
+cgroup_config_free(struct cgroup_config *config);
+
+// Move ttyd into its own leaf cgroup so the sessions can not starve it and create the
+// cgroup of the sessions, before the first session of a service with a cgroup option:
+// the controllers can not be enabled once sessions run in the cgroup of ttyd. Does
+// nothing once it succeeded, returns -1 on failure.
+int
+cgroup_setup();
+
+// Create (or reuse, for a per service cgroup) the cgroup of a session and apply the
+// limits, returns the cgroup directory or NULL on failure. Once cgroup_setup() is done
+// every session gets a cgroup, with a NULL config the one shared by the sessions of the
+// services without limits, and NULL is returned before.
+char *
+cgroup_create(const struct cgroup_config *config);
+
+// Move the calling process into the cgroup, only async-signal-safe calls are made so
+// it can be used between fork and exec
+int
+cgroup_enter(const char *cgroup);
+
+// Kill the processes left in a session cgroup and remove it, the removal is retried on
+// a thread of its own until they are gone
+void
+cgroup_remove(const char *cgroup);
+
+#endif //TTYD_CGROUP_H
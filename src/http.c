@@ -1,12 +1,31 @@
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
 #include <libwebsockets.h>
 #include <json.h>
 
 #include "server.h"
 #include "html.h"
+#include "utils.h"
+#include "log.h"
+#include "resolve.h"
+
+// the script tag of the built-in index.html replaced by the inline bootstrap script
+#define AUTH_TOKEN_SCRIPT "<script src=\"auth_token.js\"></script>"
+
+// The built-in page of a service path with the auth token and the websocket config
+// inlined, so the client connects without fetching auth_token.js and ?q=config first.
+// The page only depends on the path and the credential, it stays valid across reloads.
+struct service_page {
+    char *path;
+    char *html;
+    size_t len;
+    LIST_ENTRY(service_page) list;
+};
 
 int
-check_auth(struct lws *wsi) {
+check_auth(struct lws *wsi, struct tty_server *server) {
     if (server->credential == NULL)
         return 0;
 
@@ -97,25 +116,114 @@ get_ws_relative_path(const char *from, char *buf) {
     strcat(buf, WS_PATH);
 }
 
+const struct service_page *
+get_service_page(struct tty_server *server, const char *path) {
+    struct service_page *page;
+    LIST_FOREACH(page, &server->service_pages, list) {
+        if (strcmp(page->path, path) == 0)
+            return page;
+    }
+
+    const char *html = (const char *) index_html;
+    const char *marker = memmem(html, index_html_len, AUTH_TOKEN_SCRIPT, strlen(AUTH_TOKEN_SCRIPT));
+    if (marker == NULL)
+        return NULL;
+
+    char ws_path[512];
+    get_ws_relative_path(path, ws_path);
+    struct json_object *config = json_object_new_object();
+    json_object_object_add(config, "socketPath", json_object_new_string(ws_path));
+    json_object_object_add(config, "service", json_object_new_string(path));
+    // json-c escapes '/', the config can not close the script tag
+    const char *config_json = json_object_to_json_string(config);
+    const char *token = server->credential != NULL ? server->credential : "";
+
+    size_t script_len = strlen(config_json) + strlen(token) + 96;
+    char *script = xmalloc(script_len);
+    if (server->credential != NULL)
+        script_len = (size_t) snprintf(script, script_len, "<script>var tty_auth_token='%s';var tty_config=%s;</script>", token, config_json);
+    else
+        script_len = (size_t) snprintf(script, script_len, "<script>var tty_config=%s;</script>", config_json);
+    json_object_put(config);
+
+    size_t prefix_len = marker - html;
+    size_t suffix_len = index_html_len - prefix_len - strlen(AUTH_TOKEN_SCRIPT);
+    page = xmalloc(sizeof(struct service_page));
+    page->path = strdup(path);
+    page->len = prefix_len + script_len + suffix_len;
+    page->html = xmalloc(page->len);
+    memcpy(page->html, html, prefix_len);
+    memcpy(page->html + prefix_len, script, script_len);
+    memcpy(page->html + prefix_len + script_len, marker + strlen(AUTH_TOKEN_SCRIPT), suffix_len);
+    free(script);
+    LIST_INSERT_HEAD(&server->service_pages, page, list);
+
+    return page;
+}
+
+void
+service_pages_free(struct tty_server *server) {
+    while (!LIST_EMPTY(&server->service_pages)) {
+        struct service_page *page = LIST_FIRST(&server->service_pages);
+        LIST_REMOVE(page, list);
+        free(page->path);
+        free(page->html);
+        free(page);
+    }
+}
+
+// Copy the request path: an HTTP/1.1 request has it in the request line, an HTTP/2
+// one (websockets over HTTP/2 included, RFC 8441) in the :path pseudo header
+int
+request_path(struct lws *wsi, char *buf, int len) {
+    int n = lws_hdr_copy(wsi, buf, len, WSI_TOKEN_GET_URI);
+#if LWS_LIBRARY_VERSION_MAJOR >= 3 && defined(LWS_WITH_HTTP2)
+    if (n <= 0)
+        n = lws_hdr_copy(wsi, buf, len, WSI_TOKEN_HTTP_COLON_PATH);
+#endif
+    return n;
+}
+
+// Whether the request is a GET, HTTP/2 carries the method in the :method pseudo header
+static bool
+is_get_request(struct lws *wsi) {
+    if (lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI) > 0)
+        return true;
+#if LWS_LIBRARY_VERSION_MAJOR >= 3 && defined(LWS_WITH_HTTP2)
+    char method[8];
+    return lws_hdr_copy(wsi, method, sizeof(method), WSI_TOKEN_HTTP_COLON_METHOD) > 0 && strcmp(method, "GET") == 0;
+#else
+    return false;
+#endif
+}
+
 int
 callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
     struct pss_http *pss = (struct pss_http *) user;
+    struct tty_server *server = wsi_server(wsi);
     unsigned char buffer[4096 + LWS_PRE], *p, *end;
-    char buf[256], name[100], rip[50];
+    char buf[256], rip[50], hostname[100];
 
     switch (reason) {
         case LWS_CALLBACK_HTTP:
             // only GET method is allowed
-            if (!lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI) || len < 1) {
+            if (!is_get_request(wsi) || len < 1) {
                 lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL);
                 goto try_to_reuse;
             }
 
             snprintf(pss->path, sizeof(pss->path), "%s", (const char *)in);
+            // the address only, a reverse lookup would hold the service thread for every request
+#if LWS_LIBRARY_VERSION_MAJOR >= 2
+            lws_get_peer_simple(wsi, rip, sizeof(rip));
+#else
+            char name[100];
             lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi), name, sizeof(name), rip, sizeof(rip));
-            lwsl_notice("HTTP %s - %s (%s)\n", (char *) in, rip, name);
+#endif
+            log_event(LLL_NOTICE, &server->http_rate, "http", "path=%s address=%s hostname=%s", (const char *) in, rip,
+                      resolver_lookup(rip, hostname, sizeof(hostname)) ? hostname : NULL);
 
-            switch (check_auth(wsi)) {
+            switch (check_auth(wsi, server)) {
                 case 0:
                     break;
                 case -1:
@@ -130,7 +238,7 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
 
             struct service_t *service;
             int found = 1;
-            LIST_FOREACH(service, &server->services, list) {
+            LIST_FOREACH(service, &server->services->list, list) {
                 found = auth_token_url_match(service->path, pss->path);
                 if (found == 0)
                     break;
@@ -159,13 +267,14 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
 #else
                 pss->buffer = pss->ptr = strdup(buf);
                 pss->len = n;
+                pss->owned = true;
                 lws_callback_on_writable(wsi);
                 return 0;
 #endif
             }
 
             found = 1;
-            LIST_FOREACH(service, &server->services, list) {
+            LIST_FOREACH(service, &server->services->list, list) {
                 found = strcmp(service->path, pss->path);
                 if (found == 0)
                     break;
@@ -207,6 +316,7 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
 #else
                     pss->buffer = pss->ptr = strdup(buf);
                     pss->len = n;
+                    pss->owned = true;
                     lws_callback_on_writable(wsi);
                     return 0;
 #endif
@@ -219,23 +329,31 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                 if (n < 0 || (n > 0 && lws_http_transaction_completed(wsi)))
                     return 1;
             } else {
+                const char *html = (const char *) index_html;
+                size_t html_len = index_html_len;
+                const struct service_page *page = get_service_page(server, pss->path);
+                if (page != NULL) {
+                    html = page->html;
+                    html_len = page->len;
+                }
                 if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end))
                     return 1;
                 if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *) content_type, 9, &p, end))
                     return 1;
-                if (lws_add_http_header_content_length(wsi, (unsigned long) index_html_len, &p, end))
+                if (lws_add_http_header_content_length(wsi, (unsigned long) html_len, &p, end))
                     return 1;
                 if (lws_finalize_http_header(wsi, &p, end))
                     return 1;
                 if (lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
                     return 1;
 #if LWS_LIBRARY_VERSION_MAJOR < 3
-                if (lws_write_http(wsi, index_html, index_html_len) < 0)
+                if (lws_write_http(wsi, html, html_len) < 0)
                     return 1;
                 goto try_to_reuse;
 #else
-                pss->buffer = pss->ptr = (char *) index_html;
-                pss->len = index_html_len;
+                pss->buffer = pss->ptr = (char *) html;
+                pss->len = html_len;
+                pss->owned = false;
                 lws_callback_on_writable(wsi);
                 return 0;
 #endif
@@ -247,7 +365,7 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                 goto try_to_reuse;
 
             if (pss ->ptr - pss->buffer == pss->len) {
-                if (pss->buffer != (char *) index_html) free(pss->buffer);
+                if (pss->owned) free(pss->buffer);
                 goto try_to_reuse;
             }
 
@@ -256,8 +374,10 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                 n = (int) (pss->len - (pss->ptr - pss->buffer));
             memcpy(buffer + LWS_PRE, pss->ptr, n);
             pss->ptr += n;
-            if (lws_write_http(wsi, buffer + LWS_PRE, (size_t) n) < n) {
-                if (pss->buffer != (char *) index_html) free(pss->buffer);
+            // the last write ends the stream of an HTTP/2 request
+            enum lws_write_protocol wp = pss->ptr - pss->buffer == pss->len ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP;
+            if (lws_write(wsi, buffer + LWS_PRE, (size_t) n, wp) < n) {
+                if (pss->owned) free(pss->buffer);
                 return -1;
             }
 
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libwebsockets.h>
+
+#include "log.h"
+#include "utils.h"
+
+// microseconds the writer sleeps when the ring is empty
+#define LOG_IDLE_WAIT 10000
+
+struct log_slot {
+    uint64_t seq;                   // position + 1 once the slot is filled, + LOG_RING_SIZE once written
+    int level;
+    bool fields;                    // text holds the fields of an event, JSON members in JSON mode
+    struct timespec time;
+    char text[LOG_LINE_MAX];
+};
+
+// A bounded multi producer, single consumer queue: producers claim a position with a
+// compare and swap on head and publish the slot through its sequence number, the
+// writer thread owns tail.
+static struct {
+    struct log_slot *slots;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    int level;
+    bool json;
+    bool running;
+    bool stop;
+    pthread_t thread;
+} ring = {.level = LLL_ERR | LLL_WARN | LLL_NOTICE};
+
+static const char *level_names[] = {
+        "ERR", "WARN", "NOTICE", "INFO", "DEBUG", "PARSER", "HEADER", "EXT", "CLIENT", "LATENCY", "USER"
+};
+
+static const char *
+level_name(int level) {
+    for (int i = 0; i < (int) (sizeof(level_names) / sizeof(level_names[0])); i++) {
+        if (level & (1 << i))
+            return level_names[i];
+    }
+    return "LOG";
+}
+
+// Append to a fixed size buffer, what does not fit is cut
+struct appender {
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+static void
+append(struct appender *a, const char *str, size_t len) {
+    if (a->len + len >= a->size)
+        len = a->size - a->len - 1;
+    memcpy(a->buf + a->len, str, len);
+    a->len += len;
+    a->buf[a->len] = '\0';
+}
+
+static void
+append_str(struct appender *a, const char *str) {
+    append(a, str, strlen(str));
+}
+
+static void
+append_json_string(struct appender *a, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    append(a, "\"", 1);
+    for (const char *p = str; *p != '\0'; p++) {
+        unsigned char c = (unsigned char) *p;
+        if (c == '"' || c == '\\') {
+            char escaped[2] = {'\\', (char) c};
+            append(a, escaped, 2);
+        } else if (c < 0x20) {
+            char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            append(a, escaped, 6);
+        } else {
+            append(a, p, 1);
+        }
+    }
+    append(a, "\"", 1);
+}
+
+// Render the fields of an event, see log_event
+static void
+render_fields(struct appender *a, const char *event, const char *fmt, va_list ap) {
+    if (ring.json) {
+        append_str(a, "\"event\":");
+        append_json_string(a, event);
+    } else {
+        append_str(a, event);
+    }
+
+    const char *p = fmt;
+    while (*p != '\0') {
+        while (*p == ' ')
+            p++;
+        const char *key = p;
+        const char *conv = strchr(p, '%');
+        if (conv == NULL || conv[1] == '\0')
+            break;
+        size_t key_len = (size_t) (conv - key) - (conv > key && conv[-1] == '=' ? 1 : 0);
+
+        char number[24];
+        const char *str = number;
+        bool quoted = true;
+        switch (conv[1]) {
+            case 's':
+                str = va_arg(ap, const char *);
+                // a field without value is left out
+                if (str == NULL) {
+                    p = conv + 2;
+                    continue;
+                }
+                break;
+            case 'd':
+                snprintf(number, sizeof(number), "%d", va_arg(ap, int));
+                quoted = false;
+                break;
+            case 'u':
+                snprintf(number, sizeof(number), "%u", va_arg(ap, unsigned int));
+                quoted = false;
+                break;
+            default:
+                number[0] = '\0';
+                break;
+        }
+
+        if (ring.json) {
+            append(a, ",", 1);
+            append(a, "\"", 1);
+            append(a, key, key_len);
+            append(a, "\":", 2);
+            if (quoted)
+                append_json_string(a, str);
+            else
+                append_str(a, str);
+        } else {
+            append(a, " ", 1);
+            append(a, key, key_len);
+            append(a, "=", 1);
+            // quote the values a reader could not split on spaces
+            if (quoted && (*str == '\0' || strpbrk(str, " \"=") != NULL))
+                append_json_string(a, str);
+            else
+                append_str(a, str);
+        }
+        p = conv + 2;
+    }
+}
+
+// Format a slot as a line of the output, returns its length
+static size_t
+format_line(const struct log_slot *slot, char *buf, size_t size) {
+    struct appender a = {buf, size, 0};
+    struct tm tm;
+    char stamp[40];
+    localtime_r(&slot->time.tv_sec, &tm);
+    int ms = (int) (slot->time.tv_nsec / 1000000);
+
+    if (ring.json) {
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        append_str(&a, "{\"time\":\"");
+        append_str(&a, stamp);
+        snprintf(stamp, sizeof(stamp), ".%03d\",\"level\":\"", ms);
+        append_str(&a, stamp);
+        append_str(&a, level_name(slot->level));
+        append_str(&a, "\",");
+        if (slot->fields) {
+            append_str(&a, slot->text);
+        } else {
+            append_str(&a, "\"msg\":");
+            append_json_string(&a, slot->text);
+        }
+        // keep room for the end of the line
+        if (a.len + 3 > a.size)
+            a.len = a.size - 3;
+        append_str(&a, "}\n");
+    } else {
+        strftime(stamp, sizeof(stamp), "[%Y/%m/%d %H:%M:%S", &tm);
+        append_str(&a, stamp);
+        snprintf(stamp, sizeof(stamp), ":%03d] %s: ", ms, level_name(slot->level));
+        append_str(&a, stamp);
+        append_str(&a, slot->text);
+        if (a.len + 2 > a.size)
+            a.len = a.size - 2;
+        append_str(&a, "\n");
+    }
+    return a.len;
+}
+
+static void
+write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+}
+
+// Claim the next slot, NULL when the ring is full
+static struct log_slot *
+slot_claim(uint64_t *pos) {
+    uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    for (;;) {
+        struct log_slot *slot = &ring.slots[head % LOG_RING_SIZE];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t) (seq - head);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring.head, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = head;
+                return slot;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void
+slot_publish(struct log_slot *slot, uint64_t pos) {
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Write the slot out right away, before the writer thread is started or once it is stopped
+static void
+slot_write(const struct log_slot *slot) {
+    char line[LOG_LINE_MAX * 2];
+    write_all(line, format_line(slot, line, sizeof(line)));
+}
+
+void *
+log_thread(void *args) {
+    char batch[16384];
+    char line[LOG_LINE_MAX * 2];
+    uint64_t dropped = 0;
+
+    for (;;) {
+        size_t len = 0;
+        bool stop = __atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE);
+        for (;;) {
+            struct log_slot *slot = &ring.slots[ring.tail % LOG_RING_SIZE];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring.tail + 1)
+                break;
+            size_t n = format_line(slot, line, sizeof(line));
+            __atomic_store_n(&slot->seq, ring.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            ring.tail++;
+            if (len + n > sizeof(batch)) {
+                write_all(batch, len);
+                len = 0;
+            }
+            memcpy(batch + len, line, n);
+            len += n;
+        }
+        uint64_t total = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+        if (total != dropped) {
+            struct log_slot slot = {.level = LLL_WARN, .fields = false};
+            clock_gettime(CLOCK_REALTIME, &slot.time);
+            snprintf(slot.text, sizeof(slot.text), "%llu log lines dropped, the log ring was full",
+                     (unsigned long long) (total - dropped));
+            dropped = total;
+            size_t n = format_line(&slot, line, sizeof(line));
+            if (len + n > sizeof(batch)) {
+                write_all(batch, len);
+                len = 0;
+            }
+            memcpy(batch + len, line, n);
+            len += n;
+        }
+        if (len > 0)
+            write_all(batch, len);
+        else if (stop)
+            break;
+        else
+            usleep(LOG_IDLE_WAIT);
+    }
+    return NULL;
+}
+
+void
+log_init(int level, bool json) {
+    ring.level = level;
+    ring.json = json;
+    ring.slots = xmalloc(LOG_RING_SIZE * sizeof(struct log_slot));
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+        ring.slots[i].seq = i;
+    ring.head = ring.tail = 0;
+    ring.stop = false;
+    lws_set_log_level(level, log_emit);
+    if (pthread_create(&ring.thread, NULL, log_thread, NULL) != 0) {
+        lwsl_err("log thread: %d (%s), logging synchronously\n", errno, strerror(errno));
+        return;
+    }
+    __atomic_store_n(&ring.running, true, __ATOMIC_RELEASE);
+}
+
+void
+log_close() {
+    if (!__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&ring.stop, true, __ATOMIC_RELEASE);
+    pthread_join(ring.thread, NULL);
+    __atomic_store_n(&ring.running, false, __ATOMIC_RELEASE);
+    free(ring.slots);
+    ring.slots = NULL;
+}
+
+void
+log_emit(int level, const char *line) {
+    struct log_slot local, *slot = &local;
+    uint64_t pos = 0;
+    bool running = __atomic_load_n(&ring.running, __ATOMIC_ACQUIRE);
+    if (running && (slot = slot_claim(&pos)) == NULL)
+        return;
+
+    slot->level = level;
+    slot->fields = false;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    size_t len = strlen(line);
+    while (len > 0 && line[len - 1] == '\n')
+        len--;
+    if (len >= sizeof(slot->text))
+        len = sizeof(slot->text) - 1;
+    memcpy(slot->text, line, len);
+    slot->text[len] = '\0';
+
+    if (running)
+        slot_publish(slot, pos);
+    else
+        slot_write(slot);
+}
+
+// Whether a sampled event is to be logged, at most LOG_SAMPLE_RATE per second
+static bool
+log_sample(struct log_rate *rate) {
+    uint64_t now = time_monotonic();
+    if (now != rate->second) {
+        rate->second = now;
+        rate->count = 0;
+    }
+    if (rate->count >= LOG_SAMPLE_RATE) {
+        rate->suppressed++;
+        return false;
+    }
+    rate->count++;
+    return true;
+}
+
+void
+log_event(int level, struct log_rate *rate, const char *event, const char *fmt, ...) {
+    if (!(level & ring.level))
+        return;
+    if (rate != NULL && !log_sample(rate))
+        return;
+
+    struct log_slot local, *slot = &local;
+    uint64_t pos = 0;
+    bool running = __atomic_load_n(&ring.running, __ATOMIC_ACQUIRE);
+    if (running && (slot = slot_claim(&pos)) == NULL)
+        return;
+
+    slot->level = level;
+    slot->fields = ring.json;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    struct appender a = {slot->text, sizeof(slot->text), 0};
+    va_list ap;
+    va_start(ap, fmt);
+    render_fields(&a, event, fmt, ap);
+    va_end(ap);
+    if (rate != NULL && rate->suppressed > 0) {
+        char suppressed[48];
+        snprintf(suppressed, sizeof(suppressed), ring.json ? ",\"suppressed\":%d" : " suppressed=%d",
+                 rate->suppressed);
+        append_str(&a, suppressed);
+        rate->suppressed = 0;
+    }
+
+    if (running)
+        slot_publish(slot, pos);
+    else
+        slot_write(slot);
+}
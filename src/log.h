@@ -0,0 +1,43 @@
+#ifndef TTYD_LOG_H
+#define TTYD_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// lines the log ring holds, a line logged while it is full is dropped and counted
+#define LOG_RING_SIZE 1024
+
+// longest log line, a longer one is cut
+#define LOG_LINE_MAX 512
+
+// events a sampled call site logs per second, the others are only counted
+#define LOG_SAMPLE_RATE 20
+
+// Sampling state of a frequent event (or of a few related ones), only used from the service thread
+struct log_rate {
+    uint64_t second;
+    int count;
+    int suppressed;                 // events not logged since the last one
+};
+
+// Route the libwebsockets log into a lock-free ring, written out by a thread of its own
+// as text lines or as JSON lines. Logging never waits for the output.
+void
+log_init(int level, bool json);
+
+// Write the lines left in the ring and stop the thread, later lines are written directly
+void
+log_close();
+
+// Log function given to libwebsockets
+void
+log_emit(int level, const char *line);
+
+// Log an event with structured fields: fmt is a list of key=%s, key=%d or key=%u separated
+// by spaces, written as "event key=value ..." or as the members of a JSON object; a NULL
+// string leaves its field out.
+// With a rate, the event is sampled and the next one logged tells how many were not.
+void
+log_event(int level, struct log_rate *rate, const char *event, const char *fmt, ...);
+
+#endif //TTYD_LOG_H
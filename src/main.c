@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LWS_CONFIG_H
+#include "lws_config.h"
+#endif
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "ttyd.h"
+#include "utils.h"
+#include "log.h"
+#include "resolve.h"
+
+#ifndef TTYD_VERSION
+#define TTYD_VERSION "unknown"
+#endif
+
+// the ttyd program is a server of libttyd listening on its own context
+static struct tty_server *server;
+
+// websocket extensions
+static const struct lws_extension extensions[] = {
+        {"permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate"},
+        {"deflate-frame",      lws_extension_callback_pm_deflate, "deflate_frame"},
+        {NULL, NULL, NULL}
+};
+
+// long only options
+enum {
+    OPT_COALESCE = 256,
+    OPT_IP_RATE,
+    OPT_IP_MAX_SESSIONS,
+    OPT_CREDENTIAL_RATE,
+    OPT_CREDENTIAL_MAX_SESSIONS,
+    OPT_MAX_QUEUE,
+    OPT_LOG_FORMAT,
+    OPT_RESOLVE_HOSTS
+};
+
+// command line options
+static const struct option options[] = {
+        {"port",         required_argument, NULL, 'p'},
+        {"interface",    required_argument, NULL, 'i'},
+        {"credential",   required_argument, NULL, 'c'},
+        {"uid",          required_argument, NULL, 'u'},
+        {"gid",          required_argument, NULL, 'g'},
+        {"signal",       required_argument, NULL, 's'},
+        {"signal-list",  no_argument,       NULL,  1},
+        {"reconnect",    required_argument, NULL, 'r'},
+        {"index",        required_argument, NULL, 'I'},
+        {"ssl",          no_argument,       NULL, 'S'},
+        {"ssl-cert",     required_argument, NULL, 'C'},
+        {"ssl-key",      required_argument, NULL, 'K'},
+        {"ssl-ca",       required_argument, NULL, 'A'},
+        {"readonly",     no_argument,       NULL, 'R'},
+        {"check-origin", no_argument,       NULL, 'O'},
+        {"max-clients",  required_argument, NULL, 'm'},
+        {"max-queue",    required_argument, NULL, OPT_MAX_QUEUE},
+        {"once",         no_argument,       NULL, 'o'},
+        {"coalesce",     no_argument,       NULL, OPT_COALESCE},
+        {"ip-rate",      required_argument, NULL, OPT_IP_RATE},
+        {"ip-max-sessions", required_argument, NULL, OPT_IP_MAX_SESSIONS},
+        {"credential-rate", required_argument, NULL, OPT_CREDENTIAL_RATE},
+        {"credential-max-sessions", required_argument, NULL, OPT_CREDENTIAL_MAX_SESSIONS},
+        {"browser",      no_argument,       NULL, 'B'},
+        {"debug",        required_argument, NULL, 'd'},
+        {"log-format",   required_argument, NULL, OPT_LOG_FORMAT},
+        {"resolve-hosts", no_argument,      NULL, OPT_RESOLVE_HOSTS},
+        {"version",      no_argument,       NULL, 'v'},
+        {"help",         no_argument,       NULL, 'h'},
+        {NULL,           0,                 0,     0}
+};
+static const char *opt_string = "f:p:i:c:u:g:s:r:I:aSC:K:A:Rt:T:Om:oBd:vh";
+
+void print_help() {
+    fprintf(stderr, "ttyd-express is a tool for sharing terminal over the web\n\n"
+                    "USAGE:\n"
+                    "    ttyd [options] <command> [<arguments...>]\n\n"
+                    "VERSION:\n"
+                    "    %s\n\n"
+                    "OPTIONS:\n"
+                    "    -f, --conf-file         Configuration file path (eg: /etc/ttyd/config.json)\n"
+                    "    -p, --port              Port to listen (default: 7681, use `0` for random port)\n"
+                    "    -i, --interface         Network interface to bind (eg: eth0), or UNIX domain socket path (eg: /var/run/ttyd.sock)\n"
+                    "    -c, --credential        Credential for Basic Authentication (format: username:password)\n"
+                    "    -u, --uid               User id to run with\n"
+                    "    -g, --gid               Group id to run with\n"
+                    "    -s, --signal            Signal to send to the command when exit it (default: 1, SIGHUP)\n"
+                    "    -r, --reconnect         Time to reconnect for the client in seconds (default: 10, disable reconnect: <= 0)\n"
+                    "    -R, --readonly          Do not allow clients to write to the TTY\n"
+                    "    -t, --client-option     Send option to client (format: key=value), repeat to add more options\n"
+                    "    -T, --terminal-type     Terminal type to report, default: xterm-color\n"
+                    "    -O, --check-origin      Do not allow websocket connection from different origin\n"
+                    "    -m, --max-clients       Maximum clients to support (default: 0, no limit)\n"
+                    "        --max-queue         Connections waiting for a free client at --max-clients (default: 0, refuse them)\n"
+                    "    -o, --once              Accept only one client and exit on disconnection\n"
+                    "        --coalesce          Repaint the screen instead of sending stale redraws when the client falls behind\n"
+                    "        --ip-rate           Connections per second allowed from a client address (format: rate[/burst])\n"
+                    "        --ip-max-sessions   Maximum sessions of a client address (default: 0, no limit)\n"
+                    "        --credential-rate   Connections per second allowed with a credential (format: rate[/burst])\n"
+                    "        --credential-max-sessions Maximum sessions of a credential (default: 0, no limit)\n"
+                    "    -B, --browser           Open terminal with the default system browser\n"
+                    "    -I, --index             Custom index.html path\n"
+                    "    -S, --ssl               Enable SSL\n"
+                    "    -C, --ssl-cert          SSL certificate file path\n"
+                    "    -K, --ssl-key           SSL key file path\n"
+                    "    -A, --ssl-ca            SSL CA file path for client certificate verification\n"
+                    "    -d, --debug             Set log level (default: 7)\n"
+                    "        --log-format        Log format: text or json (default: text)\n"
+                    "        --resolve-hosts     Log the host names of the clients, resolved in the background\n"
+                    "    -v, --version           Print the version and exit\n"
+                    "    -h, --help              Print this text and exit\n\n"
+                    "Visit https://github.com/santosh0705/ttyd-express to get more information and report bugs.\n"
+                    "ttyd-express is a fork of ttyd project: https://github.com/tsl0922/ttyd\n",
+            TTYD_VERSION
+    );
+}
+
+void
+sig_handler(int sig) {
+    if (ttyd_stopped(server))
+        exit(EXIT_FAILURE);
+
+    char sig_name[20];
+    get_sig_name(sig, sig_name, sizeof(sig_name));
+    lwsl_notice("received signal: %s (%d), exiting...\n", sig_name, sig);
+    ttyd_stop(server);
+    lwsl_notice("send ^C to force exit.\n");
+}
+
+void
+reload_handler(int sig) {
+    ttyd_reload(server);
+}
+
+void
+stats_handler(int sig) {
+    ttyd_stats(server);
+}
+
+int
+calc_command_start(int argc, char **argv) {
+    // make a copy of argc and argv
+    int argc_copy = argc;
+    char **argv_copy = xmalloc(sizeof(char *) * argc);
+    for (int i = 0; i < argc; i++) {
+        argv_copy[i] = strdup(argv[i]);
+    }
+
+    // do not print error message for invalid option
+    opterr = 0;
+    while (getopt_long(argc_copy, argv_copy, opt_string, options, NULL) != -1)
+        ;
+
+    int start = argc;
+    if (optind < argc) {
+        char *command = argv_copy[optind];
+        for (int i = 0; i < argc; i++) {
+            if (strcmp(argv[i], command) == 0) {
+                start = i;
+                break;
+            }
+        }
+    }
+
+    // free argv copy
+    for (int i = 0; i < argc; i++) {
+        free(argv_copy[i]);
+    }
+    free(argv_copy);
+
+    // reset for next use
+    opterr = 1;
+    optind = 0;
+
+    return start;
+}
+
+char **
+get_cmd(int argc, char **argv, int start) {
+    char **cmd = xmalloc(sizeof(char *) * ((argc - start) + 1));
+    int i;
+    for (i = 0; (start + i) < argc; i++) {
+        cmd[i] = strdup(argv[start + i]);
+    }
+    cmd[i] = NULL;
+
+    return cmd;
+}
+
+int
+main(int argc, char **argv) {
+    if (argc == 1) {
+        print_help();
+        return 0;
+    }
+
+    int start = calc_command_start(argc, argv);
+    char **cmd_argv = get_cmd(argc, argv, start);
+
+    struct ttyd_options opts;
+    ttyd_options_init(&opts);
+
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = -1;
+    info.iface = NULL;
+    info.ssl_cert_filepath = NULL;
+    info.ssl_private_key_filepath = NULL;
+    info.gid = -1;
+    info.uid = -1;
+    info.max_http_header_pool = 16;
+    info.options = LWS_SERVER_OPTION_VALIDATE_UTF8;
+    info.extensions = extensions;
+
+    int debug_level = LLL_ERR | LLL_WARN | LLL_NOTICE;
+    char iface[128] = "";
+    char socket_path[255] = "";
+    char *conf_file = NULL;
+    char *index = NULL;
+    bool browser = false;
+    bool log_json = false;
+    bool resolve_hosts = false;
+    bool ssl = false;
+    char cert_path[1024] = "";
+    char key_path[1024] = "";
+    char ca_path[1024] = "";
+
+    struct json_object *client_prefs = json_object_new_object();
+    const char *home = getenv("HOME");
+
+    // parse command line options
+    int c;
+    while ((c = getopt_long(start, argv, opt_string, options, NULL)) != -1) {
+        switch (c) {
+            case 'h':
+                print_help();
+                return 0;
+            case 'v':
+                printf("ttyd-express version %s\n", TTYD_VERSION);
+                return 0;
+            case 'd':
+                debug_level = atoi(optarg);
+                break;
+            case 'f':
+                ; // empty statement
+                char *file_path;
+                if (!strncmp(optarg, "~/", 2)) {
+                    file_path = malloc(strlen(home) + strlen(optarg));
+                    sprintf(file_path, "%s%s", home, optarg + 1);
+                } else {
+                    file_path = strdup(optarg);
+                }
+                struct json_object *jobj = read_config(file_path);
+                if (jobj == NULL)
+                    return -1;
+                free(conf_file);
+                conf_file = file_path;
+                struct json_object *g_jobj, *p_jobj;
+                // preference given to commandline arguments
+                if (json_object_object_get_ex(jobj, "listen", &g_jobj)) {
+                    if ((info.port == -1) && (json_object_object_get_ex(g_jobj, "port", &p_jobj)))
+                        info.port = json_object_get_int(p_jobj);
+                    if ((iface[0] == '\0') && (json_object_object_get_ex(g_jobj, "ip", &p_jobj)))
+                        strncpy(iface, json_object_get_string(p_jobj), sizeof(iface) - 1);
+                        iface[sizeof(iface) - 1] = '\0';
+                }
+                if (json_object_object_get_ex(jobj, "terminal", &g_jobj)) {
+                    json_object_object_foreach(g_jobj, key, val) {
+                        if ((json_object_object_get(client_prefs, key) == NULL) && (json_object_object_get_ex(g_jobj, key, &p_jobj))) {
+                            struct json_object *pref = NULL;
+                            if (json_object_deep_copy(p_jobj, &pref, NULL) == 0) {
+                                json_object_object_add(client_prefs, key, pref);
+                            } else {
+                                fprintf(stderr, "Failed to copy JSON configuration\n");
+                                return -1;
+                            }
+                        }
+                    }
+                }
+                // the services are loaded once the server is created
+                json_object_put(jobj);
+                break;
+            case 'R':
+                opts.readonly = true;
+                break;
+            case 'O':
+                opts.check_origin = true;
+                break;
+            case 'm':
+                opts.max_clients = atoi(optarg);
+                break;
+            case 'o':
+                opts.once = true;
+                break;
+            case 'B':
+                browser = true;
+                break;
+            case OPT_COALESCE:
+                opts.coalesce = true;
+                break;
+            case OPT_IP_RATE:
+                if (ttyd_parse_rate(optarg, &opts.ip_rate, &opts.ip_burst) != 0) {
+                    fprintf(stderr, "ttyd: invalid rate: %s, format: rate[/burst]\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_CREDENTIAL_RATE:
+                if (ttyd_parse_rate(optarg, &opts.credential_rate, &opts.credential_burst) != 0) {
+                    fprintf(stderr, "ttyd: invalid rate: %s, format: rate[/burst]\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_RESOLVE_HOSTS:
+                resolve_hosts = true;
+                break;
+            case OPT_LOG_FORMAT:
+                if (strcmp(optarg, "json") == 0) {
+                    log_json = true;
+                } else if (strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "ttyd: invalid log format: %s, it must be text or json\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_MAX_QUEUE:
+                opts.max_queue = atoi(optarg);
+                break;
+            case OPT_IP_MAX_SESSIONS:
+                opts.ip_max_sessions = atoi(optarg);
+                break;
+            case OPT_CREDENTIAL_MAX_SESSIONS:
+                opts.credential_max_sessions = atoi(optarg);
+                break;
+            case 'p':
+                info.port = atoi(optarg);
+                break;
+            case 'i':
+                strncpy(iface, optarg, sizeof(iface) - 1);
+                iface[sizeof(iface) - 1] = '\0';
+                break;
+            case 'c':
+                opts.credential = optarg;
+                break;
+            case 'u':
+                info.uid = atoi(optarg);
+                break;
+            case 'g':
+                info.gid = atoi(optarg);
+                break;
+            case 's': {
+                int sig = get_sig(optarg);
+                if (sig > 0) {
+                    opts.sig_code = sig;
+                } else {
+                    fprintf(stderr, "ttyd: invalid signal: %s\n", optarg);
+                    return -1;
+                }
+            }
+                break;
+            case 'r':
+                opts.reconnect = atoi(optarg);
+                if (opts.reconnect <= 0) {
+                    fprintf(stdout, "ttyd: reconnection is disabled\n");
+                }
+                break;
+            case 'I':
+                free(index);
+                if (!strncmp(optarg, "~/", 2)) {
+                    index = malloc(strlen(home) + strlen(optarg));
+                    sprintf(index, "%s%s", home, optarg + 1);
+                } else {
+                    index = strdup(optarg);
+                }
+                opts.index = index;
+                break;
+            case 'S':
+                ssl = true;
+                break;
+            case 'C':
+                strncpy(cert_path, optarg, sizeof(cert_path) - 1);
+                cert_path[sizeof(cert_path) - 1] = '\0';
+                break;
+            case 'K':
+                strncpy(key_path, optarg, sizeof(key_path) - 1);
+                key_path[sizeof(key_path) - 1] = '\0';
+                break;
+            case 'A':
+                strncpy(ca_path, optarg, sizeof(ca_path) - 1);
+                ca_path[sizeof(ca_path) - 1] = '\0';
+                break;
+            case 'T':
+                opts.terminal_type = optarg;
+                break;
+            case '?':
+                break;
+            case 't':
+                optind--;
+                for (; optind < start && *argv[optind] != '-'; optind++) {
+                    char *option = strdup(optarg);
+                    char *key = strsep(&option, "=");
+                    if (key == NULL) {
+                        fprintf(stderr, "ttyd: invalid client option: %s, format: key=value\n", optarg);
+                        return -1;
+                    }
+                    char *value = strsep(&option, "=");
+                    free(option);
+                    struct json_object *obj = json_tokener_parse(value);
+                    json_object_object_add(client_prefs, key, obj != NULL ? obj : json_object_new_string(value));
+                }
+                break;
+            default:
+                print_help();
+                return -1;
+        }
+    }
+    opts.client_options = json_object_to_json_string(client_prefs);
+
+    // validating parameters
+    if (info.port == -1) info.port = 7681;
+    if (info.port < 0) {
+        fprintf(stderr, "ttyd: invalid port: %d\n", info.port);
+        return -1;
+    }
+
+    log_init(debug_level, log_json);
+    if (resolve_hosts)
+        resolver_init();
+
+    lwsl_notice("ttyd %s (libwebsockets %s)\n", TTYD_VERSION, LWS_LIBRARY_VERSION);
+    server = ttyd_new(&opts);
+    json_object_put(client_prefs);
+    free(index);
+    if (server == NULL)
+        return -1;
+
+    int services = 0;
+    if (conf_file != NULL) {
+        services = ttyd_load_services(server, conf_file);
+        if (services < 0)
+            return -1;
+        if (services > 0)
+            fprintf(stdout, "ttyd: service configuration found, ignoring start command if passed on commandline\n");
+    }
+    if (services == 0) {
+        if (cmd_argv[0] == NULL) {
+            fprintf(stderr, "ttyd: missing service(s) or start command\n");
+            return -1;
+        }
+        if (ttyd_add_service(server, "/", cmd_argv) != 0)
+            return -1;
+    }
+    for (int i = 0; cmd_argv[i] != NULL; i++) {
+        free(cmd_argv[i]);
+    }
+    free(cmd_argv);
+
+    info.protocols = ttyd_protocols(server);
+
+#if LWS_LIBRARY_VERSION_MAJOR >= 2
+    char server_hdr[128] = "";
+    sprintf(server_hdr, "ttyd/%s (libwebsockets/%s)", TTYD_VERSION, LWS_LIBRARY_VERSION);
+    info.server_string = server_hdr;
+#endif
+
+    if (strlen(iface) > 0) {
+        info.iface = iface;
+        if (endswith(info.iface, ".sock") || endswith(info.iface, ".socket")) {
+#if defined(LWS_USE_UNIX_SOCK) || defined(LWS_WITH_UNIX_SOCK)
+            info.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+            strncpy(socket_path, info.iface, sizeof(socket_path) - 1);
+#else
+            fprintf(stderr, "libwebsockets is not compiled with UNIX domain socket support");
+            return -1;
+#endif
+        }
+    }
+
+    if (ssl) {
+        info.ssl_cert_filepath = cert_path;
+        info.ssl_private_key_filepath = key_path;
+        info.ssl_ca_filepath = ca_path;
+        info.ssl_cipher_list = "ECDHE-ECDSA-AES256-GCM-SHA384:"
+                "ECDHE-RSA-AES256-GCM-SHA384:"
+                "DHE-RSA-AES256-GCM-SHA384:"
+                "ECDHE-RSA-AES256-SHA384:"
+                "HIGH:!aNULL:!eNULL:!EXPORT:"
+                "!DES:!MD5:!PSK:!RC4:!HMAC_SHA1:"
+                "!SHA1:!DHE-RSA-AES128-GCM-SHA256:"
+                "!DHE-RSA-AES128-SHA256:"
+                "!AES128-GCM-SHA256:"
+                "!AES128-SHA256:"
+                "!DHE-RSA-AES256-SHA256:"
+                "!AES256-GCM-SHA384:"
+                "!AES256-SHA256";
+        if (strlen(info.ssl_ca_filepath) > 0)
+            info.options |= LWS_SERVER_OPTION_REQUIRE_VALID_OPENSSL_CLIENT_CERT;
+#if LWS_LIBRARY_VERSION_MAJOR >= 2
+        info.options |= LWS_SERVER_OPTION_REDIRECT_HTTP_TO_HTTPS;
+#endif
+#if LWS_LIBRARY_VERSION_MAJOR >= 3 && defined(LWS_WITH_HTTP2)
+        // negotiate HTTP/2 over ALPN: the page and the websockets (RFC 8441) share one connection
+        info.alpn = "h2,http/1.1";
+#ifdef LWS_SERVER_OPTION_H2_JUST_FIX_WINDOW_UPDATE_OVERFLOW
+        info.options |= LWS_SERVER_OPTION_H2_JUST_FIX_WINDOW_UPDATE_OVERFLOW;
+#endif
+#endif
+    }
+
+    signal(SIGINT, sig_handler);  // ^C
+    signal(SIGTERM, sig_handler); // kill
+    if (conf_file != NULL)
+        signal(SIGHUP, reload_handler);
+    signal(SIGUSR1, stats_handler);
+
+    struct lws_context *context = lws_create_context(&info);
+    if (context == NULL) {
+        lwsl_err("libwebsockets init failed\n");
+        return 1;
+    }
+    ttyd_attach(server, context);
+
+    if (browser) {
+        char url[30];
+        sprintf(url, "%s://localhost:%d", ssl ? "https" : "http", info.port);
+        open_uri(url);
+    }
+
+    ttyd_run(server);
+
+    lws_context_destroy(context);
+
+    // cleanup
+    ttyd_free(server);
+    free(conf_file);
+    if (strlen(socket_path) > 0) {
+        struct stat st;
+        if (!stat(socket_path, &st)) {
+            unlink(socket_path);
+        }
+    }
+    resolver_close();
+    log_close();
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "utils.h"
+#include "timer.h"
+#include "log.h"
+#include "trace.h"
+
+// Sessions of the "tty-mux" protocol share one websocket connection: every message
+// starts with the channel byte of its session, then the usual message type and data.
+// A session is opened by a JSON_DATA message on an unused channel and closed by
+// CLOSE_CHANNEL, the server reports the end of a session with CHANNEL_CLOSED and its
+// close status. The connection is authenticated once, by the first session.
+
+// Send a ping on the connection every DEFAULT_KEEPALIVE seconds, close it when the
+// previous one was not answered
+void
+mux_timer_fire(struct timer *timer) {
+    struct mux_conn *mux = timer->data;
+    if (mux->pong_pending) {
+        mux->timed_out = true;
+    } else {
+        mux->ping_pending = true;
+        timer_add(&mux->server->timers, timer, DEFAULT_KEEPALIVE);
+    }
+    lws_callback_on_writable(mux->wsi);
+}
+
+// Report the end of a channel with its close status on the next writable callback, a
+// channel is reported once however many times it is closed or refused meanwhile
+void
+mux_report_closed(struct mux_conn *mux, int channel, unsigned short status) {
+    if (mux->closed[channel] == 0)
+        mux->closing++;
+    mux->closed[channel] = status;
+    lws_callback_on_writable(mux->wsi);
+}
+
+// Open a channel for the session started by a JSON_DATA message
+struct tty_client *
+mux_channel_open(struct mux_conn *mux, int channel) {
+    struct tty_client *client = xmalloc(sizeof(struct tty_client));
+    memset(client, 0, sizeof(struct tty_client));
+    arena_init(&client->arena, &mux->server->arena_cache);
+    tty_client_init(client, mux->wsi);
+    client->channel = channel;
+    client->fragment = mux->fragment;
+    client->authenticated = mux->authenticated;
+    client->source = mux->source;
+    admission_hold(&mux->server->admission, &client->source);
+    client->admitted = true;
+    tty_client_add(client);
+    mux->channels[channel] = client;
+    mux->count++;
+    log_event(LLL_NOTICE, &mux->server->mux_rate, "channel_open", "channel=%d address=%s clients=%d", channel,
+              client->address, client_count(mux->server));
+    return client;
+}
+
+// Close the session of a channel, the client is told on the next writable callback
+void
+mux_channel_close(struct mux_conn *mux, int channel) {
+    struct tty_client *client = mux->channels[channel];
+    mux->channels[channel] = NULL;
+    mux->count--;
+    mux_report_closed(mux, channel, client->close_status > 0 ? client->close_status
+                                                             : LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+    tty_client_destroy(client);
+    log_event(LLL_NOTICE, &mux->server->mux_rate, "channel_close", "channel=%d address=%s hostname=%s clients=%d",
+              channel, client->address, client_hostname(client), client_count(mux->server));
+    free(client);
+}
+
+// Whether one of the sessions has something to send
+bool
+mux_pending(struct mux_conn *mux) {
+    if (mux->closing > 0)
+        return true;
+    for (int i = 0; i < MUX_CHANNELS && mux->count > 0; i++) {
+        if (mux->channels[i] != NULL && tty_client_pending(mux->channels[i]))
+            return true;
+    }
+    return false;
+}
+
+int
+mux_writable(struct lws *wsi, struct mux_conn *mux) {
+    if (mux->timed_out) {
+        lwsl_notice("closing WS mux connection: ping timeout\n");
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_GOINGAWAY, NULL, 0);
+        return -1;
+    }
+    if (mux->ping_pending) {
+        unsigned char ping[LWS_PRE + 1];
+        mux->ping_pending = false;
+        if (lws_write(wsi, ping + LWS_PRE, 0, LWS_WRITE_PING) < 0) {
+            lwsl_err("write ping to WS\n");
+            return -1;
+        }
+        mux->pong_pending = true;
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+
+    // report the closed channels first, the client may reuse them once told
+    for (int i = 0; i < MUX_CHANNELS && mux->closing > 0; i++) {
+        if (mux->closed[i] == 0)
+            continue;
+        unsigned char message[LWS_PRE + 16];
+        unsigned char *p = &message[LWS_PRE];
+        p[0] = (unsigned char) i;
+        p[1] = CHANNEL_CLOSED;
+        int n = 2 + sprintf((char *) p + 2, "%d", mux->closed[i]);
+        mux->closed[i] = 0;
+        mux->closing--;
+        if (lws_write(wsi, p, (size_t) n, LWS_WRITE_BINARY) < n) {
+            lwsl_err("write channel close to WS\n");
+            return -1;
+        }
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+
+    // one message per callback, the channels take turns
+    for (int i = 0; i < MUX_CHANNELS && mux->count > 0; i++) {
+        int channel = (mux->next + i) % MUX_CHANNELS;
+        struct tty_client *client = mux->channels[channel];
+        if (client == NULL || !tty_client_pending(client))
+            continue;
+        mux->next = (channel + 1) % MUX_CHANNELS;
+        if (tty_client_writable(wsi, client) != 0)
+            mux_channel_close(mux, channel);
+        break;
+    }
+    if (mux_pending(mux))
+        lws_callback_on_writable(wsi);
+    return 0;
+}
+
+// Route a received message, or part of it, to the session of its channel
+int
+mux_receive(struct lws *wsi, struct mux_conn *mux, unsigned char *in, size_t len) {
+    struct tty_server *server = mux->server;
+    mux->pong_pending = false;
+
+    if (mux->rx_channel < 0) {
+        if (len < 2) {
+            lwsl_warn("WS mux message without channel and type\n");
+            return -1;
+        }
+        int channel = in[0];
+        enum admission_result result;
+        in++;
+        len--;
+        mux->rx_channel = channel;
+        // a channel is not reused before the client is told it was closed, the messages
+        // sent on it meanwhile are dropped
+        if (mux->channels[channel] == NULL && mux->closed[channel] == 0 && in[0] == JSON_DATA) {
+            if ((server->once && client_count(server) > 0) ||
+                (server->max_clients > 0 && client_count(server) >= server->max_clients)) {
+                lwsl_warn("refuse to open WS channel due to the --once or --max-clients option.\n");
+                mux_report_closed(mux, channel, LWS_CLOSE_STATUS_POLICY_VIOLATION);
+            } else if ((result = admission_check(&server->admission, &mux->source)) != ADMISSION_OK) {
+                // each channel is a session of its own, it is held to the limits of the source
+                admission_refused(result);
+                mux_report_closed(mux, channel, LWS_CLOSE_STATUS_POLICY_VIOLATION);
+            } else {
+                mux_channel_open(mux, channel);
+            }
+        } else if (mux->channels[channel] != NULL && in[0] == CLOSE_CHANNEL) {
+            mux->channels[channel]->close_status = LWS_CLOSE_STATUS_NORMAL;
+            mux_channel_close(mux, channel);
+        }
+    }
+
+    int channel = mux->rx_channel;
+    struct tty_client *client = mux->channels[channel];
+    if (lws_remaining_packet_payload(wsi) == 0 && lws_is_final_fragment(wsi))
+        mux->rx_channel = -1;
+    // the rest of the messages of a closed channel is dropped
+    if (client == NULL)
+        return 0;
+
+    if (tty_client_receive(wsi, client, in, len) != 0) {
+        mux_channel_close(mux, channel);
+        // a failed authentication closes the whole connection
+        if (server->credential != NULL && !mux->authenticated)
+            return -1;
+        return 0;
+    }
+    if (client->authenticated)
+        mux->authenticated = true;
+    return 0;
+}
+
+int
+callback_tty_mux(struct lws *wsi, enum lws_callback_reasons reason,
+                 void *user, void *in, size_t len) {
+    struct mux_conn *mux = (struct mux_conn *) user;
+
+    switch (reason) {
+        case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
+            if (!ws_connection_allowed(wsi, &mux->source)) {
+                TRACE2(filter, 0, 1);
+                return 1;
+            }
+            TRACE2(filter, 1, 1);
+            arena_init(&mux->arena, &wsi_server(wsi)->arena_cache);
+            mux->fragment = ws_fragments(wsi, &mux->arena);
+            break;
+
+        case LWS_CALLBACK_ESTABLISHED:
+            mux->server = wsi_server(wsi);
+            mux->wsi = wsi;
+            mux->authenticated = false;
+            memset(mux->channels, 0, sizeof(mux->channels));
+            memset(mux->closed, 0, sizeof(mux->closed));
+            mux->count = 0;
+            mux->closing = 0;
+            mux->rx_channel = -1;
+            mux->next = 0;
+            mux->ping_pending = false;
+            mux->pong_pending = false;
+            mux->timed_out = false;
+            mux->timer.active = false;
+            mux->timer.cb = mux_timer_fire;
+            mux->timer.data = mux;
+            timer_add(&mux->server->timers, &mux->timer, DEFAULT_KEEPALIVE);
+            log_event(LLL_NOTICE, &mux->server->mux_rate, "mux_open", "");
+            break;
+
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            return mux_writable(wsi, mux);
+
+        case LWS_CALLBACK_RECEIVE:
+            return mux_receive(wsi, mux, in, len);
+
+        case LWS_CALLBACK_RECEIVE_PONG:
+            mux->pong_pending = false;
+            break;
+
+        case LWS_CALLBACK_CLOSED:
+            timer_cancel(&mux->timer);
+            for (int i = 0; i < MUX_CHANNELS && mux->count > 0; i++) {
+                if (mux->channels[i] != NULL) {
+                    tty_client_destroy(mux->channels[i]);
+                    free(mux->channels[i]);
+                    mux->channels[i] = NULL;
+                    mux->count--;
+                }
+            }
+            arena_free(&mux->arena);
+            log_event(LLL_NOTICE, &mux->server->mux_rate, "mux_close", "clients=%d", client_count(mux->server));
+            exit_if_once(mux->server);
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <pthread.h>
 
 #if defined(__OpenBSD__) || defined(__APPLE__)
@@ -25,6 +26,39 @@
 
 #include "server.h"
 #include "utils.h"
+#include "log.h"
+#include "resolve.h"
+#include "vt.h"
+#include "record.h"
+#include "arena.h"
+#include "cgroup.h"
+#include "timer.h"
+#include "transfer.h"
+#include "trace.h"
+
+// longest incomplete utf-8 sequence carried to the next frame
+#define UTF8_TAIL_MAX 3
+// time to wait for the rest of an incomplete utf-8 sequence (us)
+#define UTF8_TAIL_TIMEOUT 20000
+
+// longest pause between two events in playback (s)
+#define PLAYBACK_IDLE_MAX 2
+
+// smallest read of a rate limited session, unless the burst is smaller
+#define RATE_MIN_READ 1024
+
+// initial size of the receive buffer
+#define RECV_BUFFER_SIZE 256
+
+// size of the download frames, the file is read straight into the frame
+#define FILE_CHUNK_SIZE 65536
+
+struct token_bucket {
+    double rate;                    // bytes per second
+    double burst;                   // size of the bucket
+    double tokens;
+    struct timespec last;
+};
 
 // initial message list
 char initial_cmds[] = {
@@ -33,44 +67,228 @@ char initial_cmds[] = {
         SET_PREFERENCES
 };
 
+// Get the window title of the session: the command and the host name
+char *
+client_title(struct tty_client *client) {
+    size_t len = strlen(client->server->hostname) + 4;
+    for (int i = 0; client->argv[i] != NULL; i++) {
+        len += strlen(client->argv[i]) + 1;
+    }
+    char *title = arena_alloc(&client->arena, len);
+    char *ptr = title;
+    for (int i = 0; client->argv[i] != NULL; i++) {
+        if (i > 0)
+            ptr = stpcpy(ptr, " ");
+        ptr = stpcpy(ptr, client->argv[i]);
+    }
+    lwsl_notice("start command: %s\n", title);
+    sprintf(ptr, " (%s)", client->server->hostname);
+    return title;
+}
+
+// Write a message of the session, data is the payload and has MSG_PRE bytes of room in
+// front of it for the lws header, the channel of a multiplexed session and the type.
+// Returns the payload length written or -1.
 int
-send_initial_message(struct lws *wsi, struct tty_client *client) {
-    unsigned char message[LWS_PRE + 1 + 4096];
-    unsigned char *p = &message[LWS_PRE];
-    char buffer[128];
-    int n = 0;
+client_write(struct tty_client *client, char type, unsigned char *data, size_t len) {
+    size_t header = client->channel >= 0 ? 2 : 1;
+    data -= header;
+    if (client->channel >= 0)
+        data[0] = (unsigned char) client->channel;
+    data[header - 1] = (unsigned char) type;
+    TRACE3(ws_write, client->id, type, len);
+    int n = lws_write(client->wsi, data, len + header, LWS_WRITE_BINARY);
+    return n < (int) (len + header) ? -1 : (int) len;
+}
+
+// Set the close status of the session: the close frame of a connection of its own,
+// or the CHANNEL_CLOSED message of a multiplexed session
+void
+client_close_reason(struct tty_client *client, enum lws_close_status status) {
+    if (client->channel < 0)
+        lws_close_reason(client->wsi, status, NULL, 0);
+    else
+        client->close_status = status;
+}
+
+// Send the title, reconnect timeout and preferences in a single frame, only the title
+// is built per session, the rest is prepared at startup
+int
+send_handshake(struct lws *wsi, struct tty_client *client) {
+    struct json_object *title = json_object_new_string(client_title(client));
+    const char *title_json = json_object_to_json_string(title);
+    // the client leaves zmodem detection off when the service has file transfers
+    const char *files = client->service->files_dir != NULL ? "\"files\":true," : "";
+    size_t len = strlen("{\"title\":") + strlen(title_json) + 1 + strlen(files) + strlen(client->server->handshake);
+    unsigned char *message = xmalloc(MSG_PRE + len + 1);
+    unsigned char *p = &message[MSG_PRE];
+    sprintf((char *) p, "{\"title\":%s,%s%s", title_json, files, client->server->handshake);
+    json_object_put(title);
 
+    int n = client_write(client, HANDSHAKE, p, len);
+    free(message);
+    return n;
+}
+
+int
+send_initial_message(struct lws *wsi, struct tty_client *client) {
     char cmd = initial_cmds[client->initial_cmd_index];
+    const char *data = "";
+    char reconnect[16];
+
     switch(cmd) {
         case SET_WINDOW_TITLE:
-            gethostname(buffer, sizeof(buffer) - 1);
-            int command_len = 0;
-            for (int i = 0; client->argv[i] != NULL; i++) {
-                command_len += (strlen(client->argv[i]) + 1);
-            }
-            char *command = xmalloc(command_len);
-            command[0] = '\0';
-            char *ptr = command;
-            for (int i = 0; client->argv[i] != NULL; i++) {
-                ptr = stpcpy(ptr, client->argv[i]);
-                if (client->argv[i + 1] != NULL)
-                    ptr = stpcpy(ptr, " ");
-            }
-            lwsl_notice("start command: %s\n", command);
-            n = sprintf((char *) p, "%c%s (%s)", cmd, command, buffer);
-            free(command);
+            data = client_title(client);
             break;
         case SET_RECONNECT:
-            n = sprintf((char *) p, "%c%d", cmd, server->reconnect);
+            snprintf(reconnect, sizeof(reconnect), "%d", client->server->reconnect);
+            data = reconnect;
             break;
         case SET_PREFERENCES:
-            n = sprintf((char *) p, "%c%s", cmd, server->prefs_json);
+            data = client->server->prefs_json;
             break;
         default:
             break;
     }
 
-    return lws_write(wsi, p, (size_t) n, LWS_WRITE_BINARY);
+    size_t len = strlen(data);
+    unsigned char *message = xmalloc(MSG_PRE + len + 1);
+    unsigned char *p = &message[MSG_PRE];
+    strcpy((char *) p, data);
+    int n = client_write(client, cmd, p, len);
+    free(message);
+    return n;
+}
+
+// Queue a FILE_STATUS message for the writable callback, it replaces the one not sent yet
+void
+file_status(struct tty_client *client, const struct transfer *transfer, bool done, const char *error) {
+    struct json_object *status = json_object_new_object();
+    if (transfer != NULL) {
+        json_object_object_add(status, transfer->upload ? "upload" : "download", json_object_new_string(transfer->name));
+        json_object_object_add(status, "size", json_object_new_int64((int64_t) transfer->size));
+    }
+    if (done)
+        json_object_object_add(status, "done", json_object_new_boolean(true));
+    if (error != NULL)
+        json_object_object_add(status, "error", json_object_new_string(error));
+    if (client->file_status != NULL)
+        free(client->file_status);
+    client->file_status = strdup(json_object_to_json_string(status));
+    json_object_put(status);
+    lws_callback_on_writable(client->wsi);
+}
+
+int
+send_file_status(struct lws *wsi, struct tty_client *client) {
+    size_t len = strlen(client->file_status);
+    unsigned char *message = xmalloc(MSG_PRE + len + 1);
+    unsigned char *p = &message[MSG_PRE];
+    strcpy((char *) p, client->file_status);
+    int n = client_write(client, FILE_STATUS, p, len);
+    free(message);
+    free(client->file_status);
+    client->file_status = NULL;
+    return n;
+}
+
+// End the file transfer of the client, returns -1 if a complete upload could not replace the file
+int
+file_transfer_end(struct tty_client *client) {
+    int rc = 0;
+    if (client->transfer != NULL) {
+        rc = transfer_close(client->transfer);
+        client->transfer = NULL;
+    }
+    if (client->file_buffer != NULL) {
+        free(client->file_buffer);
+        client->file_buffer = NULL;
+    }
+    return rc;
+}
+
+// Write upload data to the file, it comes straight from the websocket receive buffer
+void
+file_upload(struct tty_client *client, const char *data, size_t len) {
+    struct transfer *transfer = client->transfer;
+    if (transfer_write(transfer, data, len) < 0) {
+        lwsl_err("write upload %s: %d (%s)\n", transfer->path, errno, strerror(errno));
+        file_status(client, transfer, false, strerror(errno));
+        file_transfer_end(client);
+        return;
+    }
+    if (transfer_complete(transfer)) {
+        file_status(client, transfer, true, NULL);
+        if (file_transfer_end(client) < 0)
+            file_status(client, NULL, false, strerror(errno));
+    }
+}
+
+// Start the download or upload asked by a FILE_REQUEST message, a request cancels
+// the transfer in progress
+void
+file_request(struct tty_client *client, const char *json) {
+    struct json_object *obj = json_tokener_parse(json);
+    struct json_object *o = NULL, *size = NULL;
+    const char *dir = client->service->files_dir;
+    const char *error = NULL;
+
+    file_transfer_end(client);
+    if (json_object_object_get_ex(obj, "cancel", &o)) {
+        json_object_put(obj);
+        return;
+    }
+    if (dir == NULL) {
+        error = "File transfer is disabled";
+    } else if (json_object_object_get_ex(obj, "download", &o) && json_object_is_type(o, json_type_string)) {
+        client->transfer = transfer_open(dir, json_object_get_string(o), false, 0, &error);
+        if (client->transfer != NULL)
+            client->file_buffer = xmalloc(MSG_PRE + FILE_CHUNK_SIZE);
+    } else if (json_object_object_get_ex(obj, "upload", &o) && json_object_is_type(o, json_type_string)) {
+        if (client->server->readonly)
+            error = "Read-only session";
+        else if (!json_object_object_get_ex(obj, "size", &size) || json_object_get_int64(size) < 0)
+            error = "Invalid size";
+        else
+            client->transfer = transfer_open(dir, json_object_get_string(o), true,
+                                             (uint64_t) json_object_get_int64(size), &error);
+    } else {
+        error = "Invalid request";
+    }
+
+    if (client->transfer == NULL) {
+        lwsl_warn("file transfer of %s refused: %s\n", client->address, error);
+        file_status(client, NULL, false, error);
+    } else {
+        lwsl_notice("%s %s for %s\n", client->transfer->upload ? "upload" : "download", client->transfer->path,
+                    client->address);
+        file_status(client, client->transfer, false, NULL);
+        if (client->transfer->upload)
+            file_upload(client, NULL, 0);
+    }
+    json_object_put(obj);
+}
+
+// Send the next download frame, reading the file right behind the frame header
+int
+send_file_chunk(struct lws *wsi, struct tty_client *client) {
+    struct transfer *transfer = client->transfer;
+    char *data = client->file_buffer + MSG_PRE;
+    ssize_t n = transfer_read(transfer, data, FILE_CHUNK_SIZE);
+    if (n <= 0) {
+        if (n < 0)
+            file_status(client, transfer, false, strerror(errno));
+        else
+            file_status(client, transfer, transfer_complete(transfer), transfer_complete(transfer) ? NULL : "File truncated");
+        file_transfer_end(client);
+        return 0;
+    }
+    if (client_write(client, FILE_DOWNLOAD, (unsigned char *) data, (size_t) n) < 0) {
+        lwsl_err("write file to WS\n");
+        return -1;
+    }
+    lws_callback_on_writable(wsi);
+    return 0;
 }
 
 bool
@@ -118,75 +336,349 @@ check_host_origin(struct lws *wsi) {
         sprintf(buf, "%s:%d", address, port);
     }
 
-    int host_length = lws_hdr_total_length(wsi, WSI_TOKEN_HOST);
+    enum lws_token_indexes host_token = WSI_TOKEN_HOST;
+#if LWS_LIBRARY_VERSION_MAJOR >= 3 && defined(LWS_WITH_HTTP2)
+    // HTTP/2 requests carry the host in the :authority pseudo header
+    if (lws_hdr_total_length(wsi, WSI_TOKEN_HOST) <= 0)
+        host_token = WSI_TOKEN_HTTP_COLON_AUTHORITY;
+#endif
+    int host_length = lws_hdr_total_length(wsi, host_token);
     if (host_length != strlen(buf))
         return false;
     char host_buf[host_length + 1];
     memset(host_buf, 0, sizeof(host_buf));
-    len = lws_hdr_copy(wsi, host_buf, sizeof(host_buf), WSI_TOKEN_HOST);
+    len = lws_hdr_copy(wsi, host_buf, sizeof(host_buf), host_token);
 
     return len > 0 && strcasecmp(buf, host_buf) == 0;
 }
 
+const char *
+get_fragment_value(char **fragment, const char *key) {
+    size_t key_len = strlen(key);
+    for (int i = 0; fragment != NULL && fragment[i] != NULL; i++) {
+        if (strncmp(fragment[i], key, key_len) == 0 && fragment[i][key_len] == '=')
+            return fragment[i] + key_len + 1;
+    }
+    return NULL;
+}
+
+// Output buffers are only taken and released on the service thread, sessions start and end there
+char *
+pty_buffer_alloc(struct tty_server *server) {
+    if (server->pty_buffer_count > 0)
+        return server->pty_buffers[--server->pty_buffer_count];
+    return xmalloc(PTY_BUFFER_SIZE);
+}
+
+void
+pty_buffer_release(struct tty_server *server, char *buffer) {
+    if (server->pty_buffer_count < PTY_BUFFER_POOL_MAX)
+        server->pty_buffers[server->pty_buffer_count++] = buffer;
+    else
+        free(buffer);
+}
+
+void
+tty_client_add(struct tty_client *client) {
+    // spread the clients over the shards in turn, this is only called from the service thread
+    client->shard = client->server->next_shard++ % CLIENT_SHARDS;
+    struct client_shard *shard = &client->server->shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    LIST_INSERT_HEAD(&shard->clients, client, list);
+    client->registered = true;
+    pthread_mutex_unlock(&shard->mutex);
+    __atomic_add_fetch(&client->server->client_count, 1, __ATOMIC_RELAXED);
+}
+
 void
 tty_client_remove(struct tty_client *client) {
-    pthread_mutex_lock(&server->mutex);
-    struct tty_client *iterator;
-    LIST_FOREACH(iterator, &server->clients, list) {
-        if (iterator == client) {
-            LIST_REMOVE(iterator, list);
-            server->client_count--;
-            break;
+    struct client_shard *shard = &client->server->shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    bool registered = client->registered;
+    if (registered) {
+        LIST_REMOVE(client, list);
+        client->registered = false;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (registered)
+        __atomic_sub_fetch(&client->server->client_count, 1, __ATOMIC_RELAXED);
+}
+
+// Put a connection in the wait queue, it holds no session until it is promoted
+void
+tty_queue_add(struct tty_client *client) {
+    TAILQ_INSERT_TAIL(&client->server->queue, client, queue);
+    client->queued = true;
+    client->queue_position = ++client->server->queue_length;
+    client->queue_position_pending = true;
+    lws_callback_on_writable(client->wsi);
+}
+
+void
+tty_queue_remove(struct tty_client *client) {
+    TAILQ_REMOVE(&client->server->queue, client, queue);
+    client->queued = false;
+    client->server->queue_length--;
+    client->server->queue_changed = true;
+}
+
+// Start the sessions of the connections at the head of the queue while there is room,
+// then tell the others their new position. Called by the service thread on every tick.
+void
+tty_queue_service(struct tty_server *server) {
+    while (!TAILQ_EMPTY(&server->queue) && client_count(server) < server->max_clients) {
+        struct tty_client *client = TAILQ_FIRST(&server->queue);
+        tty_queue_remove(client);
+        tty_client_add(client);
+        log_event(LLL_NOTICE, NULL, "ws_dequeue", "address=%s clients=%d", client->address, client_count(server));
+        // the session was requested while waiting, otherwise it starts on request as usual
+        if (client->argv != NULL && !client->running && tty_client_start(client) != 0)
+            client->close_reason = "can not start the session";
+        lws_callback_on_writable(client->wsi);
+    }
+    if (!server->queue_changed)
+        return;
+    server->queue_changed = false;
+    int position = 0;
+    struct tty_client *client;
+    TAILQ_FOREACH(client, &server->queue, queue) {
+        if (client->queue_position != ++position) {
+            client->queue_position = position;
+            client->queue_position_pending = true;
+            lws_callback_on_writable(client->wsi);
+        }
+    }
+}
+
+// Whether the deadline has passed, otherwise keep the earliest deadline in next
+bool
+deadline_passed(uint64_t deadline, uint64_t now, uint64_t *next) {
+    if (deadline <= now)
+        return true;
+    if (deadline < *next)
+        *next = deadline;
+    return false;
+}
+
+// Check the keepalive and the timeouts of a session, called by the timer wheel
+// of the service thread. Writing is only allowed from the writable callback, so
+// pings and closes are left to it. Until its session starts (the client has not
+// chosen the service yet, or waits in the queue) the connection is only kept alive,
+// with the default keepalive.
+void
+client_timer_fire(struct timer *timer) {
+    struct tty_client *client = timer->data;
+    const struct service_t *service = client->service;
+    uint64_t now = client->server->timers.now;
+    uint64_t next = UINT64_MAX;
+    int keepalive = client->running ? service->keepalive : DEFAULT_KEEPALIVE;
+
+    if (client->close_reason != NULL)
+        return;
+    if (client->running) {
+        uint64_t last_output = __atomic_load_n(&client->last_output, __ATOMIC_RELAXED);
+        if (service->time_limit > 0 && deadline_passed(client->started + service->time_limit, now, &next))
+            client->close_reason = "time limit reached";
+        else if (service->idle_input_timeout > 0 &&
+                 deadline_passed(client->last_input + service->idle_input_timeout, now, &next))
+            client->close_reason = "no input";
+        else if (service->idle_output_timeout > 0 &&
+                 deadline_passed(last_output + service->idle_output_timeout, now, &next))
+            client->close_reason = "no output";
+    }
+    // a multiplexed connection has a keepalive of its own
+    if (client->close_reason == NULL && keepalive > 0 && client->channel < 0 &&
+        deadline_passed(client->next_ping, now, &next)) {
+        if (client->pong_pending) {
+            client->close_reason = "ping timeout";
+        } else {
+            client->ping_pending = true;
+            client->next_ping = now + keepalive;
+            if (client->next_ping < next)
+                next = client->next_ping;
         }
     }
-    pthread_mutex_unlock(&server->mutex);
+
+    if (client->close_reason != NULL || client->ping_pending)
+        lws_callback_on_writable(client->wsi);
+    if (client->close_reason == NULL && next != UINT64_MAX)
+        timer_add(&client->server->timers, timer, next - now);
 }
 
 void
 tty_client_destroy(struct tty_client *client) {
-    if (!client->running || client->pid <= 0)
-        goto cleanup;
+    TRACE1(teardown, client->id);
+    timer_cancel(&client->timer);
+    file_transfer_end(client);
+    if (client->file_status != NULL) {
+        free(client->file_status);
+        client->file_status = NULL;
+    }
 
+    pthread_mutex_lock(&client->mutex);
     client->running = false;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->mutex);
+
+    if (client->pty_buffer != NULL) {
+        // the pty may stay open in a background process, wake the thread up before waiting for it
+        if (client->wake[1] >= 0 && write(client->wake[1], "", 1) < 0)
+            lwsl_err("wake up pty thread: %d (%s)\n", errno, strerror(errno));
+        pthread_join(client->thread, NULL);
+        pty_buffer_release(client->server, client->pty_buffer);
+        client->pty_buffer = NULL;
+    }
 
-    // kill process and free resource
-    lwsl_notice("sending %s (%d) to process %d\n", server->sig_name, server->sig_code, client->pid);
-    if (kill(client->pid, server->sig_code) != 0) {
-        lwsl_err("kill: %d, errno: %d (%s)\n", client->pid, errno, strerror(errno));
-    }
-    int status;
-    while (waitpid(client->pid, &status, 0) == -1 && errno == EINTR)
-        ;
-    lwsl_notice("process exited with code %d, pid: %d\n", status, client->pid);
-    close(client->pty);
-
-cleanup:
-    // free the command arguments
-    if (client->argv != NULL) {
-        for (int i = 0; client->argv[i] != NULL; i++) {
-            free(client->argv[i]);
+    if (client->pid > 0) {
+        // kill process and free resource
+        log_event(LLL_NOTICE, NULL, "process_kill", "pid=%d signal=%s", client->pid, client->server->sig_name);
+        if (kill(client->pid, client->server->sig_code) != 0) {
+            lwsl_err("kill: %d, errno: %d (%s)\n", client->pid, errno, strerror(errno));
         }
-        free(client->argv);
-        client->argv = NULL;
+        int status;
+        while (waitpid(client->pid, &status, 0) == -1 && errno == EINTR)
+            ;
+        log_event(LLL_NOTICE, NULL, "process_exit", "pid=%d status=%d", client->pid, status);
+        if (client->cgroup != NULL) {
+            cgroup_remove(client->cgroup);
+            free(client->cgroup);
+            client->cgroup = NULL;
+        }
+        if (client->throttled > 0)
+            lwsl_notice("output of process %d was throttled for %.1fs\n", client->pid, (double) client->throttled / 1e6);
+        close(client->pty);
+    }
+    if (client->wake[0] >= 0) {
+        close(client->wake[0]);
+        close(client->wake[1]);
+    }
+    if (client->playback != NULL) {
+        playback_close(client->playback);
+        client->playback = NULL;
+    }
+
+    // free the fragments and command arguments
+    arena_free(&client->arena);
+    client->fragment = NULL;
+    client->argv = NULL;
+
+    // release the service table, it may have been replaced by a reload
+    if (client->service_table != NULL) {
+        service_table_unref(client->service_table);
+        client->service_table = NULL;
+        client->service = NULL;
     }
 
-    // free the buffer
-    if (client->buffer != NULL)
+    // free the receive buffer
+    if (client->buffer != NULL) {
         free(client->buffer);
+        client->buffer = NULL;
+    }
 
     pthread_mutex_destroy(&client->mutex);
 
+    if (client->queued)
+        tty_queue_remove(client);
+    if (client->admitted) {
+        admission_release(&client->server->admission, &client->source);
+        client->admitted = false;
+    }
+
     // remove from client list
     tty_client_remove(client);
 }
 
+// Make room for more output while the previous one is still waiting to be sent, the
+// pending output is replaced by a repaint of the screen model once the buffer is full.
+bool
+pty_buffer_room(struct tty_client *client, char *repaint, size_t size) {
+    if (client->vt == NULL || client->pty_len <= 0)
+        return false;
+    if (client->pty_len < BUF_SIZE - UTF8_TAIL_MAX)
+        return true;
+    // part of the output is already on its way, the repaint would follow half a sequence
+    if (client->pty_sent > 0)
+        return false;
+
+    size_t n = vt_render(client->vt, repaint, size);
+    if (n == 0)
+        return false;
+    memcpy(client->pty_buffer + MSG_PRE, repaint, n);
+    client->pty_len = n;
+    client->pty_sent = 0;
+    return true;
+}
+
+// Add the tokens earned since the last refill
+void
+token_bucket_refill(struct token_bucket *bucket) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double) (now.tv_sec - bucket->last.tv_sec) + (double) (now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->last = now;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+}
+
+// Write all of buf to the pty, waiting for room when the program does not keep up
+bool
+pty_write(int pty, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(pty, buf, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {pty, POLLOUT, 0};
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                    return false;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+// Close the session once its pending output is sent, the pty can not be waited for
+void
+pty_output_error(struct tty_client *client) {
+    lwsl_err("select: %d (%s)\n", errno, strerror(errno));
+    pthread_mutex_lock(&client->mutex);
+    while (client->running && client->state == STATE_READY) {
+        pthread_cond_wait(&client->cond, &client->mutex);
+    }
+    client->pty_len = -1;
+    client->state = STATE_READY;
+    pthread_mutex_unlock(&client->mutex);
+}
+
 void *
 thread_run_command(void *args) {
     struct tty_client *client;
     int pty;
     fd_set des_set;
+    char repaint[BUF_SIZE / 2];
+    char tail[UTF8_TAIL_MAX];
+    size_t tail_len = 0;
 
     client = (struct tty_client *) args;
+
+    // every session is kept out of the cgroup of ttyd once cgroups are set up
+    char *cgroup = cgroup_create(client->service->cgroup);
+    if (cgroup == NULL && client->service->cgroup != NULL) {
+        // do not run the command without its limits, close the connection
+        pthread_mutex_lock(&client->mutex);
+        client->pty_len = -1;
+        client->state = STATE_READY;
+        pthread_mutex_unlock(&client->mutex);
+        pthread_exit((void *) 1);
+    }
+
+    TRACE1(spawn_start, client->id);
     pid_t pid = forkpty(&pty, NULL, NULL, NULL);
 
     switch (pid) {
@@ -194,7 +686,11 @@ thread_run_command(void *args) {
             lwsl_err("forkpty, error: %d (%s)\n", errno, strerror(errno));
             break;
         case 0: /* child */
-            if (setenv("TERM", server->terminal_type, true) < 0) {
+            if (cgroup != NULL && cgroup_enter(cgroup) < 0) {
+                perror("cgroup");
+                pthread_exit((void *) 1);
+            }
+            if (setenv("TERM", client->server->terminal_type, true) < 0) {
                 perror("setenv");
                 pthread_exit((void *) 1);
             }
@@ -202,319 +698,861 @@ thread_run_command(void *args) {
                 perror("execvp");
                 pthread_exit((void *) 1);
             }
-            for (int i = 0; client->argv[i] != NULL; i++) {
-                free(client->argv[i]);
-            }
-            free(client->argv);
-            client->argv = NULL;
             break;
         default: /* parent */
-            lwsl_notice("started process, pid: %d\n", pid);
+            log_event(LLL_NOTICE, NULL, "process_start", "pid=%d address=%s", pid, client->address);
             client->pid = pid;
             client->pty = pty;
-            client->running = true;
+            if (cgroup != NULL && client->service->cgroup != NULL && client->service->cgroup->per_session) {
+                client->cgroup = cgroup;
+                cgroup = NULL;
+            }
             if (client->size.ws_row > 0 && client->size.ws_col > 0)
                 ioctl(client->pty, TIOCSWINSZ, &client->size);
 
+            if (client->service->coalesce) {
+                pthread_mutex_lock(&client->mutex);
+                client->vt = vt_new(client->size.ws_col, client->size.ws_row);
+                pthread_mutex_unlock(&client->mutex);
+            }
+            if (client->service->record != NULL) {
+                struct recorder *recorder = recorder_new(client->service->record, pid, client->argv,
+                                                         client->server->terminal_type, client->size.ws_col,
+                                                         client->size.ws_row);
+                pthread_mutex_lock(&client->mutex);
+                client->recorder = recorder;
+                pthread_mutex_unlock(&client->mutex);
+            }
+
+            TRACE2(spawn_end, client->id, pid);
+
+            struct token_bucket bucket = {(double) client->service->rate_limit, (double) client->service->rate_burst};
+            bucket.tokens = bucket.burst;
+            clock_gettime(CLOCK_MONOTONIC, &bucket.last);
+
+            // the pty is non-blocking: it is read until read() fails with EAGAIN, select() is
+            // only called once it has been drained. A pty read returns 4K at most, so the
+            // size of a read does not tell whether more output is waiting.
+            fcntl(pty, F_SETFL, fcntl(pty, F_GETFL) | O_NONBLOCK);
+            bool readable = false;
             while (client->running) {
-                FD_ZERO (&des_set);
-                FD_SET (pty, &des_set);
+                if (readable && bucket.rate > 0) {
+                    // leave the output in the pty until the bucket refills, the program
+                    // blocks on the full pty in the meantime
+                    token_bucket_refill(&bucket);
+                    double min = bucket.burst < RATE_MIN_READ ? bucket.burst : RATE_MIN_READ;
+                    if (bucket.tokens < min) {
+                        double wait = (min - bucket.tokens) / bucket.rate;
+                        struct timeval timeout = {(time_t) wait, (suseconds_t) ((wait - (double) (time_t) wait) * 1e6)};
+                        FD_ZERO (&des_set);
+                        FD_SET (client->wake[0], &des_set);
+                        int ready = select(client->wake[0] + 1, &des_set, NULL, NULL, &timeout);
+                        // a signal handled by this thread (SIGHUP, SIGUSR1) cuts the wait short
+                        if (ready < 0 && errno == EINTR)
+                            continue;
+                        if (ready < 0)
+                            pty_output_error(client);
+                        if (ready != 0)
+                            break;
+                        uint64_t waited = (uint64_t) (wait * 1e6);
+                        __atomic_add_fetch(&client->throttled, waited, __ATOMIC_RELAXED);
+                        TRACE2(throttle, client->id, waited);
+                        token_bucket_refill(&bucket);
+                    }
+                }
+                if (!readable) {
+                    FD_ZERO (&des_set);
+                    FD_SET (pty, &des_set);
+                    FD_SET (client->wake[0], &des_set);
 
-                if (select(pty + 1, &des_set, NULL, NULL, NULL) < 0)
-                    break;
+                    // wait a moment for the rest of an incomplete utf-8 sequence, then send it as is
+                    struct timeval timeout = {0, UTF8_TAIL_TIMEOUT};
+                    int nfds = (pty > client->wake[0] ? pty : client->wake[0]) + 1;
+                    int ready = select(nfds, &des_set, NULL, NULL, tail_len > 0 ? &timeout : NULL);
+                    if (ready < 0 && errno == EINTR)
+                        continue;
+                    if (ready < 0)
+                        pty_output_error(client);
+                    if (ready < 0 || FD_ISSET (client->wake[0], &des_set))
+                        break;
+                    readable = FD_ISSET (pty, &des_set);
+                }
 
-                if (FD_ISSET (pty, &des_set)) {
-                    while (client->running) {
-                        pthread_mutex_lock(&client->mutex);
-                        while (client->state == STATE_READY) {
+                pthread_mutex_lock(&client->mutex);
+                while (client->running && client->state == STATE_READY &&
+                       !pty_buffer_room(client, repaint, sizeof(repaint))) {
+                    pthread_cond_wait(&client->cond, &client->mutex);
+                }
+                if (!client->running) {
+                    pthread_mutex_unlock(&client->mutex);
+                    break;
+                }
+                size_t offset = client->state == STATE_READY ? (size_t) client->pty_len : 0;
+                char *ptr = client->pty_buffer + MSG_PRE + offset;
+                memcpy(ptr, tail, tail_len);
+                size_t len = tail_len;
+                if (readable) {
+                    size_t size = BUF_SIZE - offset - tail_len;
+                    if (bucket.rate > 0 && size > (size_t) bucket.tokens)
+                        size = bucket.tokens >= 1 ? (size_t) bucket.tokens : 1;
+                    ssize_t n = read(pty, ptr + tail_len, size);
+                    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        readable = false;
+                        pthread_mutex_unlock(&client->mutex);
+                        continue;
+                    }
+                    if (n <= 0) {
+                        // send the pending output before reporting the read error
+                        while (client->running && client->state == STATE_READY) {
                             pthread_cond_wait(&client->cond, &client->mutex);
                         }
-                        memset(client->pty_buffer, 0, sizeof(client->pty_buffer));
-                        client->pty_len = read(pty, client->pty_buffer + LWS_PRE + 1, BUF_SIZE);
+                        client->pty_len = n;
                         client->state = STATE_READY;
                         pthread_mutex_unlock(&client->mutex);
                         break;
                     }
+                    TRACE2(pty_read, client->id, n);
+                    bucket.tokens -= n;
+                    if (client->service->idle_output_timeout > 0)
+                        __atomic_store_n(&client->last_output, time_monotonic(), __ATOMIC_RELAXED);
+                    if (client->vt != NULL)
+                        vt_feed(client->vt, ptr + tail_len, (size_t) n);
+                    len += n;
+                    // keep an incomplete utf-8 sequence for the next frame, the client decodes each frame on its own
+                    size_t complete = utf8_complete_length(ptr, len);
+                    tail_len = len - complete;
+                    memcpy(tail, ptr + complete, tail_len);
+                    len = complete;
+                } else {
+                    tail_len = 0;
                 }
-                if (client->pty_len <= 0) {
-                    break;
+                // copied before the output is published: once it is READY the writable callback
+                // sends it in parts and writes each frame header over the part sent before
+                if (len > 0)
+                    recorder_output(client->recorder, ptr, len);
+                if (offset + len > 0) {
+                    client->pty_len = offset + len;
+                    client->state = STATE_READY;
+                    TRACE2(frame_enqueue, client->id, client->pty_len);
                 }
+                pthread_mutex_unlock(&client->mutex);
             }
+
+            pthread_mutex_lock(&client->mutex);
+            vt_free(client->vt);
+            client->vt = NULL;
+            struct recorder *recorder = client->recorder;
+            client->recorder = NULL;
+            pthread_mutex_unlock(&client->mutex);
+            recorder_close(recorder);
             break;
     }
 
+    free(cgroup);
     pthread_exit((void *) 0);
 }
 
-int
-callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
-             void *user, void *in, size_t len) {
-    struct tty_client *client = (struct tty_client *) user;
+// Copy output to the pty buffer, wait for the previous output to be sent first,
+// returns false if the client is gone
+bool
+pty_buffer_write(struct tty_client *client, const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len;
+        if (n > BUF_SIZE) {
+            n = utf8_complete_length(data, BUF_SIZE);
+            if (n == 0)
+                n = BUF_SIZE;
+        }
+        pthread_mutex_lock(&client->mutex);
+        while (client->running && client->state == STATE_READY) {
+            pthread_cond_wait(&client->cond, &client->mutex);
+        }
+        if (!client->running) {
+            pthread_mutex_unlock(&client->mutex);
+            return false;
+        }
+        memcpy(client->pty_buffer + MSG_PRE, data, n);
+        client->pty_len = n;
+        client->state = STATE_READY;
+        pthread_mutex_unlock(&client->mutex);
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void *
+thread_run_playback(void *args) {
+    struct tty_client *client = (struct tty_client *) args;
+    struct playback *playback = client->playback;
+    const char *data;
+    size_t len;
+    double start = playback_start(playback);
+    double time, last = 0;
+    struct timespec deadline;
+
+    lwsl_notice("started playback: %s\n", client->argv[0]);
+    data = playback_keyframe(playback, &len);
+    if (data != NULL && !pty_buffer_write(client, data, len))
+        pthread_exit((void *) 0);
+
+    // events before the start time are sent at once, the others at their recorded pace
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    while (client->running && playback_next(playback, &time, &data, &len)) {
+        if (time > start) {
+            double gap = time - (last > start ? last : start);
+            if (gap > PLAYBACK_IDLE_MAX)
+                gap = PLAYBACK_IDLE_MAX;
+            deadline.tv_sec += (time_t) gap;
+            deadline.tv_nsec += (long) ((gap - (double) (time_t) gap) * 1e9);
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&client->mutex);
+            while (client->running && pthread_cond_timedwait(&client->cond, &client->mutex, &deadline) != ETIMEDOUT)
+                ;
+            pthread_mutex_unlock(&client->mutex);
+        }
+        last = time;
+        if (!pty_buffer_write(client, data, len))
+            pthread_exit((void *) 0);
+    }
+
+    // end of the recording, close the connection
+    pthread_mutex_lock(&client->mutex);
+    while (client->running && client->state == STATE_READY) {
+        pthread_cond_wait(&client->cond, &client->mutex);
+    }
+    client->pty_len = 0;
+    client->state = STATE_READY;
+    pthread_mutex_unlock(&client->mutex);
+
+    pthread_exit((void *) 0);
+}
+
+// Get the admission source of a connection: its address and its basic auth credential, if any
+void
+ws_admission_source(struct lws *wsi, struct admission_source *source) {
+    char address[50] = "";
+#if LWS_LIBRARY_VERSION_MAJOR >= 2
+    // no reverse lookup here, the connection may well be refused
+    lws_get_peer_simple(wsi, address, sizeof(address));
+#else
+    char name[100];
+    lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi), name, sizeof(name), address, sizeof(address));
+#endif
+    int credential_length = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_AUTHORIZATION);
+    char credential[credential_length + 1];
+    if (lws_hdr_copy(wsi, credential, sizeof(credential), WSI_TOKEN_HTTP_AUTHORIZATION) <= 0)
+        credential[0] = '\0';
+    admission_source_init(source, address, credential);
+}
+
+// Log a connection or session refused by the admission control, these may come in floods
+void
+admission_refused(enum admission_result result) {
+    switch (result) {
+        case ADMISSION_RATE:
+            lwsl_info("refuse to serve WS client due to the connection rate limit.\n");
+            break;
+        case ADMISSION_CONCURRENCY:
+            lwsl_info("refuse to serve WS client due to the session limit.\n");
+            break;
+        case ADMISSION_FULL:
+            lwsl_info("refuse to serve WS client, the admission table is full.\n");
+            break;
+        default:
+            break;
+    }
+}
+
+// Check a new websocket connection against the --once, --max-clients and --check-origin
+// options, then against the limits of its source
+bool
+ws_connection_allowed(struct lws *wsi, struct admission_source *source) {
+    struct tty_server *server = wsi_server(wsi);
     char buf[256];
-    size_t n = 0;
-    int m;
 
-    switch (reason) {
-        case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
-            if (server->once && server->client_count > 0) {
-                lwsl_warn("refuse to serve WS client due to the --once option.\n");
-                return 1;
+    if (server->once && client_count(server) > 0) {
+        lwsl_warn("refuse to serve WS client due to the --once option.\n");
+        return false;
+    }
+    if (server->max_clients > 0 && client_count(server) >= server->max_clients && server->queue_length >= server->max_queue) {
+        lwsl_warn("refuse to serve WS client due to the --max-clients option.\n");
+        return false;
+    }
+    if (request_path(wsi, buf, sizeof(buf)) <= 0 || strcmp(buf, WS_PATH) != 0) {
+        lwsl_warn("refuse to serve WS client for illegal ws path: %s\n", buf);
+        return false;
+    }
+
+    if (server->check_origin && !check_host_origin(wsi)) {
+        lwsl_warn("refuse to serve WS client from different origin due to the --check-origin option.\n");
+        return false;
+    }
+
+    ws_admission_source(wsi, source);
+    enum admission_result result = admission_check(&server->admission, source);
+    if (result != ADMISSION_OK) {
+        admission_refused(result);
+        return false;
+    }
+    return true;
+}
+
+// Save the GET argument fragments of the connection for reuse
+char **
+ws_fragments(struct lws *wsi, struct arena *arena) {
+    char buf[256];
+    int m = 0;
+    while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, m) >= 0 ) {
+        m++;
+    }
+    char **fragment = arena_alloc(arena, sizeof(char *) * (1 + m));
+    m = 0;
+    while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, m) >= 0 ) {
+        fragment[m] = arena_strdup(arena, buf);
+        m++;
+    }
+    fragment[m] = NULL;
+    return fragment;
+}
+
+// Initialize a client of the websocket connection wsi
+void
+tty_client_init(struct tty_client *client, struct lws *wsi) {
+    // identifies the session in the traces, unique across the servers of the process
+    static uint64_t next_id = 0;
+    client->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    client->server = wsi_server(wsi);
+    client->running = false;
+    client->argv = NULL;
+    client->service = NULL;
+    client->service_table = NULL;
+    client->vt = NULL;
+    client->recorder = NULL;
+    client->playback = NULL;
+    client->pty_buffer = NULL;
+    client->pid = 0;
+    client->pty = 0;
+    client->wake[0] = client->wake[1] = -1;
+    client->initialized = false;
+    client->handshake = false;
+    client->initial_cmd_index = 0;
+    client->authenticated = false;
+    client->wsi = wsi;
+    client->buffer = NULL;
+    client->buffer_size = 0;
+    client->len = 0;
+    client->state = STATE_INIT;
+    client->pty_len = 0;
+    client->pty_sent = 0;
+    client->deficit = 0;
+    client->weight = 1;
+    client->throttled = 0;
+    client->cgroup = NULL;
+    client->timer.active = false;
+    client->ping_pending = false;
+    client->pong_pending = false;
+    client->close_reason = NULL;
+    client->transfer = NULL;
+    client->file_buffer = NULL;
+    client->file_status = NULL;
+    client->upload_fragment = false;
+    client->channel = -1;
+    client->close_status = 0;
+    client->paused = false;
+    client->admitted = false;
+    client->queued = false;
+    client->queue_position_pending = false;
+    pthread_mutex_init(&client->mutex, NULL);
+    pthread_cond_init(&client->cond, NULL);
+    // the address only, a reverse lookup would hold the service thread for every connection
+#if LWS_LIBRARY_VERSION_MAJOR >= 2
+    lws_get_peer_simple(wsi, client->address, sizeof(client->address));
+#else
+    lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi), client->hostname, sizeof(client->hostname),
+                           client->address, sizeof(client->address));
+#endif
+    // the host name comes from the cache, or later once the resolver thread got it
+    client->hostname[0] = '\0';
+    resolver_lookup(client->address, client->hostname, sizeof(client->hostname));
+}
+
+// Host name of the client, NULL until it is resolved
+const char *
+client_hostname(struct tty_client *client) {
+    if (client->hostname[0] == '\0' && !resolver_lookup(client->address, client->hostname, sizeof(client->hostname)))
+        return NULL;
+    return client->hostname;
+}
+
+// Whether the writable callback has something to send for the session
+bool
+tty_client_pending(struct tty_client *client) {
+    if (client->close_reason != NULL || client->ping_pending || client->file_status != NULL)
+        return true;
+    if (client->queued)
+        return client->queue_position_pending;
+    if (!client->initialized)
+        return client->argv != NULL;
+    if (client->paused)
+        return false;
+    if (client->transfer != NULL && !client->transfer->upload)
+        return true;
+    pthread_mutex_lock(&client->mutex);
+    bool ready = client->state == STATE_READY && (client->pty_len <= 0 || client->deficit > 0);
+    pthread_mutex_unlock(&client->mutex);
+    return ready;
+}
+
+// Send the next message of the session, returns -1 when the session has to be closed
+int
+tty_client_writable(struct lws *wsi, struct tty_client *client) {
+    size_t n;
+
+    if (client->close_reason != NULL) {
+        log_event(LLL_NOTICE, NULL, "session_close", "address=%s hostname=%s reason=%s", client->address,
+                  client_hostname(client), client->close_reason);
+        client_close_reason(client, LWS_CLOSE_STATUS_GOINGAWAY);
+        return -1;
+    }
+    if (client->ping_pending) {
+        unsigned char ping[LWS_PRE + 1];
+        client->ping_pending = false;
+        if (lws_write(wsi, ping + LWS_PRE, 0, LWS_WRITE_PING) < 0) {
+            lwsl_err("write ping to WS\n");
+            return -1;
+        }
+        client->pong_pending = true;
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+    if (client->queued) {
+        if (client->queue_position_pending) {
+            unsigned char message[MSG_PRE + 16];
+            client->queue_position_pending = false;
+            int n = sprintf((char *) message + MSG_PRE, "%d", client->queue_position);
+            if (client_write(client, QUEUE_POSITION, message + MSG_PRE, (size_t) n) < 0) {
+                lwsl_err("write queue position to WS\n");
+                return -1;
             }
-            if (server->max_clients > 0 && server->client_count == server->max_clients) {
-                lwsl_warn("refuse to serve WS client due to the --max-clients option.\n");
-                return 1;
+        }
+        return 0;
+    }
+    if (!client->initialized) {
+        if (client->initial_cmd_index == sizeof(initial_cmds)) {
+            client->initialized = true;
+            return 0;
+        }
+        if (client->argv != NULL && client->handshake) {
+            if (send_handshake(wsi, client) < 0) {
+                tty_client_remove(client);
+                client_close_reason(client, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+                return -1;
             }
-            if (lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_GET_URI) <= 0 || strcmp(buf, WS_PATH) != 0) {
-                lwsl_warn("refuse to serve WS client for illegal ws path: %s\n", buf);
-                return 1;
+            client->initialized = true;
+            lws_callback_on_writable(wsi);
+            return 0;
+        }
+        if (client->argv != NULL) {
+            if (send_initial_message(wsi, client) < 0) {
+                tty_client_remove(client);
+                client_close_reason(client, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+                return -1;
             }
+            client->initial_cmd_index++;
+            lws_callback_on_writable(wsi);
+            return 0;
+        }
+        return 0;
+    }
+    if (client->file_status != NULL) {
+        if (send_file_status(wsi, client) < 0) {
+            lwsl_err("write file status to WS\n");
+            return -1;
+        }
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+    // the client asked to hold the output of the session back
+    if (client->paused)
+        return 0;
+    pthread_mutex_lock(&client->mutex);
+    if (client->state != STATE_READY) {
+        pthread_mutex_unlock(&client->mutex);
+        // the terminal output goes first, the download fills the gaps
+        if (client->transfer != NULL && !client->transfer->upload)
+            return send_file_chunk(wsi, client);
+        return 0;
+    }
 
-            if (server->check_origin && !check_host_origin(wsi)) {
-                lwsl_warn("refuse to serve WS client from different origin due to the --check-origin option.\n");
-                return 1;
-            }
+    // read error or client exited, close connection
+    if (client->pty_len <= 0) {
+        pthread_mutex_unlock(&client->mutex);
+        client_close_reason(client, client->pty_len == 0 ? LWS_CLOSE_STATUS_NORMAL
+                                                         : LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+        return -1;
+    }
 
-            // Save GET argument fragments for reuse
-            client->fragment = NULL;
-            m = 0;
-            while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, m) >= 0 ) {
-                m++;
-            }
-            char **fragment = malloc(sizeof(char *) * (1 + m));
-            m = 0;
-            while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_URI_ARGS, m) >= 0 ) {
-                fragment[m] = strdup(buf);
-                m++;
-            }
-            fragment[m] = NULL;
-            client->fragment = fragment;
-            break;
+    // send at most the share granted by the scheduler, the rest goes on the next ticks
+    char *data = client->pty_buffer + MSG_PRE + client->pty_sent;
+    n = (size_t) client->pty_len - client->pty_sent;
+    if (n > client->deficit) {
+        n = utf8_complete_length(data, client->deficit);
+        if (n == 0) {
+            pthread_mutex_unlock(&client->mutex);
+            return 0;
+        }
+    }
+    // the sent output is overwritten by the frame header
+    if (client_write(client, OUTPUT, (unsigned char *) data, n) < 0) {
+        lwsl_err("write data to WS\n");
+    }
+    client->deficit -= n;
+    client->pty_sent += n;
+    if (client->pty_sent == (size_t) client->pty_len) {
+        client->pty_sent = 0;
+        client->deficit = 0;
+        client->state = STATE_DONE;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (client->transfer != NULL && !client->transfer->upload)
+        lws_callback_on_writable(wsi);
+    return 0;
+}
 
-        case LWS_CALLBACK_ESTABLISHED:
-            client->running = false;
-            client->argv = NULL;
-            client->initialized = false;
-            client->initial_cmd_index = 0;
-            client->authenticated = false;
-            client->wsi = wsi;
-            client->buffer = NULL;
-            client->state = STATE_INIT;
-            client->pty_len = 0;
-            pthread_mutex_init(&client->mutex, NULL);
-            pthread_cond_init(&client->cond, NULL);
-            lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi),
-                                   client->hostname, sizeof(client->hostname),
-                                   client->address, sizeof(client->address));
-
-            pthread_mutex_lock(&server->mutex);
-            LIST_INSERT_HEAD(&server->clients, client, list);
-            server->client_count++;
-            pthread_mutex_unlock(&server->mutex);
-            lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_GET_URI);
-
-            lwsl_notice("WS   %s - %s (%s), clients: %d\n", buf, client->address, client->hostname, server->client_count);
-            break;
+// Create the wake pipe of a session. It is close on exec from the start: the other
+// sessions fork their commands from threads of their own at any time.
+int
+wake_pipe(int fds[2]) {
+#ifdef HAVE_PIPE2
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
 
-        case LWS_CALLBACK_SERVER_WRITEABLE:
-            if (!client->initialized) {
-                if (client->initial_cmd_index == sizeof(initial_cmds)) {
-                    client->initialized = true;
-                    break;
-                }
-                if (client->argv != NULL) {
-                    if (send_initial_message(wsi, client) < 0) {
-                        tty_client_remove(client);
-                        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-                        return -1;
-                    }
-                    client->initial_cmd_index++;
-                    lws_callback_on_writable(wsi);
-                    return 0;
-                }
+// Start the command (or the playback) of the session, returns 1 on failure
+int
+tty_client_start(struct tty_client *client) {
+    if (client->playback == NULL && wake_pipe(client->wake) < 0) {
+        lwsl_err("pipe: %d (%s)\n", errno, strerror(errno));
+        client->wake[0] = client->wake[1] = -1;
+        return 1;
+    }
+    // the output buffer is only attached to sessions, not to every connection
+    client->pty_buffer = pty_buffer_alloc(client->server);
+    client->running = true;
+    int err = pthread_create(&client->thread, NULL,
+                             client->playback != NULL ? thread_run_playback : thread_run_command, client);
+    if (err != 0) {
+        lwsl_err("pthread_create return: %d\n", err);
+        client->running = false;
+        pty_buffer_release(client->server, client->pty_buffer);
+        client->pty_buffer = NULL;
+        return 1;
+    }
+
+    // keepalive and timeouts, checked by the timer wheel from now on
+    client->started = client->last_input = client->last_output = client->server->timers.now;
+    client->next_ping = client->server->timers.now + client->service->keepalive;
+    client->timer.cb = client_timer_fire;
+    client->timer.data = client;
+    timer_add(&client->server->timers, &client->timer, 1);
+    return 0;
+}
+
+// Handle a received message (or part of it), returns non zero when the session has to be closed
+int
+tty_client_receive(struct lws *wsi, struct tty_client *client, void *in, size_t len) {
+    struct tty_server *server = client->server;
+    char buf[256];
+    int m;
+
+    // upload data goes to the file as it arrives, without going through the receive buffer
+    if (client->upload_fragment || (client->transfer != NULL && client->transfer->upload &&
+                                    client->len == 0 && len > 0 && *(char *) in == FILE_UPLOAD)) {
+        const char *data = in;
+        if (!client->upload_fragment) {
+            data++;
+            len--;
+        }
+        client->upload_fragment = lws_remaining_packet_payload(wsi) > 0 || !lws_is_final_fragment(wsi);
+        client->last_input = server->timers.now;
+        // the rest of an upload that failed is dropped
+        if (client->transfer != NULL && client->transfer->upload)
+            file_upload(client, data, len);
+        return 0;
+    }
+
+    // the receive buffer is kept between messages, it only grows for large messages
+    if (client->len + len + 1 > client->buffer_size) {
+        size_t size = client->buffer_size > 0 ? client->buffer_size : RECV_BUFFER_SIZE;
+        while (size < client->len + len + 1)
+            size *= 2;
+        client->buffer = xrealloc(client->buffer, size);
+        client->buffer_size = size;
+    }
+    memcpy(client->buffer + client->len, in, len);
+    client->len += len;
+    client->buffer[client->len] = '\0';
+    client->last_input = server->timers.now;
+    client->pong_pending = false;
+
+    const char command = client->buffer[0];
+
+    // check auth
+    if (server->credential != NULL && !client->authenticated && command != JSON_DATA) {
+        lwsl_warn("WS client not authenticated\n");
+        return 1;
+    }
+
+    // check if there are more fragmented messages
+    if (lws_remaining_packet_payload(wsi) > 0 || !lws_is_final_fragment(wsi)) {
+        return 0;
+    }
+
+    switch (command) {
+        case INPUT:
+            if (client->pty == 0)
                 break;
+            if (server->readonly) {
+                client->len = 0;
+                return 0;
             }
-            if (client->state != STATE_READY)
-                break;
-
-            // read error or client exited, close connection
-            if (client->pty_len <= 0) {
-                lws_close_reason(wsi,
-                                 client->pty_len == 0 ? LWS_CLOSE_STATUS_NORMAL
-                                                       : LWS_CLOSE_STATUS_UNEXPECTED_CONDITION,
-                                 NULL, 0);
+            if (!pty_write(client->pty, client->buffer + 1, client->len - 1)) {
+                lwsl_err("write INPUT to pty: %d (%s)\n", errno, strerror(errno));
+                tty_client_remove(client);
+                client_close_reason(client, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
                 return -1;
             }
-
-            client->pty_buffer[LWS_PRE] = OUTPUT;
-            n = (size_t) (client->pty_len + 1);
-            if (lws_write(wsi, (unsigned char *) client->pty_buffer + LWS_PRE, n, LWS_WRITE_BINARY) < n) {
-                lwsl_err("write data to WS\n");
+            TRACE2(input, client->id, client->len - 1);
+            break;
+        case RESIZE_TERMINAL:
+            if (parse_window_size(client->buffer + 1, &client->size) && client->pty > 0) {
+                TRACE3(resize, client->id, client->size.ws_col, client->size.ws_row);
+                pthread_mutex_lock(&client->mutex);
+                if (client->vt != NULL)
+                    vt_resize(client->vt, client->size.ws_col, client->size.ws_row);
+                if (client->recorder != NULL)
+                    recorder_resize(client->recorder, client->size.ws_col, client->size.ws_row);
+                pthread_mutex_unlock(&client->mutex);
+                if (ioctl(client->pty, TIOCSWINSZ, &client->size) == -1) {
+                    lwsl_err("ioctl TIOCSWINSZ: %d (%s)\n", errno, strerror(errno));
+                }
             }
-            client->state = STATE_DONE;
             break;
-
-        case LWS_CALLBACK_RECEIVE:
-            if (client->buffer == NULL) {
-                client->buffer = xmalloc(len);
-                client->len = len;
-                memcpy(client->buffer, in, len);
-            } else {
-                client->buffer = xrealloc(client->buffer, client->len + len);
-                memcpy(client->buffer + client->len, in, len);
-                client->len += len;
+        case FILE_REQUEST:
+            if (client->service != NULL)
+                file_request(client, client->buffer + 1);
+            break;
+        case FILE_UPLOAD:
+            // data of a cancelled upload
+            break;
+        case PAUSE:
+            client->paused = true;
+            break;
+        case RESUME:
+            client->paused = false;
+            lws_callback_on_writable(wsi);
+            break;
+        case JSON_DATA:
+            if (client->pid > 0 || client->argv != NULL)
+                break;
+            json_object *obj = json_tokener_parse(client->buffer);
+            struct json_object *o = NULL;
+            if (server->credential != NULL) {
+                if (json_object_object_get_ex(obj, "AuthToken", &o)) {
+                    const char *token = json_object_get_string(o);
+                    if (token != NULL && !strcmp(token, server->credential))
+                        client->authenticated = true;
+                    else
+                        lwsl_warn("WS authentication failed with token: %s\n", token);
+                }
+                TRACE2(auth, client->id, client->authenticated);
+                if (!client->authenticated) {
+                    tty_client_remove(client);
+                    client_close_reason(client, LWS_CLOSE_STATUS_POLICY_VIOLATION);
+                    return -1;
+                }
             }
 
-            const char command = client->buffer[0];
+            // clients that understand the single frame handshake say so
+            if (json_object_object_get_ex(obj, "Handshake", &o))
+                client->handshake = json_object_get_boolean(o);
 
-            // check auth
-            if (server->credential != NULL && !client->authenticated && command != JSON_DATA) {
-                lwsl_warn("WS client not authenticated\n");
-                return 1;
+            if (!json_object_object_get_ex(obj, "ServicePath", &o)) {
+                lwsl_warn("Disconnecting client, missing service path.\n");
+                tty_client_remove(client);
+                client_close_reason(client, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+                return -1;
             }
-
-            // check if there are more fragmented messages
-            if (lws_remaining_packet_payload(wsi) > 0 || !lws_is_final_fragment(wsi)) {
-                return 0;
+            const char *service_path = json_object_get_string(o);
+            if (service_path == NULL || strlen(service_path) == 0) {
+                lwsl_warn("Disconnecting client, service path could not be null or blank.\n");
+                tty_client_remove(client);
+                client_close_reason(client, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+                return -1;
             }
-
-            switch (command) {
-                case INPUT:
-                    if (client->pty == 0)
-                        break;
-                    if (server->readonly)
-                        return 0;
-                    if (write(client->pty, client->buffer + 1, client->len - 1) == -1) {
-                        lwsl_err("write INPUT to pty: %d (%s)\n", errno, strerror(errno));
-                        tty_client_remove(client);
-                        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-                        return -1;
+            struct service_table *services = server->services;
+            struct service_t *service;
+            LIST_FOREACH(service, &services->list, list) {
+                if (strcmp(service->path, service_path) == 0 && service->playback_dir != NULL) {
+                    const char *file = get_fragment_value(client->fragment, "file");
+                    const char *start = get_fragment_value(client->fragment, "t");
+                    client->playback = playback_open(service->playback_dir, file, start != NULL ? atof(start) : 0);
+                    if (client->playback != NULL) {
+                        client->argv = arena_alloc(&client->arena, sizeof(char *) * 2);
+                        client->argv[0] = arena_strdup(&client->arena, file);
+                        client->argv[1] = NULL;
+                        client->service = service;
+                        client->service_table = service_table_ref(services);
+                    } else {
+                        lwsl_warn("can not open recording for playback: %s\n", file != NULL ? file : "(null)");
                     }
                     break;
-                case RESIZE_TERMINAL:
-                    if (parse_window_size(client->buffer + 1, &client->size) && client->pty > 0) {
-                        if (ioctl(client->pty, TIOCSWINSZ, &client->size) == -1) {
-                            lwsl_err("ioctl TIOCSWINSZ: %d (%s)\n", errno, strerror(errno));
-                        }
-                    }
-                    break;
-                case JSON_DATA:
-                    if (client->pid > 0)
-                        break;
-                    json_object *obj = json_tokener_parse(client->buffer);
-                    struct json_object *o = NULL;
-                    if (server->credential != NULL) {
-                        if (json_object_object_get_ex(obj, "AuthToken", &o)) {
-                            const char *token = json_object_get_string(o);
-                            if (token != NULL && !strcmp(token, server->credential))
-                                client->authenticated = true;
-                            else
-                                lwsl_warn("WS authentication failed with token: %s\n", token);
-                        }
-                        if (!client->authenticated) {
-                            tty_client_remove(client);
-                            lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
-                            return -1;
-                        }
-                    }
-
-                    if (!json_object_object_get_ex(obj, "ServicePath", &o)) {
-                        lwsl_warn("Disconnecting client, missing service path.\n");
-                        tty_client_remove(client);
-                        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-                        return -1;
-                    }
-                    const char *service_path = json_object_get_string(o);
-                    if (service_path == NULL || strlen(service_path) == 0) {
-                        lwsl_warn("Disconnecting client, service path could not be null or blank.\n");
-                        tty_client_remove(client);
-                        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-                        return -1;
+                }
+                if (strcmp(service->path, service_path) == 0) {
+                    int args_len = 0;
+                    while (service->argv[args_len] != NULL) {
+                        args_len++;
                     }
-                    struct service_t *service;
-                    LIST_FOREACH(service, &server->services, list) {
-                        if (strcmp(service->path, service_path) == 0) {
-                            int args_len = 0;
-                            while (service->argv[args_len] != NULL) {
-                                args_len++;
-                            }
-                            char **client_cmd_argv = malloc(sizeof(char *) * (1 + args_len));
-                            client_cmd_argv[0] = strdup(service->argv[0]);
-                            for (m = 1; m < args_len; m++) {
-                                char *arg = strdup(service->argv[m]);
-                                char *arg_tmp = arg;
-                                while (arg_tmp[0] != '\0') {
-                                    if (arg_tmp[0] == '{') {
-                                        int i = 0;
-                                        while (client->fragment[i] != NULL) {
-                                            strcpy(buf, client->fragment[i]);
-                                            char *ptr = strchr(buf, '=');
-                                            ptr[0] = '\0';
-                                            char *frag_val = ptr + 1;
-                                            int frag_key_len = strlen(buf);
-                                            int frag_val_len = strlen(frag_val);
-                                            if ((strncmp((arg_tmp + 1), buf, frag_key_len) == 0) && (arg_tmp[(1 + frag_key_len)] == '}')) {
-                                                arg_tmp[0] = '\0';
-                                                int m = arg_tmp - arg;
-                                                arg_tmp = arg_tmp + frag_key_len + 2;
-                                                char *arg_new = malloc(m + frag_val_len + strlen(arg_tmp) + 1);
-                                                arg_new[0] = '\0';
-                                                ptr = arg_new;
-                                                ptr = stpcpy(ptr, arg);
-                                                ptr = stpcpy(ptr, frag_val);
-                                                ptr = stpcpy(ptr, arg_tmp);
-                                                free(arg);
-                                                arg = arg_new;
-                                                arg_tmp = arg + m + frag_val_len;
-                                            }
-                                            i++;
-                                        }
+                    char **client_cmd_argv = arena_alloc(&client->arena, sizeof(char *) * (1 + args_len));
+                    client_cmd_argv[0] = arena_strdup(&client->arena, service->argv[0]);
+                    for (m = 1; m < args_len; m++) {
+                        char *arg = arena_strdup(&client->arena, service->argv[m]);
+                        char *arg_tmp = arg;
+                        while (arg_tmp[0] != '\0') {
+                            if (arg_tmp[0] == '{') {
+                                int i = 0;
+                                while (client->fragment[i] != NULL) {
+                                    strcpy(buf, client->fragment[i]);
+                                    char *ptr = strchr(buf, '=');
+                                    ptr[0] = '\0';
+                                    char *frag_val = ptr + 1;
+                                    int frag_key_len = strlen(buf);
+                                    int frag_val_len = strlen(frag_val);
+                                    if ((strncmp((arg_tmp + 1), buf, frag_key_len) == 0) && (arg_tmp[(1 + frag_key_len)] == '}')) {
+                                        arg_tmp[0] = '\0';
+                                        int m = arg_tmp - arg;
+                                        arg_tmp = arg_tmp + frag_key_len + 2;
+                                        char *arg_new = arena_alloc(&client->arena, m + frag_val_len + strlen(arg_tmp) + 1);
+                                        arg_new[0] = '\0';
+                                        ptr = arg_new;
+                                        ptr = stpcpy(ptr, arg);
+                                        ptr = stpcpy(ptr, frag_val);
+                                        ptr = stpcpy(ptr, arg_tmp);
+                                        arg = arg_new;
+                                        arg_tmp = arg + m + frag_val_len;
                                     }
-                                    arg_tmp++;
+                                    i++;
                                 }
-                                client_cmd_argv[m] = arg;
-                            }
-                            client_cmd_argv[m] = NULL;
-                            client->argv = client_cmd_argv;
-                            // free the stored fragments
-                            for (m = 0; client->fragment[m] != NULL; m++) {
-                                free(client->fragment[m]);
                             }
-                            free(client->fragment);
-                            break;
+                            arg_tmp++;
                         }
+                        client_cmd_argv[m] = arg;
                     }
-                    if (client->argv == NULL) {
-                        lwsl_warn("Disconnecting client, missing service command.\n");
-                        tty_client_remove(client);
-                        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-                        return -1;
-                    }
-                    int err = pthread_create(&client->thread, NULL, thread_run_command, client);
-                    if (err != 0) {
-                        lwsl_err("pthread_create return: %d\n", err);
-                        return 1;
-                    }
-                    break;
-                default:
-                    lwsl_warn("ignored unknown message type: %c\n", command);
+                    client_cmd_argv[m] = NULL;
+                    client->argv = client_cmd_argv;
+                    client->service = service;
+                    client->service_table = service_table_ref(services);
+                    client->weight = service->weight;
                     break;
+                }
+            }
+            if (client->argv == NULL) {
+                lwsl_warn("Disconnecting client, missing service command.\n");
+                tty_client_remove(client);
+                client_close_reason(client, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION);
+                return -1;
             }
+            // at --max-clients the session starts once the connection leaves the queue
+            if (client->queued)
+                break;
+            if (tty_client_start(client) != 0)
+                return 1;
+            break;
+        default:
+            lwsl_warn("ignored unknown message type: %c\n", command);
+            break;
+    }
 
-            if (client->buffer != NULL) {
-                free(client->buffer);
-                client->buffer = NULL;
+    client->len = 0;
+    return 0;
+}
+
+// Stop the server when the last client is gone with the --once option
+void
+exit_if_once(struct tty_server *server) {
+    if (server->once && client_count(server) == 0) {
+        lwsl_notice("exiting due to the --once option.\n");
+        ttyd_stop(server);
+    }
+}
+
+int
+callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
+             void *user, void *in, size_t len) {
+    struct tty_client *client = (struct tty_client *) user;
+    struct tty_server *server = wsi_server(wsi);
+    char buf[256];
+
+    switch (reason) {
+        case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
+            if (!ws_connection_allowed(wsi, &client->source)) {
+                TRACE2(filter, 0, 0);
+                return 1;
             }
+            TRACE2(filter, 1, 0);
+            arena_init(&client->arena, &wsi_server(wsi)->arena_cache);
+            client->fragment = ws_fragments(wsi, &client->arena);
+            break;
+
+        case LWS_CALLBACK_ESTABLISHED:
+            tty_client_init(client, wsi);
+            admission_hold(&server->admission, &client->source);
+            client->admitted = true;
+            // at --max-clients the connection waits for a free session, first come first served
+            if (server->max_clients > 0 && server->max_queue > 0 &&
+                (client_count(server) >= server->max_clients || !TAILQ_EMPTY(&server->queue)))
+                tty_queue_add(client);
+            else
+                tty_client_add(client);
+            // keep the connection alive until its session starts, tty_client_start() takes over
+            client->next_ping = server->timers.now + DEFAULT_KEEPALIVE;
+            client->timer.cb = client_timer_fire;
+            client->timer.data = client;
+            timer_add(&server->timers, &client->timer, DEFAULT_KEEPALIVE);
+            request_path(wsi, buf, sizeof(buf));
+
+            log_event(LLL_NOTICE, &server->ws_rate, "ws_open", "path=%s address=%s hostname=%s clients=%d", buf,
+                      client->address, client_hostname(client), client_count(server));
+            if (client->queued)
+                log_event(LLL_NOTICE, &server->ws_rate, "ws_queue", "address=%s position=%d", client->address,
+                          client->queue_position);
+            break;
+
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            return tty_client_writable(wsi, client);
+
+        case LWS_CALLBACK_RECEIVE:
+            return tty_client_receive(wsi, client, in, len);
+
+        case LWS_CALLBACK_RECEIVE_PONG:
+            client->pong_pending = false;
             break;
 
         case LWS_CALLBACK_CLOSED:
             tty_client_destroy(client);
-            lwsl_notice("WS closed from %s (%s), clients: %d\n", client->address, client->hostname, server->client_count);
-            if (server->once && server->client_count == 0) {
-                lwsl_notice("exiting due to the --once option.\n");
-                force_exit = true;
-                lws_cancel_service(context);
-                exit(0);
-            }
+            log_event(LLL_NOTICE, &server->ws_rate, "ws_close", "address=%s hostname=%s clients=%d", client->address,
+                      client_hostname(client), client_count(server));
+            exit_if_once(server);
             break;
 
         default:
@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "record.h"
+#include "utils.h"
+#include "vt.h"
+
+// events queued beyond this are dropped instead of stalling the session
+#define RECORD_QUEUE_MAX (8 * 1024 * 1024)
+// seconds between two keyframes in the recording index
+#define KEYFRAME_INTERVAL 10
+
+// An uncompressed recording has two sidecar files: "<name>.cast.idx" is an array
+// of checkpoints sorted by time, and "<name>.cast.kf" holds the keyframes they
+// point to, each one is the sequence that repaints the screen at that time.
+struct record_index {
+    double time;                    // time of the checkpoint
+    uint64_t offset;                // offset of the first event after it in the recording
+    uint64_t keyframe;              // offset of the keyframe in the keyframe file
+    uint32_t keyframe_len;
+    uint16_t cols;
+    uint16_t rows;
+};
+
+struct record_event {
+    double time;
+    char type;
+    size_t len;
+    struct record_event *next;
+    char data[];
+};
+
+struct recorder {
+    char *dir;
+    size_t max_size;
+    bool gzip;
+
+    char name[64];                  // file name of the recording without the part and extension
+    int part;
+    FILE *fp;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+    size_t size;                    // bytes written to the current part
+    struct timespec start;
+    double part_start;              // time offset of the current part
+    int cols;
+    int rows;
+    char *command;
+    char term[30];
+
+    FILE *index;                    // index sidecar, uncompressed recordings only
+    FILE *keyframes;
+    uint64_t keyframes_size;
+    double last_checkpoint;
+    struct vt_screen *vt;           // screen state for the keyframes
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct record_event *head;
+    struct record_event *tail;
+    size_t queued;
+    size_t dropped;
+    bool closing;
+};
+
+struct record_config *
+record_config_parse(struct json_object *obj) {
+    struct json_object *o = NULL;
+    const char *dir = NULL;
+    struct record_config *config = xmalloc(sizeof(struct record_config));
+    memset(config, 0, sizeof(struct record_config));
+
+    if (json_object_is_type(obj, json_type_string)) {
+        dir = json_object_get_string(obj);
+    } else if (json_object_is_type(obj, json_type_object)) {
+        if (json_object_object_get_ex(obj, "dir", &o))
+            dir = json_object_get_string(o);
+        if (json_object_object_get_ex(obj, "max-size", &o))
+            config->max_size = (size_t) json_object_get_int64(o);
+        if (json_object_object_get_ex(obj, "compress", &o)) {
+            const char *compress = json_object_get_string(o);
+            if (compress != NULL && !strcmp(compress, "gzip")) {
+#ifdef HAVE_ZLIB
+                config->gzip = true;
+#else
+                fprintf(stderr, "ttyd: gzip compression for recordings is not available in this build\n");
+                goto error;
+#endif
+            } else if (compress != NULL && strcmp(compress, "none") != 0) {
+                fprintf(stderr, "ttyd: unsupported recording compression: %s\n", compress);
+                goto error;
+            }
+        }
+    }
+
+    struct stat st;
+    if (dir == NULL || strlen(dir) == 0) {
+        fprintf(stderr, "ttyd: missing recording directory\n");
+        goto error;
+    }
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "ttyd: invalid recording directory: %s\n", dir);
+        goto error;
+    }
+    config->dir = strdup(dir);
+    return config;
+
+error:
+    free(config);
+    return NULL;
+}
+
+void
+record_config_free(struct record_config *config) {
+    if (config == NULL)
+        return;
+    free(config->dir);
+    free(config);
+}
+
+static double
+elapsed(struct recorder *recorder) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - recorder->start.tv_sec) + (double) (now.tv_nsec - recorder->start.tv_nsec) / 1e9;
+}
+
+static void
+write_data(struct recorder *recorder, const char *buf, size_t len) {
+#ifdef HAVE_ZLIB
+    if (recorder->gz != NULL) {
+        if (gzwrite(recorder->gz, buf, (unsigned) len) <= 0)
+            lwsl_err("write recording: %s\n", recorder->name);
+        recorder->size += len;
+        return;
+    }
+#endif
+    if (recorder->fp != NULL) {
+        if (fwrite(buf, 1, len, recorder->fp) != len)
+            lwsl_err("write recording: %s, error: %d (%s)\n", recorder->name, errno, strerror(errno));
+        recorder->size += len;
+    }
+}
+
+static void
+flush_part(struct recorder *recorder) {
+#ifdef HAVE_ZLIB
+    if (recorder->gz != NULL)
+        gzflush(recorder->gz, Z_SYNC_FLUSH);
+#endif
+    if (recorder->fp != NULL)
+        fflush(recorder->fp);
+    // the index last, its checkpoints point into the recording and the keyframes
+    if (recorder->keyframes != NULL)
+        fflush(recorder->keyframes);
+    if (recorder->index != NULL)
+        fflush(recorder->index);
+}
+
+static void
+close_part(struct recorder *recorder) {
+#ifdef HAVE_ZLIB
+    if (recorder->gz != NULL) {
+        gzclose(recorder->gz);
+        recorder->gz = NULL;
+    }
+#endif
+    if (recorder->fp != NULL) {
+        fclose(recorder->fp);
+        recorder->fp = NULL;
+    }
+    if (recorder->index != NULL) {
+        fclose(recorder->index);
+        recorder->index = NULL;
+    }
+    if (recorder->keyframes != NULL) {
+        fclose(recorder->keyframes);
+        recorder->keyframes = NULL;
+    }
+}
+
+static FILE *
+open_sidecar(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+    if (fd < 0) {
+        lwsl_err("open recording index: %s, error: %d (%s)\n", path, errno, strerror(errno));
+        return NULL;
+    }
+    FILE *fp = fdopen(fd, "a");
+    if (fp == NULL)
+        close(fd);
+    return fp;
+}
+
+// Write a checkpoint for the current position of the recording, it is skipped
+// if the screen model can not describe the screen at this point.
+static void
+write_checkpoint(struct recorder *recorder, double time) {
+    if (recorder->index == NULL || recorder->keyframes == NULL || !vt_renderable(recorder->vt))
+        return;
+
+    size_t size = (size_t) recorder->vt->cols * recorder->vt->rows * 48 + 4096;
+    char *buf = xmalloc(size);
+    size_t len = vt_render(recorder->vt, buf, size);
+    if (len > 0) {
+        struct record_index entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.time = time - recorder->part_start;
+        entry.offset = recorder->size;
+        entry.keyframe = recorder->keyframes_size;
+        entry.keyframe_len = (uint32_t) len;
+        entry.cols = (uint16_t) recorder->vt->cols;
+        entry.rows = (uint16_t) recorder->vt->rows;
+        if (fwrite(buf, 1, len, recorder->keyframes) == len &&
+            fwrite(&entry, sizeof(entry), 1, recorder->index) == 1) {
+            recorder->keyframes_size += len;
+            recorder->last_checkpoint = time;
+        } else {
+            lwsl_err("write recording index: %s, error: %d (%s)\n", recorder->name, errno, strerror(errno));
+        }
+    }
+    free(buf);
+}
+
+static bool
+open_part(struct recorder *recorder, double offset) {
+    char path[1024];
+    char part[16] = "";
+    if (recorder->part > 0)
+        snprintf(part, sizeof(part), ".%d", recorder->part);
+    snprintf(path, sizeof(path), "%s/%s%s.cast%s", recorder->dir, recorder->name, part, recorder->gzip ? ".gz" : "");
+
+    // recordings may contain secrets typed into the terminal
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+    if (fd < 0) {
+        lwsl_err("open recording: %s, error: %d (%s)\n", path, errno, strerror(errno));
+        return false;
+    }
+#ifdef HAVE_ZLIB
+    if (recorder->gzip) {
+        recorder->gz = gzdopen(fd, "ab");
+        if (recorder->gz == NULL) {
+            close(fd);
+            return false;
+        }
+    } else
+#endif
+    {
+        recorder->fp = fdopen(fd, "a");
+        if (recorder->fp == NULL) {
+            close(fd);
+            return false;
+        }
+    }
+    recorder->size = 0;
+    recorder->part_start = offset;
+
+    struct json_object *header = json_object_new_object();
+    struct json_object *env = json_object_new_object();
+    json_object_object_add(header, "version", json_object_new_int(2));
+    json_object_object_add(header, "width", json_object_new_int(recorder->cols));
+    json_object_object_add(header, "height", json_object_new_int(recorder->rows));
+    json_object_object_add(header, "timestamp", json_object_new_int64((int64_t) time(NULL)));
+    json_object_object_add(header, "command", json_object_new_string(recorder->command));
+    json_object_object_add(env, "TERM", json_object_new_string(recorder->term));
+    json_object_object_add(header, "env", env);
+    const char *str = json_object_to_json_string_ext(header, JSON_C_TO_STRING_PLAIN);
+    write_data(recorder, str, strlen(str));
+    write_data(recorder, "\n", 1);
+    json_object_put(header);
+
+    if (!recorder->gzip) {
+        char sidecar[1040];
+        snprintf(sidecar, sizeof(sidecar), "%s.idx", path);
+        recorder->index = open_sidecar(sidecar);
+        snprintf(sidecar, sizeof(sidecar), "%s.kf", path);
+        recorder->keyframes = open_sidecar(sidecar);
+        recorder->keyframes_size = 0;
+        write_checkpoint(recorder, offset);
+    }
+
+    lwsl_notice("recording session to: %s\n", path);
+    return true;
+}
+
+static void
+write_event(struct recorder *recorder, struct record_event *event) {
+    if (event->type == 'r')
+        sscanf(event->data, "%dx%d", &recorder->cols, &recorder->rows);
+
+    if (recorder->max_size > 0 && recorder->size >= recorder->max_size) {
+        close_part(recorder);
+        recorder->part++;
+        open_part(recorder, event->time);
+    } else if (event->time - recorder->last_checkpoint >= KEYFRAME_INTERVAL) {
+        write_checkpoint(recorder, event->time);
+    }
+    if (recorder->vt != NULL) {
+        if (event->type == 'o')
+            vt_feed(recorder->vt, event->data, event->len);
+        else if (event->type == 'r')
+            vt_resize(recorder->vt, recorder->cols, recorder->rows);
+    }
+
+    char prefix[64];
+    int n = snprintf(prefix, sizeof(prefix), "[%.6f, \"%c\", ", event->time - recorder->part_start, event->type);
+    // asciicast is utf-8 json, binary output (zmodem, a cut sequence sent after the timeout) is not
+    size_t len = event->len;
+    char *valid = utf8_sanitize(event->data, event->len, &len);
+    struct json_object *data = json_object_new_string_len(valid != NULL ? valid : event->data, (int) len);
+    free(valid);
+    const char *str = json_object_to_json_string_ext(data, JSON_C_TO_STRING_PLAIN);
+    write_data(recorder, prefix, (size_t) n);
+    write_data(recorder, str, strlen(str));
+    write_data(recorder, "]\n", 2);
+    json_object_put(data);
+}
+
+static void *
+thread_write_recording(void *args) {
+    struct recorder *recorder = (struct recorder *) args;
+
+    while (true) {
+        pthread_mutex_lock(&recorder->mutex);
+        while (recorder->head == NULL && !recorder->closing) {
+            pthread_cond_wait(&recorder->cond, &recorder->mutex);
+        }
+        struct record_event *event = recorder->head;
+        size_t dropped = recorder->dropped;
+        bool closing = recorder->closing;
+        recorder->head = recorder->tail = NULL;
+        recorder->queued = 0;
+        recorder->dropped = 0;
+        pthread_mutex_unlock(&recorder->mutex);
+
+        if (dropped > 0) {
+            lwsl_warn("recording %s can not keep up, dropped %zu bytes\n", recorder->name, dropped);
+            // the screen model missed some output, keyframes resume after the next full redraw
+            if (recorder->vt != NULL)
+                vt_invalidate(recorder->vt);
+        }
+
+        while (event != NULL) {
+            struct record_event *next = event->next;
+            write_event(recorder, event);
+            free(event);
+            event = next;
+        }
+        flush_part(recorder);
+
+        if (closing)
+            break;
+    }
+
+    pthread_exit((void *) 0);
+}
+
+static void
+enqueue(struct recorder *recorder, char type, const char *data, size_t len) {
+    if (recorder == NULL)
+        return;
+
+    double now = elapsed(recorder);
+    pthread_mutex_lock(&recorder->mutex);
+    if (recorder->closing || recorder->queued + len > RECORD_QUEUE_MAX) {
+        recorder->dropped += len;
+        pthread_mutex_unlock(&recorder->mutex);
+        return;
+    }
+    struct record_event *event = xmalloc(sizeof(struct record_event) + len + 1);
+    event->time = now;
+    event->type = type;
+    event->len = len;
+    event->next = NULL;
+    memcpy(event->data, data, len);
+    event->data[len] = '\0';
+    if (recorder->tail != NULL)
+        recorder->tail->next = event;
+    else
+        recorder->head = event;
+    recorder->tail = event;
+    recorder->queued += len;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->mutex);
+}
+
+struct recorder *
+recorder_new(const struct record_config *config, int pid, char **argv, const char *term, int cols, int rows) {
+    struct recorder *recorder = xmalloc(sizeof(struct recorder));
+    memset(recorder, 0, sizeof(struct recorder));
+
+    recorder->dir = strdup(config->dir);
+    recorder->max_size = config->max_size;
+    recorder->gzip = config->gzip;
+    recorder->cols = cols > 0 ? cols : 80;
+    recorder->rows = rows > 0 ? rows : 24;
+    strncpy(recorder->term, term, sizeof(recorder->term) - 1);
+    clock_gettime(CLOCK_MONOTONIC, &recorder->start);
+    if (!recorder->gzip) {
+        // the recording starts from a blank screen
+        recorder->vt = vt_new(recorder->cols, recorder->rows);
+        vt_feed(recorder->vt, "\x1b[m\x1b[H\x1b[2J", 10);
+    }
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    size_t n = strftime(recorder->name, sizeof(recorder->name), "%Y%m%d-%H%M%S", &tm);
+    snprintf(recorder->name + n, sizeof(recorder->name) - n, "-%d", pid);
+
+    size_t command_len = 1;
+    for (int i = 0; argv[i] != NULL; i++)
+        command_len += strlen(argv[i]) + 1;
+    recorder->command = xmalloc(command_len);
+    char *ptr = recorder->command;
+    *ptr = '\0';
+    for (int i = 0; argv[i] != NULL; i++) {
+        ptr = stpcpy(ptr, argv[i]);
+        if (argv[i + 1] != NULL)
+            ptr = stpcpy(ptr, " ");
+    }
+
+    if (!open_part(recorder, 0))
+        goto error;
+
+    pthread_mutex_init(&recorder->mutex, NULL);
+    pthread_cond_init(&recorder->cond, NULL);
+    int err = pthread_create(&recorder->thread, NULL, thread_write_recording, recorder);
+    if (err != 0) {
+        lwsl_err("pthread_create return: %d\n", err);
+        pthread_mutex_destroy(&recorder->mutex);
+        pthread_cond_destroy(&recorder->cond);
+        close_part(recorder);
+        goto error;
+    }
+
+    return recorder;
+
+error:
+    vt_free(recorder->vt);
+    free(recorder->command);
+    free(recorder->dir);
+    free(recorder);
+    return NULL;
+}
+
+void
+recorder_output(struct recorder *recorder, const char *buf, size_t len) {
+    enqueue(recorder, 'o', buf, len);
+}
+
+void
+recorder_resize(struct recorder *recorder, int cols, int rows) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%dx%d", cols, rows);
+    enqueue(recorder, 'r', buf, (size_t) n);
+}
+
+void
+recorder_close(struct recorder *recorder) {
+    if (recorder == NULL)
+        return;
+
+    pthread_mutex_lock(&recorder->mutex);
+    recorder->closing = true;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->mutex);
+    pthread_join(recorder->thread, NULL);
+
+    close_part(recorder);
+    pthread_mutex_destroy(&recorder->mutex);
+    pthread_cond_destroy(&recorder->cond);
+    vt_free(recorder->vt);
+    free(recorder->command);
+    free(recorder->dir);
+    free(recorder);
+}
+
+struct playback {
+    char *data;                     // the mapped recording
+    size_t size;
+    size_t offset;                  // offset of the next event
+    struct record_index *index;     // the mapped index, NULL if there is none
+    size_t index_size;
+    size_t index_count;
+    char *keyframes;
+    size_t keyframes_size;
+    const struct record_index *checkpoint;
+    double start;
+    struct json_tokener *tok;
+    struct json_object *event;
+};
+
+static void *
+map_file(const char *path, size_t *size) {
+    struct stat st;
+    void *data = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        else
+            *size = (size_t) st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+struct playback *
+playback_open(const char *dir, const char *name, double start) {
+    char path[1024];
+
+    // only plain file names of uncompressed recordings in the directory are served
+    if (name == NULL || strchr(name, '/') != NULL || name[0] == '.' || !endswith(name, ".cast"))
+        return NULL;
+
+    struct playback *playback = xmalloc(sizeof(struct playback));
+    memset(playback, 0, sizeof(struct playback));
+    playback->start = start;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    playback->data = map_file(path, &playback->size);
+    if (playback->data == NULL) {
+        lwsl_err("open recording: %s, error: %d (%s)\n", path, errno, strerror(errno));
+        free(playback);
+        return NULL;
+    }
+    // skip the header
+    char *eol = memchr(playback->data, '\n', playback->size);
+    playback->offset = eol != NULL ? (size_t) (eol - playback->data) + 1 : playback->size;
+
+    snprintf(path, sizeof(path), "%s/%s.idx", dir, name);
+    playback->index = map_file(path, &playback->index_size);
+    playback->index_count = playback->index_size / sizeof(struct record_index);
+    snprintf(path, sizeof(path), "%s/%s.kf", dir, name);
+    playback->keyframes = map_file(path, &playback->keyframes_size);
+
+    if (playback->index != NULL && playback->keyframes != NULL && playback->index_count > 0) {
+        // find the last checkpoint before the start time
+        size_t lo = 0, hi = playback->index_count;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (playback->index[mid].time <= start)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        const struct record_index *checkpoint = &playback->index[lo];
+        if (checkpoint->time <= start && checkpoint->offset <= playback->size &&
+            checkpoint->keyframe + checkpoint->keyframe_len <= playback->keyframes_size) {
+            playback->checkpoint = checkpoint;
+            playback->offset = (size_t) checkpoint->offset;
+        }
+    }
+
+    playback->tok = json_tokener_new();
+    return playback;
+}
+
+const char *
+playback_keyframe(struct playback *playback, size_t *len) {
+    if (playback->checkpoint == NULL)
+        return NULL;
+    *len = playback->checkpoint->keyframe_len;
+    return playback->keyframes + playback->checkpoint->keyframe;
+}
+
+double
+playback_start(const struct playback *playback) {
+    return playback->start;
+}
+
+bool
+playback_next(struct playback *playback, double *time, const char **data, size_t *len) {
+    if (playback->event != NULL) {
+        json_object_put(playback->event);
+        playback->event = NULL;
+    }
+
+    while (playback->offset < playback->size) {
+        char *line = playback->data + playback->offset;
+        size_t remaining = playback->size - playback->offset;
+        char *eol = memchr(line, '\n', remaining);
+        size_t line_len = eol != NULL ? (size_t) (eol - line) : remaining;
+        playback->offset += line_len + 1;
+
+        json_tokener_reset(playback->tok);
+        struct json_object *event = json_tokener_parse_ex(playback->tok, line, (int) line_len);
+        if (event == NULL)
+            continue;
+        if (!json_object_is_type(event, json_type_array)) {
+            json_object_put(event);
+            continue;
+        }
+        struct json_object *type = json_object_array_get_idx(event, 1);
+        struct json_object *str = json_object_array_get_idx(event, 2);
+        if (json_object_array_length(event) != 3 || type == NULL || str == NULL ||
+            strcmp(json_object_get_string(type), "o") != 0) {
+            json_object_put(event);
+            continue;
+        }
+        *time = json_object_get_double(json_object_array_get_idx(event, 0));
+        *data = json_object_get_string(str);
+        *len = (size_t) json_object_get_string_len(str);
+        playback->event = event;
+        return true;
+    }
+
+    return false;
+}
+
+void
+playback_close(struct playback *playback) {
+    if (playback == NULL)
+        return;
+    if (playback->event != NULL)
+        json_object_put(playback->event);
+    json_tokener_free(playback->tok);
+    munmap(playback->data, playback->size);
+    if (playback->index != NULL)
+        munmap(playback->index, playback->index_size);
+    if (playback->keyframes != NULL)
+        munmap(playback->keyframes, playback->keyframes_size);
+    free(playback);
+}
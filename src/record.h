@@ -0,0 +1,64 @@
+#ifndef TTYD_RECORD_H
+#define TTYD_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct record_config {
+    char *dir;                  // directory to write the recordings to
+    size_t max_size;            // rotate the recording after this many bytes, 0 to disable
+    bool gzip;                  // compress the recording with gzip
+};
+
+struct recorder;
+struct playback;
+struct json_object;
+
+// Parse the "record" option of a service, it is either the recording directory
+// or an object with the "dir", "max-size" and "compress" keys
+struct record_config *
+record_config_parse(struct json_object *obj);
+
+// Free the record config
+void
+record_config_free(struct record_config *config);
+
+// Start recording a session to a new asciicast v2 file
+struct recorder *
+recorder_new(const struct record_config *config, int pid, char **argv, const char *term, int cols, int rows);
+
+// Queue pty output, never blocks on the disk
+void
+recorder_output(struct recorder *recorder, const char *buf, size_t len);
+
+// Queue a terminal resize event
+void
+recorder_resize(struct recorder *recorder, int cols, int rows);
+
+// Flush the queued events and close the recording
+void
+recorder_close(struct recorder *recorder);
+
+// Open a recording in dir for playback from the given time (in seconds), the
+// index sidecar is used to seek to the closest keyframe if there is one
+struct playback *
+playback_open(const char *dir, const char *name, double start);
+
+// Get the keyframe the playback starts from, NULL if it starts from the beginning
+const char *
+playback_keyframe(struct playback *playback, size_t *len);
+
+// Get the time the playback was asked to start from
+double
+playback_start(const struct playback *playback);
+
+// Get the next output event, the data is valid until the next call,
+// returns false at the end of the recording
+bool
+playback_next(struct playback *playback, double *time, const char **data, size_t *len);
+
+// Close the playback
+void
+playback_close(struct playback *playback);
+
+#endif //TTYD_RECORD_H
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <libwebsockets.h>
+
+#include "resolve.h"
+#include "utils.h"
+#include "log.h"
+
+enum resolve_state {
+    RESOLVE_FREE, RESOLVE_PENDING, RESOLVE_RUNNING, RESOLVE_DONE
+};
+
+struct resolve_entry {
+    enum resolve_state state;
+    char address[50];
+    char hostname[100];               // empty if the address has no name
+    uint64_t expires;
+};
+
+// The cache is shared by the service thread and the resolver thread, the lock is
+// never held during a lookup
+static struct {
+    bool running;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct resolve_entry entries[RESOLVE_CACHE_SIZE];
+} resolver = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// Reverse lookup of a numeric address, this may take seconds with a slow resolver
+static void
+resolve(const char *address, char *hostname, size_t len) {
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST;
+    hostname[0] = '\0';
+    if (getaddrinfo(address, NULL, &hints, &ai) != 0)
+        return;
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, hostname, (socklen_t) len, NULL, 0, NI_NAMEREQD) != 0)
+        hostname[0] = '\0';
+    freeaddrinfo(ai);
+}
+
+void *
+resolver_thread(void *args) {
+    char address[50], hostname[100];
+
+    pthread_mutex_lock(&resolver.mutex);
+    while (!resolver.stop) {
+        struct resolve_entry *entry = NULL;
+        for (int i = 0; i < RESOLVE_CACHE_SIZE && entry == NULL; i++) {
+            if (resolver.entries[i].state == RESOLVE_PENDING)
+                entry = &resolver.entries[i];
+        }
+        if (entry == NULL) {
+            pthread_cond_wait(&resolver.cond, &resolver.mutex);
+            continue;
+        }
+        entry->state = RESOLVE_RUNNING;
+        snprintf(address, sizeof(address), "%s", entry->address);
+        pthread_mutex_unlock(&resolver.mutex);
+
+        resolve(address, hostname, sizeof(hostname));
+        if (hostname[0] != '\0')
+            log_event(LLL_INFO, NULL, "resolve", "address=%s hostname=%s", address, hostname);
+
+        pthread_mutex_lock(&resolver.mutex);
+        // a running entry is not reused, it is still the one of the address
+        snprintf(entry->hostname, sizeof(entry->hostname), "%s", hostname);
+        entry->expires = time_monotonic() + (hostname[0] != '\0' ? RESOLVE_TTL : RESOLVE_NEGATIVE_TTL);
+        entry->state = RESOLVE_DONE;
+    }
+    pthread_mutex_unlock(&resolver.mutex);
+    return NULL;
+}
+
+void
+resolver_init() {
+    int err = pthread_create(&resolver.thread, NULL, resolver_thread, NULL);
+    if (err != 0) {
+        lwsl_err("resolver thread: %d, client addresses are not resolved\n", err);
+        return;
+    }
+    resolver.running = true;
+}
+
+void
+resolver_close() {
+    if (!resolver.running)
+        return;
+    pthread_mutex_lock(&resolver.mutex);
+    resolver.stop = true;
+    pthread_cond_signal(&resolver.cond);
+    pthread_mutex_unlock(&resolver.mutex);
+    // do not wait for a lookup in progress, the process is exiting
+    pthread_detach(resolver.thread);
+    resolver.running = false;
+}
+
+bool
+resolver_lookup(const char *address, char *hostname, size_t len) {
+    if (!resolver.running || address[0] == '\0')
+        return false;
+
+    uint64_t now = time_monotonic();
+    bool found = false;
+    struct resolve_entry *victim = NULL;
+    pthread_mutex_lock(&resolver.mutex);
+    for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+        struct resolve_entry *entry = &resolver.entries[i];
+        if (entry->state != RESOLVE_FREE && strcmp(entry->address, address) == 0) {
+            if (entry->state == RESOLVE_DONE && entry->expires <= now) {
+                // expired, look it up again
+                entry->state = RESOLVE_PENDING;
+                pthread_cond_signal(&resolver.cond);
+            } else if (entry->state == RESOLVE_DONE && entry->hostname[0] != '\0') {
+                snprintf(hostname, len, "%s", entry->hostname);
+                found = true;
+            }
+            pthread_mutex_unlock(&resolver.mutex);
+            return found;
+        }
+        // reuse a free entry, or the one that expires first
+        if (entry->state == RESOLVE_FREE)
+            victim = entry;
+        else if (entry->state == RESOLVE_DONE && (victim == NULL || (victim->state == RESOLVE_DONE &&
+                                                                      entry->expires < victim->expires)))
+            victim = entry;
+    }
+    // the cache may be full of lookups in progress, the address is not resolved then
+    if (victim != NULL) {
+        snprintf(victim->address, sizeof(victim->address), "%s", address);
+        victim->hostname[0] = '\0';
+        victim->state = RESOLVE_PENDING;
+        pthread_cond_signal(&resolver.cond);
+    }
+    pthread_mutex_unlock(&resolver.mutex);
+    return false;
+}
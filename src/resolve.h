@@ -0,0 +1,27 @@
+#ifndef TTYD_RESOLVE_H
+#define TTYD_RESOLVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// addresses the resolver keeps the host name of
+#define RESOLVE_CACHE_SIZE 256
+
+// seconds a host name is kept, and the failure to get one
+#define RESOLVE_TTL 300
+#define RESOLVE_NEGATIVE_TTL 60
+
+// Start the resolver thread, client addresses are only resolved when it runs
+void
+resolver_init();
+
+void
+resolver_close();
+
+// Copy the cached host name of a numeric address. It never waits for the resolver: on
+// a miss the address is queued and false is returned, the name shows up in the cache
+// later. Returns false as well when the address has no name or the resolver is off.
+bool
+resolver_lookup(const char *address, char *hostname, size_t len);
+
+#endif //TTYD_RESOLVE_H
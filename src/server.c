@@ -3,9 +3,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #ifdef HAVE_LWS_CONFIG_H
@@ -16,621 +16,536 @@
 
 #include "server.h"
 #include "utils.h"
+#include "record.h"
+#include "cgroup.h"
 
-#ifndef TTYD_VERSION
-#define TTYD_VERSION "unknown"
-#endif
-
-volatile bool force_exit = false;
-struct lws_context *context;
-struct tty_server *server;
-
-// websocket protocols
+// websocket protocols, each server has a copy with itself as the user
 static const struct lws_protocols protocols[] = {
-        {"http-only", callback_http, sizeof(struct pss_http),   0},
-        {"tty",       callback_tty,  sizeof(struct tty_client), 0},
-        {NULL, NULL,                 0,                         0}
+        {"http-only", callback_http,    sizeof(struct pss_http),   0},
+        {"tty",       callback_tty,     sizeof(struct tty_client), 0},
+        {"tty-mux",   callback_tty_mux, sizeof(struct mux_conn),   0},
+        {NULL, NULL,                    0,                         0}
 };
 
-// websocket extensions
-static const struct lws_extension extensions[] = {
-        {"permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate"},
-        {"deflate-frame",      lws_extension_callback_pm_deflate, "deflate_frame"},
-        {NULL, NULL, NULL}
-};
-
-// command line options
-static const struct option options[] = {
-        {"port",         required_argument, NULL, 'p'},
-        {"interface",    required_argument, NULL, 'i'},
-        {"credential",   required_argument, NULL, 'c'},
-        {"uid",          required_argument, NULL, 'u'},
-        {"gid",          required_argument, NULL, 'g'},
-        {"signal",       required_argument, NULL, 's'},
-        {"signal-list",  no_argument,       NULL,  1},
-        {"reconnect",    required_argument, NULL, 'r'},
-        {"index",        required_argument, NULL, 'I'},
-        {"ssl",          no_argument,       NULL, 'S'},
-        {"ssl-cert",     required_argument, NULL, 'C'},
-        {"ssl-key",      required_argument, NULL, 'K'},
-        {"ssl-ca",       required_argument, NULL, 'A'},
-        {"readonly",     no_argument,       NULL, 'R'},
-        {"check-origin", no_argument,       NULL, 'O'},
-        {"max-clients",  required_argument, NULL, 'm'},
-        {"once",         no_argument,       NULL, 'o'},
-        {"browser",      no_argument,       NULL, 'B'},
-        {"debug",        required_argument, NULL, 'd'},
-        {"version",      no_argument,       NULL, 'v'},
-        {"help",         no_argument,       NULL, 'h'},
-        {NULL,           0,                 0,     0}
-};
-static const char *opt_string = "f:p:i:c:u:g:s:r:I:aSC:K:A:Rt:T:Om:oBd:vh";
-
-void print_help() {
-    fprintf(stderr, "ttyd-express is a tool for sharing terminal over the web\n\n"
-                    "USAGE:\n"
-                    "    ttyd [options] <command> [<arguments...>]\n\n"
-                    "VERSION:\n"
-                    "    %s\n\n"
-                    "OPTIONS:\n"
-                    "    -f, --conf-file         Configuration file path (eg: /etc/ttyd/config.json)\n"
-                    "    -p, --port              Port to listen (default: 7681, use `0` for random port)\n"
-                    "    -i, --interface         Network interface to bind (eg: eth0), or UNIX domain socket path (eg: /var/run/ttyd.sock)\n"
-                    "    -c, --credential        Credential for Basic Authentication (format: username:password)\n"
-                    "    -u, --uid               User id to run with\n"
-                    "    -g, --gid               Group id to run with\n"
-                    "    -s, --signal            Signal to send to the command when exit it (default: 1, SIGHUP)\n"
-                    "    -r, --reconnect         Time to reconnect for the client in seconds (default: 10, disable reconnect: <= 0)\n"
-                    "    -R, --readonly          Do not allow clients to write to the TTY\n"
-                    "    -t, --client-option     Send option to client (format: key=value), repeat to add more options\n"
-                    "    -T, --terminal-type     Terminal type to report, default: xterm-color\n"
-                    "    -O, --check-origin      Do not allow websocket connection from different origin\n"
-                    "    -m, --max-clients       Maximum clients to support (default: 0, no limit)\n"
-                    "    -o, --once              Accept only one client and exit on disconnection\n"
-                    "    -B, --browser           Open terminal with the default system browser\n"
-                    "    -I, --index             Custom index.html path\n"
-                    "    -S, --ssl               Enable SSL\n"
-                    "    -C, --ssl-cert          SSL certificate file path\n"
-                    "    -K, --ssl-key           SSL key file path\n"
-                    "    -A, --ssl-ca            SSL CA file path for client certificate verification\n"
-                    "    -d, --debug             Set log level (default: 7)\n"
-                    "    -v, --version           Print the version and exit\n"
-                    "    -h, --help              Print this text and exit\n\n"
-                    "Visit https://github.com/santosh0705/ttyd-express to get more information and report bugs.\n"
-                    "ttyd-express is a fork of ttyd project: https://github.com/tsl0922/ttyd\n",
-            TTYD_VERSION
-    );
+struct service_table *
+service_table_new() {
+    struct service_table *table = xmalloc(sizeof(struct service_table));
+    LIST_INIT(&table->list);
+    table->refs = 1;
+    return table;
 }
 
-struct tty_server *
-tty_server_new() {
-    struct tty_server *ts;
-
-    ts = xmalloc(sizeof(struct tty_server));
+struct service_table *
+service_table_ref(struct service_table *table) {
+    __atomic_add_fetch(&table->refs, 1, __ATOMIC_RELAXED);
+    return table;
+}
 
-    memset(ts, 0, sizeof(struct tty_server));
-    LIST_INIT(&ts->clients);
-    ts->client_count = 0;
-    LIST_INIT(&ts->services);
-    ts->reconnect = 10;
-    ts->sig_code = SIGHUP;
-    sprintf(ts->terminal_type, "%s", "xterm-color");
-    get_sig_name(ts->sig_code, ts->sig_name, sizeof(ts->sig_name));
-/* TODO: remove block
-    if (start == argc)
-        return ts;
-
-    int cmd_argc = argc - start;
-    char **cmd_argv = &argv[start];
-    ts->argv = xmalloc(sizeof(char *) * (cmd_argc + 1));
-    for (int i = 0; i < cmd_argc; i++) {
-        ts->argv[i] = strdup(cmd_argv[i]);
-        cmd_len += strlen(ts->argv[i]);
-        if (i != cmd_argc - 1) {
-            cmd_len++; // for space
+void
+service_table_unref(struct service_table *table) {
+    if (table == NULL || __atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    while (!LIST_EMPTY(&table->list)) {
+        struct service_t *service = LIST_FIRST(&table->list);
+        LIST_REMOVE(service, list);
+        if (service->path != NULL)
+            free(service->path);
+        if (service->argv != NULL) {
+            for (int i = 0; service->argv[i] != NULL; i++) {
+                free(service->argv[i]);
+            }
+            free(service->argv);
         }
+        record_config_free(service->record);
+        cgroup_config_free(service->cgroup);
+        if (service->playback_dir != NULL)
+            free(service->playback_dir);
+        if (service->files_dir != NULL)
+            free(service->files_dir);
+        free(service);
     }
-    ts->argv[cmd_argc] = NULL;
-
-    ts->command = xmalloc(cmd_len + 1);
-    char *ptr = ts->command;
-    for (int i = 0; i < cmd_argc; i++) {
-        ptr = stpcpy(ptr, ts->argv[i]);
-        if (i != cmd_argc - 1) {
-            *ptr++ = ' ';
+    free(table);
+}
+
+// Parse the "service" block of the configuration file into a new service table, the
+// services coalesce redraws unless their "coalesce" key says otherwise
+struct service_table *
+service_table_parse(struct json_object *services, bool coalesce) {
+    struct service_table *table = service_table_new();
+    struct json_object *p_jobj;
+    json_object_object_foreach(services, key, val) {
+        if (key == NULL || strlen(key) == 0 || key[0] != '/') {
+            fprintf(stderr, "ttyd: empty or invalid service path in configuration file, it must start with a leading '/'\n");
+            goto error;
+        }
+        struct service_t *service = malloc(sizeof(struct service_t));
+        memset(service, 0, sizeof(struct service_t));
+        service->path = strdup(key);
+        service->weight = 1;
+        service->keepalive = DEFAULT_KEEPALIVE;
+        service->coalesce = coalesce;
+        LIST_INSERT_HEAD(&table->list, service, list);
+        if (json_object_object_get_ex(val, "keepalive", &p_jobj))
+            service->keepalive = json_object_get_int(p_jobj);
+        if (json_object_object_get_ex(val, "idle-input-timeout", &p_jobj))
+            service->idle_input_timeout = json_object_get_int(p_jobj);
+        if (json_object_object_get_ex(val, "idle-output-timeout", &p_jobj))
+            service->idle_output_timeout = json_object_get_int(p_jobj);
+        if (json_object_object_get_ex(val, "time-limit", &p_jobj))
+            service->time_limit = json_object_get_int(p_jobj);
+        if (json_object_object_get_ex(val, "type", &p_jobj) && strcmp(json_object_get_string(p_jobj), "playback") == 0) {
+            struct stat st;
+            if (!json_object_object_get_ex(val, "dir", &p_jobj) || stat(json_object_get_string(p_jobj), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "ttyd: missing or invalid recordings directory for playback service: %s\n", key);
+                goto error;
+            }
+            service->playback_dir = strdup(json_object_get_string(p_jobj));
+            continue;
+        }
+        char *cmd = NULL;
+        if (json_object_object_get_ex(val, "command", &p_jobj))
+            cmd = strdup(json_object_get_string(p_jobj));
+        if (cmd == NULL || strlen(cmd) == 0) {
+            fprintf(stderr, "ttyd: missing start command in configuration file\n");
+            free(cmd);
+            goto error;
+        }
+        int args_len = 0;
+        if (json_object_object_get_ex(val, "args", &p_jobj)) {
+            args_len = json_object_array_length(p_jobj);
+        }
+        char **ser_cmd_argv = xmalloc(sizeof(char *) * (2 + args_len));
+        int i = 0;
+        ser_cmd_argv[i] = cmd;
+        if (args_len > 0) {
+            for (int j = 0; j < args_len; j++) {
+                i++;
+                ser_cmd_argv[i] = strdup(json_object_get_string(json_object_array_get_idx(p_jobj, j)));
+            }
+        }
+        i++;
+        ser_cmd_argv[i] = NULL;
+        service->argv = ser_cmd_argv;
+        if (json_object_object_get_ex(val, "coalesce", &p_jobj))
+            service->coalesce = json_object_get_boolean(p_jobj);
+        if (json_object_object_get_ex(val, "weight", &p_jobj)) {
+            service->weight = json_object_get_int(p_jobj);
+            if (service->weight < 1 || service->weight > BUF_SIZE / SCHED_QUANTUM) {
+                fprintf(stderr, "ttyd: invalid weight for service: %s, it must be between 1 and %d\n", key, BUF_SIZE / SCHED_QUANTUM);
+                goto error;
+            }
+        }
+        if (json_object_object_get_ex(val, "rate-limit", &p_jobj)) {
+            int64_t rate = json_object_get_int64(p_jobj);
+            service->rate_limit = rate > 0 ? (size_t) rate : 0;
+            service->rate_burst = service->rate_limit;
+        }
+        if (json_object_object_get_ex(val, "rate-burst", &p_jobj)) {
+            int64_t burst = json_object_get_int64(p_jobj);
+            if (burst <= 0) {
+                fprintf(stderr, "ttyd: invalid rate-burst for service: %s\n", key);
+                goto error;
+            }
+            service->rate_burst = (size_t) burst;
+        }
+        if (json_object_object_get_ex(val, "cgroup", &p_jobj)) {
+            service->cgroup = cgroup_config_parse(p_jobj, key);
+            if (service->cgroup == NULL)
+                goto error;
+        }
+        if (json_object_object_get_ex(val, "record", &p_jobj)) {
+            service->record = record_config_parse(p_jobj);
+            if (service->record == NULL)
+                goto error;
+        }
+        if (json_object_object_get_ex(val, "files", &p_jobj)) {
+            struct stat st;
+            if (stat(json_object_get_string(p_jobj), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "ttyd: invalid files directory for service: %s\n", key);
+                goto error;
+            }
+            service->files_dir = strdup(json_object_get_string(p_jobj));
         }
     }
-    *ptr = '\0'; // null terminator
-*/
+    return table;
 
-    return ts;
+error:
+    service_table_unref(table);
+    return NULL;
 }
 
-void
-tty_server_free(struct tty_server *ts) {
-    if (ts == NULL)
+// Reload the services of the configuration file, the sessions keep the table they
+// were started from until they are closed
+static void
+reload_services(struct tty_server *server) {
+    if (server->conf_file == NULL)
         return;
-    if (!LIST_EMPTY(&ts->services)) {
-        struct service_t *service;
-        LIST_FOREACH(service, &ts->services, list) {
-            if (service->path != NULL)
-                free(service->path);
-            if (service->argv != NULL) {
-                for (int i = 0; service->argv[i] != NULL; i++) {
-                    free(service->argv[i]);
-                }
-                free(service->argv);
-            }
-            free(service);
-        }
-    }
+    int count = ttyd_load_services(server, server->conf_file);
+    if (count < 0)
+        lwsl_err("reload failed, keeping the current services\n");
+    else if (count == 0)
+        lwsl_warn("no service in configuration file: %s, keeping the current services\n", server->conf_file);
+    else
+        lwsl_notice("reloaded %d service(s) from: %s\n", count, server->conf_file);
+}
+
+int
+ttyd_parse_rate(const char *str, double *rate, double *burst) {
+    double r, b;
+    int n = sscanf(str, "%lf/%lf", &r, &b);
+    if (n < 1 || r <= 0)
+        return -1;
+    if (n < 2)
+        b = r < 1 ? 1 : r;
+    if (b < 1)
+        return -1;
+    *rate = r;
+    *burst = b;
+    return 0;
+}
+
+// Set the limits of a kind of source, the burst defaults to the rate
+static int
+admission_limit_set(struct admission_limit *limit, double rate, double burst, int max_sessions) {
+    if (rate < 0 || max_sessions < 0)
+        return -1;
+    if (rate > 0 && burst <= 0)
+        burst = rate < 1 ? 1 : rate;
+    if (rate > 0 && burst < 1)
+        return -1;
+    limit->rate = rate;
+    limit->burst = rate > 0 ? burst : 0;
+    limit->max_sessions = max_sessions;
+    return 0;
+}
+
+// Log the configuration of a new server
+static void
+log_options(struct tty_server *ts) {
+    lwsl_notice("tty configuration:\n");
     if (ts->credential != NULL)
-        free(ts->credential);
-    if (ts->index != NULL)
-        free(ts->index);
-    free(ts->prefs_json);
-    if (strlen(ts->socket_path) > 0) {
-        struct stat st;
-        if (!stat(ts->socket_path, &st)) {
-            unlink(ts->socket_path);
-        }
+        lwsl_notice("  credential: %s\n", ts->credential);
+    lwsl_notice("  close signal: %s (%d)\n", ts->sig_name, ts->sig_code);
+    lwsl_notice("  terminal type: %s\n", ts->terminal_type);
+    if (ts->reconnect <= 0)
+        lwsl_notice("  reconnect timeout: disabled\n");
+    else
+        lwsl_notice("  reconnect timeout: %ds\n", ts->reconnect);
+    if (ts->check_origin)
+        lwsl_notice("  check origin: true\n");
+    if (ts->readonly)
+        lwsl_notice("  readonly: true\n");
+    if (ts->max_clients > 0)
+        lwsl_notice("  max clients: %d\n", ts->max_clients);
+    if (ts->max_clients > 0 && ts->max_queue > 0)
+        lwsl_notice("  max queue: %d\n", ts->max_queue);
+    if (ts->once)
+        lwsl_notice("  once: true\n");
+    if (ts->admission.address.rate > 0)
+        lwsl_notice("  ip rate: %g/s, burst: %g\n", ts->admission.address.rate, ts->admission.address.burst);
+    if (ts->admission.address.max_sessions > 0)
+        lwsl_notice("  ip max sessions: %d\n", ts->admission.address.max_sessions);
+    if (ts->admission.credential.rate > 0)
+        lwsl_notice("  credential rate: %g/s, burst: %g\n", ts->admission.credential.rate,
+                    ts->admission.credential.burst);
+    if (ts->admission.credential.max_sessions > 0)
+        lwsl_notice("  credential max sessions: %d\n", ts->admission.credential.max_sessions);
+    if (ts->index != NULL) {
+        lwsl_notice("  custom index.html: %s\n", ts->index);
     }
-    pthread_mutex_destroy(&ts->mutex);
-    free(ts);
+    lwsl_notice("  memory: %zu bytes per connection, %d more per session\n", sizeof(struct tty_client), PTY_BUFFER_SIZE);
 }
 
 void
-sig_handler(int sig) {
-    if (force_exit)
-        exit(EXIT_FAILURE);
-
-    char sig_name[20];
-    get_sig_name(sig, sig_name, sizeof(sig_name));
-    lwsl_notice("received signal: %s (%d), exiting...\n", sig_name, sig);
-    force_exit = true;
-    lws_cancel_service(context);
-    lwsl_notice("send ^C to force exit.\n");
+ttyd_options_init(struct ttyd_options *options) {
+    memset(options, 0, sizeof(struct ttyd_options));
+    options->terminal_type = "xterm-color";
+    options->sig_code = SIGHUP;
+    options->reconnect = 10;
 }
 
-int
-calc_command_start(int argc, char **argv) {
-    // make a copy of argc and argv
-    int argc_copy = argc;
-    char **argv_copy = xmalloc(sizeof(char *) * argc);
-    for (int i = 0; i < argc; i++) {
-        argv_copy[i] = strdup(argv[i]);
-    }
+struct tty_server *
+ttyd_new(const struct ttyd_options *options) {
+    struct tty_server *ts;
+    struct stat st;
 
-    // do not print error message for invalid option
-    opterr = 0;
-    while (getopt_long(argc_copy, argv_copy, opt_string, options, NULL) != -1)
-        ;
-
-    int start = argc;
-    if (optind < argc) {
-        char *command = argv_copy[optind];
-        for (int i = 0; i < argc; i++) {
-            if (strcmp(argv[i], command) == 0) {
-                start = i;
-                break;
-            }
+    ts = xmalloc(sizeof(struct tty_server));
+
+    memset(ts, 0, sizeof(struct tty_server));
+    memcpy(ts->protocols, protocols, sizeof(protocols));
+    for (int i = 0; ts->protocols[i].name != NULL; i++) {
+        ts->protocols[i].user = ts;
+    }
+    for (int i = 0; i < CLIENT_SHARDS; i++) {
+        LIST_INIT(&ts->shards[i].clients);
+        pthread_mutex_init(&ts->shards[i].mutex, NULL);
+    }
+    ts->client_count = 0;
+    TAILQ_INIT(&ts->queue);
+    LIST_INIT(&ts->service_pages);
+    ts->services = service_table_new();
+    ts->reconnect = options->reconnect;
+    ts->readonly = options->readonly;
+    ts->check_origin = options->check_origin;
+    ts->once = options->once;
+    ts->coalesce = options->coalesce;
+    ts->max_clients = options->max_clients;
+    ts->max_queue = options->max_queue;
+    ts->sig_code = options->sig_code;
+    get_sig_name(ts->sig_code, ts->sig_name, sizeof(ts->sig_name));
+    snprintf(ts->terminal_type, sizeof(ts->terminal_type), "%s",
+             options->terminal_type != NULL ? options->terminal_type : "xterm-color");
+    gethostname(ts->hostname, sizeof(ts->hostname) - 1);
+
+    if (options->credential != NULL) {
+        if (strchr(options->credential, ':') == NULL) {
+            fprintf(stderr, "ttyd: invalid credential, format: username:password\n");
+            goto error;
         }
+        ts->credential = base64_encode((const unsigned char *) options->credential, strlen(options->credential));
     }
-
-    // free argv copy
-    for (int i = 0; i < argc; i++) {
-        free(argv_copy[i]);
+    if (options->index != NULL) {
+        ts->index = strdup(options->index);
+        if (stat(ts->index, &st) == -1) {
+            fprintf(stderr, "Can not stat index.html: %s, error: %s\n", ts->index, strerror(errno));
+            goto error;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Invalid index.html path: %s, is it a dir?\n", ts->index);
+            goto error;
+        }
+    }
+    if (admission_limit_set(&ts->admission.address, options->ip_rate, options->ip_burst,
+                            options->ip_max_sessions) != 0 ||
+        admission_limit_set(&ts->admission.credential, options->credential_rate, options->credential_burst,
+                            options->credential_max_sessions) != 0) {
+        fprintf(stderr, "ttyd: invalid admission limits\n");
+        goto error;
     }
-    free(argv_copy);
+    admission_init(&ts->admission);
 
-    // reset for next use
-    opterr = 1;
-    optind = 0;
+    ts->prefs_json = strdup(options->client_options != NULL ? options->client_options : "{}");
+    // the part of the handshake shared by all the sessions
+    size_t handshake_len = strlen(ts->prefs_json) + 64;
+    ts->handshake = xmalloc(handshake_len);
+    snprintf(ts->handshake, handshake_len, "\"reconnect\":%d,\"preferences\":%s}", ts->reconnect, ts->prefs_json);
 
-    return start;
-}
-
-char **
-get_cmd(int argc, char **argv, int start) {
-    char **cmd = xmalloc(sizeof(char *) * ((argc - start) + 1));
-    int i;
-    for (i = 0; (start + i) < argc; i++) {
-        cmd[i] = strdup(argv[start + i]);
-    }
-    cmd[i] = NULL;
+    log_options(ts);
+    return ts;
 
-    return cmd;
+error:
+    ttyd_free(ts);
+    return NULL;
 }
 
 int
-main(int argc, char **argv) {
-    if (argc == 1) {
-        print_help();
+ttyd_load_services(struct tty_server *server, const char *conf_file) {
+    struct json_object *jobj = read_config(conf_file);
+    if (jobj == NULL)
+        return -1;
+    if (server->conf_file == NULL || strcmp(server->conf_file, conf_file) != 0) {
+        free(server->conf_file);
+        server->conf_file = strdup(conf_file);
+    }
+    struct json_object *g_jobj;
+    if (!json_object_object_get_ex(jobj, "service", &g_jobj)) {
+        json_object_put(jobj);
         return 0;
     }
-
-    int start = calc_command_start(argc, argv);
-    char **cmd_argv = get_cmd(argc, argv, start);
-    server = tty_server_new();
-    pthread_mutex_init(&server->mutex, NULL);
-
-    struct lws_context_creation_info info;
-    memset(&info, 0, sizeof(info));
-    info.port = -1;
-    info.iface = NULL;
-    info.protocols = protocols;
-    info.ssl_cert_filepath = NULL;
-    info.ssl_private_key_filepath = NULL;
-    info.gid = -1;
-    info.uid = -1;
-    info.max_http_header_pool = 16;
-    info.options = LWS_SERVER_OPTION_VALIDATE_UTF8;
-    info.extensions = extensions;
-
-    int debug_level = LLL_ERR | LLL_WARN | LLL_NOTICE;
-    char iface[128] = "";
-    bool browser = false;
-    bool ssl = false;
-    char cert_path[1024] = "";
-    char key_path[1024] = "";
-    char ca_path[1024] = "";
-
-    struct json_object *client_prefs = json_object_new_object();
-    const char *home = getenv("HOME");
-    struct stat st;
-
-    // parse command line options
-    int c;
-    while ((c = getopt_long(start, argv, opt_string, options, NULL)) != -1) {
-        switch (c) {
-            case 'h':
-                print_help();
-                return 0;
-            case 'v':
-                printf("ttyd-express version %s\n", TTYD_VERSION);
-                return 0;
-            case 'd':
-                debug_level = atoi(optarg);
-                break;
-            case 'f':
-                ; // empty statement
-                char *file_path;
-                if (!strncmp(optarg, "~/", 2)) {
-                    file_path = malloc(strlen(home) + strlen(optarg));
-                    sprintf(file_path, "%s%s", home, optarg + 1);
-                } else {
-                    file_path = strdup(optarg);
-                }
-                if (stat(file_path, &st) == -1) {
-                    fprintf(stderr, "Can not stat configuration file: %s, error: %s\n", file_path, strerror(errno));
-                    return -1;
-                }
-                if (S_ISDIR(st.st_mode)) {
-                    fprintf(stderr, "Invalid configuration file path: %s, is it a dir?\n", file_path);
-                    return -1;
-                }
-                FILE *fp = fopen(file_path, "r");
-                if (fp == NULL) {
-                    fprintf(stderr, "Can not open configuration file: %s\n", file_path);
-                    return -1;
-                }
-                struct json_tokener *tok;
-                tok = json_tokener_new();
-                char *buf = malloc(sizeof(char) * st.st_size);
-                if (fread(buf, 1, st.st_size, fp) != st.st_size) {
-                    fprintf(stderr, "Could not read complete file: %s\n", file_path);
-                    return -1;
-                }
-                fclose(fp);
-                struct json_object *jobj = json_tokener_parse_ex(tok, buf, st.st_size);
-                free (buf);
-                if (jobj == NULL) {
-                    fprintf(stderr, "Invalid JSON file: %s\n", file_path);
-                    return -1;
-                }
-                free (file_path);
-                struct json_object *g_jobj, *p_jobj;
-                // preference given to commandline arguments
-                if (json_object_object_get_ex(jobj, "listen", &g_jobj)) {
-                    if ((info.port == -1) && (json_object_object_get_ex(g_jobj, "port", &p_jobj)))
-                        info.port = json_object_get_int(p_jobj);
-                    if ((iface[0] == '\0') && (json_object_object_get_ex(g_jobj, "ip", &p_jobj)))
-                        strncpy(iface, json_object_get_string(p_jobj), sizeof(iface) - 1);
-                        iface[sizeof(iface) - 1] = '\0';
-                }
-                if (json_object_object_get_ex(jobj, "terminal", &g_jobj)) {
-                    json_object_object_foreach(g_jobj, key, val) {
-                        if ((json_object_object_get(client_prefs, key) == NULL) && (json_object_object_get_ex(g_jobj, key, &p_jobj))) {
-                            struct json_object *pref = NULL;
-                            if (json_object_deep_copy(p_jobj, &pref, NULL) == 0) {
-                                json_object_object_add(client_prefs, key, pref);
-                            } else {
-                                fprintf(stderr, "Failed to copy JSON configuration\n");
-                                return -1;
-                            }
-                        }
-                    }
-                }
-                if (json_object_object_get_ex(jobj, "service", &g_jobj)) {
-                    fprintf(stdout, "ttyd: service configuration found, ignoring start command if passed on commandline\n");
-                    json_object_object_foreach(g_jobj, key, val) {
-                        if (key == NULL || strlen(key) == 0 || key[0] != '/') {
-                            fprintf(stderr, "ttyd: empty or invalid service path in configuration file, it must start with a leading '/'\n");
-                            return -1;
-                        }
-                        struct service_t *service = malloc(sizeof(struct service_t));
-                        service->path = strdup(key);
-                        char *cmd = NULL;
-                        if (json_object_object_get_ex(val, "command", &p_jobj))
-                            cmd = strdup(json_object_get_string(p_jobj));
-                        if (cmd == NULL || strlen(cmd) == 0) {
-                            fprintf(stderr, "ttyd: missing start command in configuration file\n");
-                            return -1;
-                        }
-                        int args_len = 0;
-                        if (json_object_object_get_ex(val, "args", &p_jobj)) {
-                            args_len = json_object_array_length(p_jobj);
-                        }
-                        char **ser_cmd_argv = xmalloc(sizeof(char *) * (2 + args_len));
-                        int i = 0;
-                        ser_cmd_argv[i] = cmd;
-                        if (args_len > 0) {
-                            for (int j = 0; j < args_len; j++) {
-                                i++;
-                                ser_cmd_argv[i] = strdup(json_object_get_string(json_object_array_get_idx(p_jobj, j)));
-                            }
-                        }
-                        i++;
-                        ser_cmd_argv[i] = NULL;
-                        service->argv = ser_cmd_argv;
-                        LIST_INSERT_HEAD(&server->services, service, list);
-                    }
-                }
-                json_object_put(jobj);
-                break;
-            case 'R':
-                server->readonly = true;
-                break;
-            case 'O':
-                server->check_origin = true;
-                break;
-            case 'm':
-                server->max_clients = atoi(optarg);
-                break;
-            case 'o':
-                server->once = true;
-                break;
-            case 'B':
-                browser = true;
-                break;
-            case 'p':
-                info.port = atoi(optarg);
-                break;
-            case 'i':
-                strncpy(iface, optarg, sizeof(iface) - 1);
-                iface[sizeof(iface) - 1] = '\0';
-                break;
-            case 'c':
-                if (strchr(optarg, ':') == NULL) {
-                    fprintf(stderr, "ttyd: invalid credential, format: username:password\n");
-                    return -1;
-                }
-                server->credential = base64_encode((const unsigned char *) optarg, strlen(optarg));
-                break;
-            case 'u':
-                info.uid = atoi(optarg);
-                break;
-            case 'g':
-                info.gid = atoi(optarg);
-                break;
-            case 's': {
-                int sig = get_sig(optarg);
-                if (sig > 0) {
-                    server->sig_code = sig;
-                    get_sig_name(sig, server->sig_name, sizeof(server->sig_name));
-                } else {
-                    fprintf(stderr, "ttyd: invalid signal: %s\n", optarg);
-                    return -1;
-                }
-            }
-                break;
-            case 'r':
-                server->reconnect = atoi(optarg);
-                if (server->reconnect <= 0) {
-                    fprintf(stdout, "ttyd: reconnection is disabled\n");
-                }
-                break;
-            case 'I':
-                if (!strncmp(optarg, "~/", 2)) {
-                    server->index = malloc(strlen(home) + strlen(optarg));
-                    sprintf(server->index, "%s%s", home, optarg + 1);
-                } else {
-                    server->index = strdup(optarg);
-                }
-                if (stat(server->index, &st) == -1) {
-                    fprintf(stderr, "Can not stat index.html: %s, error: %s\n", server->index, strerror(errno));
-                    return -1;
-                }
-                if (S_ISDIR(st.st_mode)) {
-                    fprintf(stderr, "Invalid index.html path: %s, is it a dir?\n", server->index);
-                    return -1;
-                }
-                break;
-            case 'S':
-                ssl = true;
-                break;
-            case 'C':
-                strncpy(cert_path, optarg, sizeof(cert_path) - 1);
-                cert_path[sizeof(cert_path) - 1] = '\0';
-                break;
-            case 'K':
-                strncpy(key_path, optarg, sizeof(key_path) - 1);
-                key_path[sizeof(key_path) - 1] = '\0';
-                break;
-            case 'A':
-                strncpy(ca_path, optarg, sizeof(ca_path) - 1);
-                ca_path[sizeof(ca_path) - 1] = '\0';
-                break;
-            case 'T':
-                strncpy(server->terminal_type, optarg, sizeof(server->terminal_type) - 1);
-                server->terminal_type[sizeof(server->terminal_type) - 1] = '\0';
-                break;
-            case '?':
-                break;
-            case 't':
-                optind--;
-                for (; optind < start && *argv[optind] != '-'; optind++) {
-                    char *option = strdup(optarg);
-                    char *key = strsep(&option, "=");
-                    if (key == NULL) {
-                        fprintf(stderr, "ttyd: invalid client option: %s, format: key=value\n", optarg);
-                        return -1;
-                    }
-                    char *value = strsep(&option, "=");
-                    free(option);
-                    struct json_object *obj = json_tokener_parse(value);
-                    json_object_object_add(client_prefs, key, obj != NULL ? obj : json_object_new_string(value));
-                }
-                break;
-            default:
-                print_help();
-                return -1;
+    struct service_table *services = service_table_parse(g_jobj, server->coalesce);
+    json_object_put(jobj);
+    if (services == NULL)
+        return -1;
+    // set the cgroups up before a session runs in the cgroup of ttyd, the sessions of
+    // a service with a cgroup option are refused if it fails
+    struct service_t *service;
+    LIST_FOREACH(service, &services->list, list) {
+        if (service->cgroup != NULL) {
+            cgroup_setup();
+            break;
         }
     }
-    server->prefs_json = strdup(json_object_to_json_string(client_prefs));
-    json_object_put(client_prefs);
+    // sessions look the table up on the lws service thread only, no lock is needed
+    struct service_table *old = __atomic_exchange_n(&server->services, services, __ATOMIC_ACQ_REL);
+    service_table_unref(old);
+    int count = 0;
+    LIST_FOREACH(service, &services->list, list) {
+        count++;
+    }
+    return count;
+}
 
-    // validating parameters
-    if (info.port == -1) info.port = 7681;
-    if (info.port < 0) {
-        fprintf(stderr, "ttyd: invalid port: %d\n", info.port);
+int
+ttyd_add_service(struct tty_server *server, const char *path, char *const argv[]) {
+    if (path == NULL || path[0] != '/' || argv == NULL || argv[0] == NULL) {
+        fprintf(stderr, "ttyd: invalid service path or command\n");
         return -1;
     }
-    if (LIST_EMPTY(&server->services)) {
-        if (cmd_argv[0] == NULL) {
-            fprintf(stderr, "ttyd: missing service(s) or start command\n");
+    struct service_t *service;
+    LIST_FOREACH(service, &server->services->list, list) {
+        if (strcmp(service->path, path) == 0) {
+            fprintf(stderr, "ttyd: service path already in use: %s\n", path);
             return -1;
         }
-        struct service_t *service = malloc(sizeof(struct service_t));
-        service->path = strdup("/");
-        service->argv = cmd_argv;
-        LIST_INSERT_HEAD(&server->services, service, list);
-    } else if (cmd_argv != NULL) {
-        for (int i = 0; cmd_argv[i] != NULL; i++) {
-            free(cmd_argv[i]);
-        }
-        free(cmd_argv);
     }
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    service = xmalloc(sizeof(struct service_t));
+    memset(service, 0, sizeof(struct service_t));
+    service->path = strdup(path);
+    service->argv = xmalloc(sizeof(char *) * (argc + 1));
+    for (int i = 0; i < argc; i++) {
+        service->argv[i] = strdup(argv[i]);
+    }
+    service->argv[argc] = NULL;
+    service->coalesce = server->coalesce;
+    service->weight = 1;
+    service->keepalive = DEFAULT_KEEPALIVE;
+    // the table is only looked up on the service thread, a new entry does not disturb the sessions
+    LIST_INSERT_HEAD(&server->services->list, service, list);
+    return 0;
+}
 
-    lws_set_log_level(debug_level, NULL);
+const struct lws_protocols *
+ttyd_protocols(struct tty_server *server) {
+    return server->protocols;
+}
 
-#if LWS_LIBRARY_VERSION_MAJOR >= 2
-    char server_hdr[128] = "";
-    sprintf(server_hdr, "ttyd/%s (libwebsockets/%s)", TTYD_VERSION, LWS_LIBRARY_VERSION);
-    info.server_string = server_hdr;
-#if LWS_LIBRARY_VERSION_MINOR >= 1
-    info.ws_ping_pong_interval = 5;
-#endif
-#endif
+int
+ttyd_attach(struct tty_server *server, struct lws_context *context) {
+    if (context == NULL)
+        return -1;
+    server->context = context;
+    timer_wheel_init(&server->timers, time_monotonic());
+    return 0;
+}
 
-    if (strlen(iface) > 0) {
-        info.iface = iface;
-        if (endswith(info.iface, ".sock") || endswith(info.iface, ".socket")) {
-#if defined(LWS_USE_UNIX_SOCK) || defined(LWS_WITH_UNIX_SOCK)
-            info.options |= LWS_SERVER_OPTION_UNIX_SOCK;
-            strncpy(server->socket_path, info.iface, sizeof(server->socket_path));
-#else
-            fprintf(stderr, "libwebsockets is not compiled with UNIX domain socket support");
-            return -1;
-#endif
+// Log the time the output of each rate limited session was held back so far
+static void
+sessions_log(struct tty_server *server) {
+    for (int i = 0; i < CLIENT_SHARDS; i++) {
+        struct client_shard *shard = &server->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        struct tty_client *client;
+        LIST_FOREACH(client, &shard->clients, list) {
+            if (!client->running || client->service->rate_limit <= 0)
+                continue;
+            uint64_t throttled = __atomic_load_n(&client->throttled, __ATOMIC_RELAXED);
+            lwsl_notice("session %llu (pid %d, %s): output throttled for %.1fs\n", (unsigned long long) client->id,
+                        client->pid, client->address, (double) throttled / 1e6);
         }
+        pthread_mutex_unlock(&shard->mutex);
     }
+}
 
-    if (ssl) {
-        info.ssl_cert_filepath = cert_path;
-        info.ssl_private_key_filepath = key_path;
-        info.ssl_ca_filepath = ca_path;
-        info.ssl_cipher_list = "ECDHE-ECDSA-AES256-GCM-SHA384:"
-                "ECDHE-RSA-AES256-GCM-SHA384:"
-                "DHE-RSA-AES256-GCM-SHA384:"
-                "ECDHE-RSA-AES256-SHA384:"
-                "HIGH:!aNULL:!eNULL:!EXPORT:"
-                "!DES:!MD5:!PSK:!RC4:!HMAC_SHA1:"
-                "!SHA1:!DHE-RSA-AES128-GCM-SHA256:"
-                "!DHE-RSA-AES128-SHA256:"
-                "!AES128-GCM-SHA256:"
-                "!AES128-SHA256:"
-                "!DHE-RSA-AES256-SHA256:"
-                "!AES256-GCM-SHA384:"
-                "!AES256-SHA256";
-        if (strlen(info.ssl_ca_filepath) > 0)
-            info.options |= LWS_SERVER_OPTION_REQUIRE_VALID_OPENSSL_CLIENT_CERT;
-#if LWS_LIBRARY_VERSION_MAJOR >= 2
-        info.options |= LWS_SERVER_OPTION_REDIRECT_HTTP_TO_HTTPS;
-#endif
-    }
-
-    lwsl_notice("ttyd %s (libwebsockets %s)\n", TTYD_VERSION, LWS_LIBRARY_VERSION);
-    lwsl_notice("tty configuration:\n");
-    if (server->credential != NULL)
-        lwsl_notice("  credential: %s\n", server->credential);
-    lwsl_notice("  close signal: %s (%d)\n", server->sig_name, server->sig_code);
-    lwsl_notice("  terminal type: %s\n", server->terminal_type);
-    if (server->reconnect <= 0)
-        lwsl_notice("  reconnect timeout: disabled\n");
-    else
-        lwsl_notice("  reconnect timeout: %ds\n", server->reconnect);
-    if (server->check_origin)
-        lwsl_notice("  check origin: true\n");
-    if (server->readonly)
-        lwsl_notice("  readonly: true\n");
-    if (server->max_clients > 0)
-        lwsl_notice("  max clients: %d\n", server->max_clients);
-    if (server->once)
-        lwsl_notice("  once: true\n");
-    if (server->index != NULL) {
-        lwsl_notice("  custom index.html: %s\n", server->index);
-    }
-
-    signal(SIGINT, sig_handler);  // ^C
-    signal(SIGTERM, sig_handler); // kill
-
-    context = lws_create_context(&info);
-    if (context == NULL) {
-        lwsl_err("libwebsockets init failed\n");
-        return 1;
+void
+ttyd_service(struct tty_server *server) {
+    timer_wheel_advance(&server->timers, time_monotonic());
+    if (server->reload) {
+        server->reload = false;
+        reload_services(server);
     }
-
-    if (browser) {
-        char url[30];
-        sprintf(url, "%s://localhost:%d", ssl ? "https" : "http", info.port);
-        open_uri(url);
+    if (server->stats) {
+        server->stats = false;
+        admission_log(&server->admission);
+        sessions_log(server);
     }
-
-    // libwebsockets main loop
-    while (!force_exit) {
-        pthread_mutex_lock(&server->mutex);
-        if (!LIST_EMPTY(&server->clients)) {
-            struct tty_client *client;
-            LIST_FOREACH(client, &server->clients, list) {
-                if (client->running) {
-                    pthread_mutex_lock(&client->mutex);
-                    if (client->state != STATE_DONE)
-                        lws_callback_on_writable(client->wsi);
-                    else
-                        pthread_cond_signal(&client->cond);
-                    pthread_mutex_unlock(&client->mutex);
+    if (server->max_queue > 0)
+        tty_queue_service(server);
+    // deficit round robin: while several sessions have output, each one gets a quantum
+    // per tick so a busy session can not hold back the others, alone it sends all it has
+    size_t quantum = server->ready > 1 ? SCHED_QUANTUM : BUF_SIZE;
+    server->ready = 0;
+    for (int i = 0; i < CLIENT_SHARDS; i++) {
+        struct client_shard *shard = &server->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        struct tty_client *client;
+        LIST_FOREACH(client, &shard->clients, list) {
+            if (client->running) {
+                pthread_mutex_lock(&client->mutex);
+                // a paused session keeps its output until the client resumes it
+                if (client->state == STATE_READY && !client->paused) {
+                    client->deficit += quantum * client->weight;
+                    if (client->deficit > BUF_SIZE)
+                        client->deficit = BUF_SIZE;
+                    server->ready++;
                 }
+                if (client->state == STATE_DONE)
+                    pthread_cond_signal(&client->cond);
+                else if (!client->paused)
+                    lws_callback_on_writable(client->wsi);
+                pthread_mutex_unlock(&client->mutex);
             }
         }
-        pthread_mutex_unlock(&server->mutex);
-        lws_service(context, 10);
+        pthread_mutex_unlock(&shard->mutex);
     }
+}
 
-    lws_context_destroy(context);
+int
+ttyd_run(struct tty_server *server) {
+    if (server->context == NULL)
+        return -1;
+    // libwebsockets main loop
+    while (!server->stop) {
+        ttyd_service(server);
+        lws_service(server->context, 10);
+    }
+    return 0;
+}
 
-    // cleanup
-    tty_server_free(server);
+void
+ttyd_stop(struct tty_server *server) {
+    server->stop = true;
+    if (server->context != NULL)
+        lws_cancel_service(server->context);
+}
 
-    return 0;
+bool
+ttyd_stopped(struct tty_server *server) {
+    return server != NULL && server->stop;
+}
+
+void
+ttyd_reload(struct tty_server *server) {
+    server->reload = true;
+    if (server->context != NULL)
+        lws_cancel_service(server->context);
+}
+
+void
+ttyd_stats(struct tty_server *server) {
+    server->stats = true;
+    if (server->context != NULL)
+        lws_cancel_service(server->context);
+}
+
+int
+ttyd_client_count(struct tty_server *server) {
+    return client_count(server);
+}
+
+void
+ttyd_free(struct tty_server *ts) {
+    if (ts == NULL)
+        return;
+    service_table_unref(ts->services);
+    service_pages_free(ts);
+    admission_log(&ts->admission);
+    admission_free(&ts->admission);
+    if (ts->conf_file != NULL)
+        free(ts->conf_file);
+    if (ts->credential != NULL)
+        free(ts->credential);
+    if (ts->index != NULL)
+        free(ts->index);
+    free(ts->prefs_json);
+    free(ts->handshake);
+    while (ts->pty_buffer_count > 0)
+        free(ts->pty_buffers[--ts->pty_buffer_count]);
+    arena_cache_free(&ts->arena_cache);
+    for (int i = 0; i < CLIENT_SHARDS; i++) {
+        pthread_mutex_destroy(&ts->shards[i].mutex);
+    }
+    free(ts);
 }
@@ -2,25 +2,58 @@
 #include <sys/ioctl.h>
 #include <sys/queue.h>
 
+#include "ttyd.h"
+#include "admission.h"
+#include "arena.h"
+#include "log.h"
+#include "timer.h"
+
 // client message
 #define INPUT '0'
 #define RESIZE_TERMINAL '1'
 #define JSON_DATA '{'
+#define FILE_REQUEST '2'
+#define FILE_UPLOAD '3'
+#define CLOSE_CHANNEL '4'
+#define PAUSE '5'
+#define RESUME '6'
 
 // server message
 #define OUTPUT '0'
 #define SET_WINDOW_TITLE '1'
 #define SET_PREFERENCES '2'
 #define SET_RECONNECT '3'
+#define HANDSHAKE '4'
+#define FILE_STATUS '5'
+#define FILE_DOWNLOAD '6'
+#define CHANNEL_CLOSED '7'
+#define QUEUE_POSITION '8'
 
 // websocket url path
 #define WS_PATH "/ws"
 
 #define BUF_SIZE 32768 // 32K
 
-extern volatile bool force_exit;
-extern struct lws_context *context;
-extern struct tty_server *server;
+// seconds between two pings when the service does not set it
+#define DEFAULT_KEEPALIVE 5
+
+// number of locks the client registry is split over
+#define CLIENT_SHARDS 16
+
+// output a session may send per tick while other sessions are waiting
+#define SCHED_QUANTUM 4096
+
+// room in front of a message: the lws header, the channel of a multiplexed session and the message type
+#define MSG_PRE (LWS_PRE + 2)
+
+// output buffer of a session, with room for the message header
+#define PTY_BUFFER_SIZE (MSG_PRE + BUF_SIZE)
+
+// sessions a multiplexed connection can carry, the channel is a single byte
+#define MUX_CHANNELS 256
+
+// released output buffers kept for the next sessions
+#define PTY_BUFFER_POOL_MAX 16
 
 enum pty_state {
     STATE_INIT, STATE_READY, STATE_DONE
@@ -29,48 +62,161 @@ enum pty_state {
 struct service_t {
     char *path;
     char **argv;
+    bool coalesce;                            // collapse redraws with a screen model when the client falls behind
+    struct record_config *record;             // session recording, NULL if disabled
+    struct cgroup_config *cgroup;             // cgroup limits of the sessions, NULL if disabled
+    char *playback_dir;                       // recordings directory of a playback service
+    char *files_dir;                          // directory of the file transfers, NULL if disabled
+    int weight;                               // share of the output bandwidth against the other sessions
+    size_t rate_limit;                        // maximum output rate (bytes/s), 0 for no limit
+    size_t rate_burst;                        // output allowed above the rate after an idle time
+    int keepalive;                            // seconds between two pings, 0 to disable
+    int idle_input_timeout;                   // close the session after this long without input (s)
+    int idle_output_timeout;                  // close the session after this long without output (s)
+    int time_limit;                           // maximum session duration (s)
     LIST_ENTRY(service_t) list;
 };
 
+// An immutable set of services, it is replaced as a whole when the configuration
+// file is reloaded and freed once the last session using it is gone
+struct service_table {
+    LIST_HEAD(service, service_t) list;
+    int refs;
+};
+
 struct tty_client {
+    uint64_t id;                              // session id of the traces
+    struct tty_server *server;
     bool running;
     bool initialized;
+    bool handshake;                           // send the initial messages in a single frame
     int initial_cmd_index;
     bool authenticated;
-    char hostname[100];
     char address[50];
+    char hostname[100];                       // resolved in the background with --resolve-hosts, empty until then
     char **argv;
     char **fragment;
+    struct service_t *service;
+    struct service_table *service_table;      // table the service belongs to, referenced by the client
 
     struct lws *wsi;
     struct winsize size;
-    char *buffer;
+    char *buffer;                             // receive buffer, kept for the whole connection
+    size_t buffer_size;
     size_t len;
+    struct arena arena;                       // fragments and command arguments
 
     int pid;
     int pty;
     enum pty_state state;
-    char pty_buffer[LWS_PRE + 1 + BUF_SIZE];
+    char *pty_buffer;                         // PTY_BUFFER_SIZE, attached when the session starts
     ssize_t pty_len;
+    size_t pty_sent;                          // part of the output already sent
+    size_t deficit;                           // bytes the session may send, granted by the scheduler
+    int weight;
+    uint64_t throttled;                       // time the output was held back by the rate limit (us), written by the pty thread
+    char *cgroup;                             // cgroup of the session, removed when it ends
+
+    struct timer timer;                       // keepalive and timeouts
+    uint64_t started;
+    uint64_t last_input;
+    uint64_t last_output;                     // written by the pty thread
+    uint64_t next_ping;
+    bool ping_pending;                        // a ping is to be sent
+    bool pong_pending;                        // the last ping was not answered yet
+    const char *close_reason;                 // the session is closed on the next writable callback
+
+    struct transfer *transfer;                // file transfer in progress
+    char *file_buffer;                        // download frame buffer
+    char *file_status;                        // FILE_STATUS message to send
+    bool upload_fragment;                     // the received message continues an upload
+
+    int channel;                              // channel of a multiplexed session, -1 on a connection of its own
+    int close_status;                         // reported to the client when a multiplexed session closes
+    bool paused;                              // the client holds the output back
+
+    struct admission_source source;           // address and credential the admission limits apply to
+    bool admitted;                            // whether the session is counted against its source
+    bool queued;                              // waiting for a session at --max-clients
+    int queue_position;                       // 1 for the next connection to get a session
+    bool queue_position_pending;              // the position is to be sent
+    TAILQ_ENTRY(tty_client) queue;
+
     pthread_t thread;
+    int wake[2];                              // pipe to stop the pty thread
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+    struct vt_screen *vt;
+    struct recorder *recorder;
+    struct playback *playback;
 
+    int shard;                                // registry shard the client is in
+    bool registered;                          // whether the client is in the registry
     LIST_ENTRY(tty_client) list;
 };
 
+struct client_shard {
+    LIST_HEAD(client, tty_client) clients;
+    pthread_mutex_t mutex;
+};
+
+// A websocket connection of the "tty-mux" protocol: it carries many sessions, each
+// message starts with the channel of its session, see mux.c
+struct mux_conn {
+    struct tty_server *server;
+    struct lws *wsi;
+    bool authenticated;
+    char **fragment;                          // GET arguments, shared by the sessions
+    struct arena arena;
+    struct admission_source source;
+    struct tty_client *channels[MUX_CHANNELS];
+    int count;                                // open channels
+    int rx_channel;                           // channel of the message being received, -1 between messages
+    int next;                                 // channel the writable callback looks at first
+    unsigned short closed[MUX_CHANNELS];      // close status of the channels to report, 0 if none
+    int closing;                              // channels to report
+
+    struct timer timer;                       // keepalive of the connection
+    bool ping_pending;
+    bool pong_pending;
+    bool timed_out;
+};
+
 struct pss_http {
     char path[128];
     char *buffer;
     char *ptr;
     size_t len;
+    bool owned;                               // whether the buffer is freed once sent
 };
 
+// A terminal server: its sessions, services and options. Everything a session needs is
+// reached from here, the connections find it as the user of their protocol.
 struct tty_server {
-    LIST_HEAD(client, tty_client) clients;    // client list
-    int client_count;                         // client count
-    LIST_HEAD(service, service_t) services;   // service list
+    struct lws_protocols protocols[4];        // http-only, tty and tty-mux, the user of each is the server
+    struct lws_context *context;              // context the server is attached to
+    volatile bool stop;                       // set by ttyd_stop(), ttyd_run() returns
+    volatile bool reload;                     // reload the services on the next tick
+    volatile bool stats;                      // log the admission counters on the next tick
+    int ready;                                // sessions with output at the last tick
+    struct client_shard shards[CLIENT_SHARDS]; // client registry
+    unsigned int next_shard;                  // shard of the next client
+    int client_count;                         // client count, updated atomically
+    struct timer_wheel timers;                // client timers, only used from the service thread
+    struct admission admission;               // per source connection limits, only used from the service thread
+    struct service_table *services;           // current service table
+    char *conf_file;                          // configuration file path, reloaded by ttyd_reload()
+    bool coalesce;                            // default coalesce option of the services
+    LIST_HEAD(service_page_list, service_page) service_pages; // generated service pages, see http.c
+    char *pty_buffers[PTY_BUFFER_POOL_MAX];   // released output buffers, only used from the service thread
+    int pty_buffer_count;
+    struct arena_cache arena_cache;           // released arena chunks, only used from the service thread
+    struct log_rate http_rate;                // sampling of the http requests
+    struct log_rate ws_rate;                  // sampling of the websocket connections
+    struct log_rate mux_rate;                 // sampling of the multiplexed connections and channels
     char *prefs_json;                         // client preferences
+    char *handshake;                          // cached end of the handshake message
+    char hostname[128];                       // host name shown in the window title
     char *credential;                         // encoded basic auth credential
     int reconnect;                            // reconnect timeout
     char *index;                              // custom index.html
@@ -79,15 +225,91 @@ struct tty_server {
     bool readonly;                            // whether not allow clients to write to the TTY
     bool check_origin;                        // whether allow websocket connection from different origin
     int max_clients;                          // maximum clients to support
+    int max_queue;                            // connections allowed to wait at max_clients
+    TAILQ_HEAD(client_queue, tty_client) queue; // connections waiting for a session, in arrival order
+    int queue_length;
+    bool queue_changed;                       // positions in the queue are to be updated
     bool once;                                // whether accept only one client and exit on disconnection
-    char socket_path[255];                    // UNIX domain socket path
     char terminal_type[30];                   // terminal type to report
-    pthread_mutex_t mutex;
 };
 
+// Get the client count without locking the registry
+static inline int
+client_count(struct tty_server *server) {
+    return __atomic_load_n(&server->client_count, __ATOMIC_RELAXED);
+}
+
+// Get the server of a connection, NULL if it is not bound to one of its protocols
+static inline struct tty_server *
+wsi_server(struct lws *wsi) {
+    const struct lws_protocols *protocol = wsi != NULL ? lws_get_protocol(wsi) : NULL;
+    return protocol != NULL ? (struct tty_server *) protocol->user : NULL;
+}
+
+extern struct service_table *
+service_table_ref(struct service_table *table);
+
+extern void
+service_table_unref(struct service_table *table);
+
+extern void
+service_pages_free(struct tty_server *server);
+
+extern int
+request_path(struct lws *wsi, char *buf, int len);
+
 extern int
 callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
 extern int
 callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
+extern int
+callback_tty_mux(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+
+// sessions, shared by the "tty" and "tty-mux" protocols
+extern bool
+ws_connection_allowed(struct lws *wsi, struct admission_source *source);
+
+extern void
+admission_refused(enum admission_result result);
+
+extern char **
+ws_fragments(struct lws *wsi, struct arena *arena);
+
+extern void
+tty_client_init(struct tty_client *client, struct lws *wsi);
+
+extern void
+tty_client_add(struct tty_client *client);
+
+extern int
+tty_client_start(struct tty_client *client);
+
+extern bool
+tty_client_pending(struct tty_client *client);
+
+extern int
+tty_client_writable(struct lws *wsi, struct tty_client *client);
+
+extern int
+tty_client_receive(struct lws *wsi, struct tty_client *client, void *in, size_t len);
+
+extern void
+tty_client_destroy(struct tty_client *client);
+
+extern void
+exit_if_once(struct tty_server *server);
+
+extern const char *
+client_hostname(struct tty_client *client);
+
+extern void
+tty_queue_add(struct tty_client *client);
+
+extern void
+tty_queue_remove(struct tty_client *client);
+
+extern void
+tty_queue_service(struct tty_server *server);
+
@@ -0,0 +1,79 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+void
+timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            LIST_INIT(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+static void
+timer_insert(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+    // find the lowest level whose range covers the delay, the top level takes the rest
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+    uint64_t max = ((uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1))) - 1;
+    if (delta > max)
+        timer->expires = wheel->now + max;
+    int slot = (int) ((timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, list);
+    timer->active = true;
+}
+
+void
+timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t delay) {
+    timer_cancel(timer);
+    timer->expires = wheel->now + (delay > 0 ? delay : 1);
+    timer_insert(wheel, timer);
+}
+
+void
+timer_cancel(struct timer *timer) {
+    if (!timer->active)
+        return;
+    LIST_REMOVE(timer, list);
+    timer->active = false;
+}
+
+// move the timers of the current slot of a level to the levels below
+static void
+cascade(struct timer_wheel *wheel, int level) {
+    int slot = (int) ((wheel->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    struct timer *timer = LIST_FIRST(&wheel->slots[level][slot]);
+    LIST_INIT(&wheel->slots[level][slot]);
+    while (timer != NULL) {
+        struct timer *next = LIST_NEXT(timer, list);
+        timer_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+void
+timer_wheel_advance(struct timer_wheel *wheel, uint64_t now) {
+    while (wheel->now < now) {
+        wheel->now++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            cascade(wheel, level);
+        }
+        struct timer_list *list = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while (!LIST_EMPTY(list)) {
+            struct timer *timer = LIST_FIRST(list);
+            LIST_REMOVE(timer, list);
+            timer->active = false;
+            timer->cb(timer);
+        }
+    }
+}
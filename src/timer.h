@@ -0,0 +1,52 @@
+#ifndef TTYD_TIMER_H
+#define TTYD_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer;
+
+typedef void (*timer_cb)(struct timer *timer);
+
+struct timer {
+    uint64_t expires;               // tick the timer fires at
+    timer_cb cb;
+    void *data;
+    bool active;
+    LIST_ENTRY(timer) list;
+};
+
+LIST_HEAD(timer_list, timer);
+
+// A hierarchical timing wheel with a resolution of one tick: level 0 holds the
+// timers of the next 64 ticks, each level above covers 64 times the range of the
+// one below and is moved down when the level below wraps. Adding and cancelling a
+// timer is O(1), whatever the number of timers. It is not thread safe.
+struct timer_wheel {
+    uint64_t now;
+    struct timer_list slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+// Initialize the wheel at the given tick
+void
+timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+// Arm the timer to fire in delay ticks, a timer that is already armed is moved
+void
+timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t delay);
+
+// Disarm the timer, it is fine to cancel a timer that is not armed
+void
+timer_cancel(struct timer *timer);
+
+// Advance the wheel to the given tick, the callbacks of the expired timers are
+// called in order and may arm timers again
+void
+timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+#endif //TTYD_TIMER_H
@@ -0,0 +1,34 @@
+#ifndef TTYD_TRACE_H
+#define TTYD_TRACE_H
+
+// Static tracepoints (USDT) of the session lifecycle and of the data path, to be used
+// with bpftrace or perf as usdt:<path of ttyd>:ttyd:<probe>, see scripts/trace. They are
+// built in when sys/sdt.h is found (ENABLE_SDT), a probe is then a nop until a tracer
+// attaches; otherwise they compile to nothing and their arguments are not evaluated.
+//
+// probe          arguments
+// filter         allowed (0 or 1), multiplexed (0 or 1)
+// auth           session, authenticated (0 or 1)
+// spawn_start    session
+// spawn_end      session, pid
+// pty_read       session, bytes
+// frame_enqueue  session, bytes pending in the output buffer
+// throttle       session, time the output was held back by the rate limit (us)
+// ws_write       session, message type, bytes
+// input          session, bytes written to the pty
+// resize         session, columns, rows
+// teardown       session
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define TRACE1(probe, a) DTRACE_PROBE1(ttyd, probe, a)
+#define TRACE2(probe, a, b) DTRACE_PROBE2(ttyd, probe, a, b)
+#define TRACE3(probe, a, b, c) DTRACE_PROBE3(ttyd, probe, a, b, c)
+#else
+#define TRACE1(probe, a) do {} while (0)
+#define TRACE2(probe, a, b) do {} while (0)
+#define TRACE3(probe, a, b, c) do {} while (0)
+#endif
+
+#endif //TTYD_TRACE_H
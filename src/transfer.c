@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "transfer.h"
+#include "utils.h"
+
+#define PART_SUFFIX ".part"
+
+// Resolve name below root: it must be a relative path without ".." components and,
+// once the symbolic links are followed, the file (the directory of an upload) must
+// still be below root
+static char *
+resolve_path(const char *root, const char *name, bool upload) {
+    if (name[0] == '\0' || name[0] == '/')
+        return NULL;
+    for (const char *p = name; *p != '\0';) {
+        size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.')
+            return NULL;
+        p += n;
+        if (*p == '/')
+            p++;
+    }
+
+    char real_root[PATH_MAX], path[PATH_MAX], real[PATH_MAX];
+    if (realpath(root, real_root) == NULL)
+        return NULL;
+    size_t root_len = strcmp(real_root, "/") == 0 ? 0 : strlen(real_root);
+    if (snprintf(path, sizeof(path), "%s/%s", real_root, name) >= (int) sizeof(path))
+        return NULL;
+
+    if (upload) {
+        // the file may not exist yet, check its directory
+        char *slash = strrchr(path, '/');
+        const char *base = slash + 1;
+        if (*base == '\0' || strcmp(base, ".") == 0)
+            return NULL;
+        *slash = '\0';
+        if (realpath(path, real) == NULL)
+            return NULL;
+        size_t n = strlen(real);
+        if (n + 1 + strlen(base) + strlen(PART_SUFFIX) >= sizeof(real))
+            return NULL;
+        real[n] = '/';
+        strcpy(real + n + 1, base);
+    } else if (realpath(path, real) == NULL) {
+        return NULL;
+    }
+
+    if (strncmp(real, real_root, root_len) != 0 || real[root_len] != '/')
+        return NULL;
+    return strdup(real);
+}
+
+struct transfer *
+transfer_open(const char *root, const char *name, bool upload, uint64_t size, const char **error) {
+    errno = 0;
+    char *path = resolve_path(root, name, upload);
+    if (path == NULL) {
+        *error = errno == ENOENT ? strerror(errno) : "Invalid path";
+        return NULL;
+    }
+
+    struct transfer *transfer = xmalloc(sizeof(struct transfer));
+    memset(transfer, 0, sizeof(struct transfer));
+    transfer->upload = upload;
+    transfer->name = strdup(name);
+    transfer->path = path;
+    transfer->size = size;
+
+    if (upload) {
+        // write next to the file and replace it at the end, readers never see half a file
+        transfer->part = xmalloc(strlen(path) + strlen(PART_SUFFIX) + 1);
+        sprintf(transfer->part, "%s%s", path, PART_SUFFIX);
+        transfer->fd = open(transfer->part, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    } else {
+        // do not block on a fifo, it is refused below anyway
+        transfer->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (transfer->fd < 0) {
+        *error = strerror(errno);
+        goto error;
+    }
+
+    if (!upload) {
+        struct stat st;
+        if (fstat(transfer->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            *error = "Not a regular file";
+            goto error;
+        }
+        transfer->size = (uint64_t) st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(transfer->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+    return transfer;
+
+error:
+    // nothing was written, do not create the file
+    transfer->upload = false;
+    transfer_close(transfer);
+    return NULL;
+}
+
+ssize_t
+transfer_read(struct transfer *transfer, char *buf, size_t len) {
+    // stop at the announced size even if the file grows meanwhile
+    if (len > transfer->size - transfer->offset)
+        len = (size_t) (transfer->size - transfer->offset);
+    if (len == 0)
+        return 0;
+    ssize_t n;
+    do {
+        n = read(transfer->fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        transfer->offset += n;
+    return n;
+}
+
+ssize_t
+transfer_write(struct transfer *transfer, const char *buf, size_t len) {
+    if (len > transfer->size - transfer->offset) {
+        errno = EFBIG;
+        return -1;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(transfer->fd, buf + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+    }
+    transfer->offset += written;
+    return (ssize_t) written;
+}
+
+bool
+transfer_complete(const struct transfer *transfer) {
+    return transfer->offset == transfer->size;
+}
+
+int
+transfer_close(struct transfer *transfer) {
+    int rc = 0;
+    if (transfer->fd >= 0)
+        close(transfer->fd);
+    if (transfer->upload) {
+        if (transfer_complete(transfer))
+            rc = rename(transfer->part, transfer->path);
+        else
+            unlink(transfer->part);
+    }
+    free(transfer->name);
+    free(transfer->path);
+    free(transfer->part);
+    free(transfer);
+    return rc;
+}
@@ -0,0 +1,42 @@
+#ifndef TTYD_TRANSFER_H
+#define TTYD_TRANSFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A file upload or download of a session, the files are below the directory
+// given by the "files" option of the service.
+struct transfer {
+    int fd;
+    bool upload;
+    char *name;                 // path relative to the files directory, as requested
+    char *path;                 // resolved path of the file
+    char *part;                 // upload: file written to, renamed to path once complete
+    uint64_t size;              // size of the file, announced by the client for an upload
+    uint64_t offset;            // bytes transferred
+};
+
+// Open name below root for a download, or create it for an upload of the given size.
+// Returns NULL and sets error to a message for the client on failure.
+struct transfer *
+transfer_open(const char *root, const char *name, bool upload, uint64_t size, const char **error);
+
+// Read the next part of a download into buf, returns 0 at the end of the file
+ssize_t
+transfer_read(struct transfer *transfer, char *buf, size_t len);
+
+// Write the next part of an upload, returns -1 past the announced size
+ssize_t
+transfer_write(struct transfer *transfer, const char *buf, size_t len);
+
+// Whether all the bytes of the transfer went through
+bool
+transfer_complete(const struct transfer *transfer);
+
+// Close the transfer, a complete upload replaces the file, an incomplete one is dropped
+int
+transfer_close(struct transfer *transfer);
+
+#endif //TTYD_TRANSFER_H
@@ -0,0 +1,122 @@
+#ifndef TTYD_TTYD_H
+#define TTYD_TTYD_H
+
+#include <stdbool.h>
+
+// libttyd: serve terminals from a libwebsockets context. A server holds its services,
+// options, sessions, caches and log sampling. The servers of a process only share the
+// log (log.h), the host name resolver (resolve.h), the cgroup ttyd runs in and the
+// atomic counter of the session ids of the traces.
+//
+// Standalone, like the ttyd program:
+//
+//     struct ttyd_options options;
+//     ttyd_options_init(&options);
+//     struct tty_server *server = ttyd_new(&options);
+//     ttyd_add_service(server, "/", argv);
+//     info.protocols = ttyd_protocols(server);
+//     struct lws_context *context = lws_create_context(&info);
+//     ttyd_attach(server, context);
+//     ttyd_run(server);
+//     lws_context_destroy(context);
+//     ttyd_free(server);
+//
+// Embedded in an existing context, the protocols of ttyd_protocols() are added to those
+// of the vhost serving the terminals (or to a vhost of their own), and ttyd_service() is
+// called from the loop of the application before each lws_service().
+
+struct tty_server;
+struct lws_context;
+struct lws_protocols;
+
+struct ttyd_options {
+    const char *credential;                 // username:password for basic authentication, NULL for none
+    const char *index;                      // custom index.html path, NULL for the built-in page
+    const char *terminal_type;              // terminal type to report (default: xterm-color)
+    const char *client_options;             // JSON object of the client preferences, NULL for none
+    int sig_code;                           // signal sent to the command when the session ends (default: SIGHUP)
+    int reconnect;                          // reconnect timeout of the client (s), <= 0 to disable (default: 10)
+    bool readonly;                          // do not allow clients to write to the TTY
+    bool check_origin;                      // refuse websocket connections from a different origin
+    bool once;                              // stop the server when the first client disconnects
+    bool coalesce;                          // default coalesce option of the services
+    int max_clients;                        // maximum sessions, 0 for no limit
+    int max_queue;                          // connections waiting for a session at max_clients
+    double ip_rate;                         // connections per second from a client address, 0 for no limit
+    double ip_burst;
+    int ip_max_sessions;                    // sessions of a client address, 0 for no limit
+    double credential_rate;                 // connections per second with a credential, 0 for no limit
+    double credential_burst;
+    int credential_max_sessions;            // sessions of a credential, 0 for no limit
+};
+
+// Set the default options
+void
+ttyd_options_init(struct ttyd_options *options);
+
+// Parse a rate limit like "2" or "2/10" (connections per second / burst) for the rate
+// options, the burst defaults to the rate. Returns -1 if it is invalid.
+int
+ttyd_parse_rate(const char *str, double *rate, double *burst);
+
+// Create a server without any service, NULL if an option is invalid. The options are
+// copied, the server logs its configuration.
+struct tty_server *
+ttyd_new(const struct ttyd_options *options);
+
+// Replace the services with those of the "service" block of a configuration file, which
+// ttyd_reload() reads again. Returns the number of services, 0 if the file has none (the
+// services are kept then) or -1 if it can not be read or is invalid.
+int
+ttyd_load_services(struct tty_server *server, const char *conf_file);
+
+// Add a service running argv (NULL terminated) at path, returns -1 if the path is
+// invalid or already served
+int
+ttyd_add_service(struct tty_server *server, const char *path, char *const argv[]);
+
+// Protocols of the server, terminated by an empty one: "http-only" (the terminal page),
+// "tty" and "tty-mux" (the sessions). They must outlive the vhosts they are given to.
+const struct lws_protocols *
+ttyd_protocols(struct tty_server *server);
+
+// Attach the server to the context whose vhost serves its protocols, before the first
+// call to ttyd_service()
+int
+ttyd_attach(struct tty_server *server, struct lws_context *context);
+
+// Run the timers and the reloads, and share the output bandwidth between the sessions.
+// To be called before each lws_service() of the context, with a timeout of about 10ms.
+void
+ttyd_service(struct tty_server *server);
+
+// Service the context until ttyd_stop()
+int
+ttyd_run(struct tty_server *server);
+
+// Make ttyd_run() return, safe to call from a signal handler
+void
+ttyd_stop(struct tty_server *server);
+
+// Whether the server was stopped, by ttyd_stop() or by its last client with the once option
+bool
+ttyd_stopped(struct tty_server *server);
+
+// Reload the services on the next tick, safe to call from a signal handler
+void
+ttyd_reload(struct tty_server *server);
+
+// Log the admission counters and the time the output of each rate limited session was
+// throttled on the next tick, safe to call from a signal handler
+void
+ttyd_stats(struct tty_server *server);
+
+// Number of sessions
+int
+ttyd_client_count(struct tty_server *server);
+
+// Free the server, once the context it is attached to is destroyed
+void
+ttyd_free(struct tty_server *server);
+
+#endif //TTYD_TTYD_H
@@ -2,8 +2,14 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <json.h>
 
 #ifdef __linux__
 // https://github.com/karelzak/util-linux/blob/master/misc-utils/kill.c
@@ -101,6 +107,99 @@ open_uri(char *uri) {
 #endif
 }
 
+uint64_t
+time_monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec;
+}
+
+size_t
+utf8_complete_length(const char *buf, size_t len) {
+    size_t i = len;
+    int cont = 0;
+    while (i > 0 && cont < 3 && ((unsigned char) buf[i - 1] & 0xc0) == 0x80) {
+        i--;
+        cont++;
+    }
+    if (i == 0)
+        return len;
+
+    unsigned char c = (unsigned char) buf[i - 1];
+    int need = 0;
+    if (c >= 0xc2 && c <= 0xdf)
+        need = 1;
+    else if (c >= 0xe0 && c <= 0xef)
+        need = 2;
+    else if (c >= 0xf0 && c <= 0xf4)
+        need = 3;
+
+    return need > cont ? i - 1 : len;
+}
+
+// Length of the valid utf-8 sequence at the start of buf, 0 if it is invalid or cut
+static size_t
+utf8_sequence_length(const unsigned char *buf, size_t len) {
+    unsigned char c = buf[0];
+    size_t n;
+    uint32_t min;
+    if (c < 0x80)
+        return 1;
+    if ((c & 0xe0) == 0xc0) {
+        n = 2;
+        min = 0x80;
+    } else if ((c & 0xf0) == 0xe0) {
+        n = 3;
+        min = 0x800;
+    } else if ((c & 0xf8) == 0xf0) {
+        n = 4;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (len < n)
+        return 0;
+    uint32_t cp = c & (0x7f >> n);
+    for (size_t i = 1; i < n; i++) {
+        if ((buf[i] & 0xc0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (buf[i] & 0x3f);
+    }
+    // overlong forms, surrogates and code points beyond U+10FFFF are invalid
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+        return 0;
+    return n;
+}
+
+char *
+utf8_sanitize(const char *buf, size_t len, size_t *out_len) {
+    const unsigned char *p = (const unsigned char *) buf;
+    size_t i = 0, n;
+    while (i < len && (n = utf8_sequence_length(p + i, len - i)) > 0)
+        i += n;
+    if (i == len)
+        return NULL;
+
+    char *out = xmalloc(len * 3 + 1);
+    memcpy(out, buf, i);
+    size_t o = i;
+    while (i < len) {
+        n = utf8_sequence_length(p + i, len - i);
+        if (n > 0) {
+            memcpy(out + o, buf + i, n);
+            o += n;
+            i += n;
+        } else {
+            memcpy(out + o, "\xef\xbf\xbd", 3);
+            o += 3;
+            i++;
+        }
+    }
+    out[o] = '\0';
+    *out_len = o;
+    return out;
+}
+
 // https://github.com/darkk/redsocks/blob/master/base64.c
 char *
 base64_encode(const unsigned char *buffer, size_t length) {
@@ -126,4 +225,38 @@ base64_encode(const unsigned char *buffer, size_t length) {
     *dst = '\0';
 
     return ret;
-}
\ No newline at end of file
+}
+
+// Read and parse the configuration file
+struct json_object *
+read_config(const char *file_path) {
+    struct stat st;
+    if (stat(file_path, &st) == -1) {
+        fprintf(stderr, "Can not stat configuration file: %s, error: %s\n", file_path, strerror(errno));
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Invalid configuration file path: %s, is it a dir?\n", file_path);
+        return NULL;
+    }
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Can not open configuration file: %s\n", file_path);
+        return NULL;
+    }
+    char *buf = malloc(sizeof(char) * st.st_size);
+    if (fread(buf, 1, st.st_size, fp) != st.st_size) {
+        fprintf(stderr, "Could not read complete file: %s\n", file_path);
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
+    fclose(fp);
+    struct json_tokener *tok = json_tokener_new();
+    struct json_object *jobj = json_tokener_parse_ex(tok, buf, st.st_size);
+    json_tokener_free(tok);
+    free(buf);
+    if (jobj == NULL)
+        fprintf(stderr, "Invalid JSON file: %s\n", file_path);
+    return jobj;
+}
@@ -1,6 +1,10 @@
 #ifndef TTYD_UTIL_H
 #define TTYD_UTIL_H
 
+#include <stdint.h>
+
+struct json_object;
+
 // malloc with NULL check
 void *
 xmalloc(size_t size);
@@ -29,8 +33,25 @@ get_sig(const char *sig_name);
 int
 open_uri(char *uri);
 
+// Get the seconds elapsed on the monotonic clock
+uint64_t
+time_monotonic();
+
+// Get the length of buf without the trailing incomplete utf-8 sequence, if any
+size_t
+utf8_complete_length(const char *buf, size_t len);
+
+// Replace the bytes of buf which are not part of a valid utf-8 sequence with U+FFFD.
+// Returns a new string of out_len bytes, or NULL if buf is valid as it is.
+char *
+utf8_sanitize(const char *buf, size_t len, size_t *out_len);
+
 // Encode text to base64, the caller should free the returned string
 char *
 base64_encode(const unsigned char *buffer, size_t length);
 
+// Read and parse a JSON configuration file, NULL if it can not be read or is invalid
+struct json_object *
+read_config(const char *file_path);
+
 #endif //TTYD_UTIL_H
@@ -0,0 +1,939 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vt.h"
+#include "utils.h"
+
+enum vt_state {
+    VT_GROUND, VT_ESC, VT_CSI, VT_OSC, VT_OSC_ESC, VT_STRING, VT_STRING_ESC, VT_CHARSET, VT_IGNORE_ONE, VT_UTF8
+};
+
+#define CELL(vt, g, x, y) ((vt)->grid[g][(y) * (vt)->cols + (x)])
+
+static void
+desync(struct vt_screen *vt) {
+    vt->synced = false;
+    vt->resync = 0;
+}
+
+// the screen is fully known again once it is cleared, the cursor moved to an
+// absolute position and the attributes reset
+static void
+resync(struct vt_screen *vt, int flag) {
+    if (vt->synced)
+        return;
+    vt->resync |= flag;
+    if (vt->resync == 7)
+        vt->synced = true;
+}
+
+static int
+char_width(uint32_t cp) {
+    // combining and zero width characters are not supported
+    if ((cp >= 0x0300 && cp <= 0x036f) || (cp >= 0x200b && cp <= 0x200f) || (cp >= 0xfe00 && cp <= 0xfe0f))
+        return 0;
+    if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0xa4cf && cp != 0x303f) ||
+        (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) || (cp >= 0xfe30 && cp <= 0xfe4f) ||
+        (cp >= 0xff00 && cp <= 0xff60) || (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x1f300 && cp <= 0x1f64f) ||
+        (cp >= 0x1f900 && cp <= 0x1f9ff) || (cp >= 0x20000 && cp <= 0x3fffd))
+        return 2;
+    return 1;
+}
+
+static void
+blank(struct vt_screen *vt, struct vt_cell *cell, int n) {
+    for (int i = 0; i < n; i++) {
+        cell[i].ch = ' ';
+        cell[i].fg = vt->pen.fg;
+        cell[i].bg = vt->pen.bg;
+        cell[i].attr = 0;
+    }
+}
+
+static void
+clear_grid(struct vt_screen *vt, int g) {
+    struct vt_cell pen = vt->pen;
+    memset(&vt->pen, 0, sizeof(vt->pen));
+    blank(vt, vt->grid[g], vt->cols * vt->rows);
+    vt->pen = pen;
+}
+
+static void
+scroll_up(struct vt_screen *vt, int top, int bottom, int n) {
+    int height = bottom - top + 1;
+    if (n > height)
+        n = height;
+    struct vt_cell *g = vt->grid[vt->active];
+    memmove(&g[top * vt->cols], &g[(top + n) * vt->cols], sizeof(struct vt_cell) * vt->cols * (height - n));
+    blank(vt, &g[(bottom - n + 1) * vt->cols], vt->cols * n);
+}
+
+static void
+scroll_down(struct vt_screen *vt, int top, int bottom, int n) {
+    int height = bottom - top + 1;
+    if (n > height)
+        n = height;
+    struct vt_cell *g = vt->grid[vt->active];
+    memmove(&g[(top + n) * vt->cols], &g[top * vt->cols], sizeof(struct vt_cell) * vt->cols * (height - n));
+    blank(vt, &g[top * vt->cols], vt->cols * n);
+}
+
+static void
+linefeed(struct vt_screen *vt) {
+    vt->wrap_pending = false;
+    if (vt->y == vt->bottom)
+        scroll_up(vt, vt->top, vt->bottom, 1);
+    else if (vt->y < vt->rows - 1)
+        vt->y++;
+}
+
+static void
+reverse_index(struct vt_screen *vt) {
+    vt->wrap_pending = false;
+    if (vt->y == vt->top)
+        scroll_down(vt, vt->top, vt->bottom, 1);
+    else if (vt->y > 0)
+        vt->y--;
+}
+
+static void
+move_to(struct vt_screen *vt, int x, int y) {
+    vt->x = x < 0 ? 0 : (x >= vt->cols ? vt->cols - 1 : x);
+    vt->y = y < 0 ? 0 : (y >= vt->rows ? vt->rows - 1 : y);
+    vt->wrap_pending = false;
+}
+
+// clear both halves of a wide glyph that is partially overwritten
+static void
+split_wide(struct vt_screen *vt, int x, int y) {
+    struct vt_cell *cell = &CELL(vt, vt->active, x, y);
+    if ((cell->attr & VT_CELL_CONT) && x > 0) {
+        blank(vt, cell - 1, 1);
+        blank(vt, cell, 1);
+    } else if ((cell->attr & VT_CELL_WIDE) && x < vt->cols - 1) {
+        blank(vt, cell, 1);
+        blank(vt, cell + 1, 1);
+    }
+}
+
+static void
+print(struct vt_screen *vt, uint32_t cp) {
+    int width = char_width(cp);
+    if (width == 0) {
+        desync(vt);
+        return;
+    }
+    if (vt->wrap_pending && vt->autowrap) {
+        vt->x = 0;
+        linefeed(vt);
+    }
+    vt->wrap_pending = false;
+    if (width == 2 && vt->x == vt->cols - 1) {
+        if (!vt->autowrap || vt->cols < 2) {
+            desync(vt);
+            return;
+        }
+        split_wide(vt, vt->x, vt->y);
+        blank(vt, &CELL(vt, vt->active, vt->x, vt->y), 1);
+        vt->x = 0;
+        linefeed(vt);
+    }
+
+    split_wide(vt, vt->x, vt->y);
+    if (width == 2)
+        split_wide(vt, vt->x + 1, vt->y);
+    struct vt_cell *cell = &CELL(vt, vt->active, vt->x, vt->y);
+    *cell = vt->pen;
+    cell->ch = cp;
+    if (width == 2) {
+        cell->attr |= VT_CELL_WIDE;
+        cell[1] = vt->pen;
+        cell[1].ch = 0;
+        cell[1].attr |= VT_CELL_CONT;
+    }
+
+    vt->x += width;
+    if (vt->x >= vt->cols) {
+        vt->x = vt->cols - 1;
+        if (vt->autowrap)
+            vt->wrap_pending = true;
+    }
+}
+
+static int
+param(struct vt_screen *vt, int i, int def) {
+    if (i >= vt->nparams || vt->params[i] <= 0)
+        return def;
+    return vt->params[i];
+}
+
+static void
+erase_display(struct vt_screen *vt, int mode) {
+    struct vt_cell *g = vt->grid[vt->active];
+    int pos = vt->y * vt->cols + vt->x;
+    switch (mode) {
+        case 0:
+            blank(vt, &g[pos], vt->cols * vt->rows - pos);
+            break;
+        case 1:
+            blank(vt, g, pos + 1);
+            break;
+        case 2:
+            blank(vt, g, vt->cols * vt->rows);
+            resync(vt, 1);
+            break;
+        case 3: // scrollback
+            break;
+        default:
+            desync(vt);
+            break;
+    }
+}
+
+static void
+erase_line(struct vt_screen *vt, int mode) {
+    struct vt_cell *row = &CELL(vt, vt->active, 0, vt->y);
+    switch (mode) {
+        case 0:
+            split_wide(vt, vt->x, vt->y);
+            blank(vt, &row[vt->x], vt->cols - vt->x);
+            break;
+        case 1:
+            split_wide(vt, vt->x, vt->y);
+            blank(vt, row, vt->x + 1);
+            break;
+        case 2:
+            blank(vt, row, vt->cols);
+            break;
+        default:
+            desync(vt);
+            break;
+    }
+}
+
+static int
+parse_color(struct vt_screen *vt, int *i, uint32_t *color) {
+    if (*i + 1 >= vt->nparams)
+        return -1;
+    switch (vt->params[*i + 1]) {
+        case 5:
+            if (*i + 2 >= vt->nparams)
+                return -1;
+            *color = VT_COLOR_INDEX | (vt->params[*i + 2] & 0xff);
+            *i += 2;
+            return 0;
+        case 2:
+            if (*i + 4 >= vt->nparams)
+                return -1;
+            *color = VT_COLOR_RGB | ((vt->params[*i + 2] & 0xff) << 16) |
+                     ((vt->params[*i + 3] & 0xff) << 8) | (vt->params[*i + 4] & 0xff);
+            *i += 4;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static void
+set_attributes(struct vt_screen *vt) {
+    if (vt->nparams == 0) {
+        memset(&vt->pen, 0, sizeof(vt->pen));
+        resync(vt, 4);
+        return;
+    }
+    for (int i = 0; i < vt->nparams; i++) {
+        int p = vt->params[i] < 0 ? 0 : vt->params[i];
+        if (p == 0) {
+            memset(&vt->pen, 0, sizeof(vt->pen));
+            resync(vt, 4);
+        } else if (p == 1) {
+            vt->pen.attr |= VT_ATTR_BOLD;
+        } else if (p == 2) {
+            vt->pen.attr |= VT_ATTR_DIM;
+        } else if (p == 3) {
+            vt->pen.attr |= VT_ATTR_ITALIC;
+        } else if (p == 4) {
+            vt->pen.attr |= VT_ATTR_UNDERLINE;
+        } else if (p == 5 || p == 6) {
+            vt->pen.attr |= VT_ATTR_BLINK;
+        } else if (p == 7) {
+            vt->pen.attr |= VT_ATTR_REVERSE;
+        } else if (p == 8) {
+            vt->pen.attr |= VT_ATTR_INVISIBLE;
+        } else if (p == 9) {
+            vt->pen.attr |= VT_ATTR_STRIKE;
+        } else if (p == 21 || p == 22) {
+            vt->pen.attr &= ~(VT_ATTR_BOLD | VT_ATTR_DIM);
+        } else if (p == 23) {
+            vt->pen.attr &= ~VT_ATTR_ITALIC;
+        } else if (p == 24) {
+            vt->pen.attr &= ~VT_ATTR_UNDERLINE;
+        } else if (p == 25) {
+            vt->pen.attr &= ~VT_ATTR_BLINK;
+        } else if (p == 27) {
+            vt->pen.attr &= ~VT_ATTR_REVERSE;
+        } else if (p == 28) {
+            vt->pen.attr &= ~VT_ATTR_INVISIBLE;
+        } else if (p == 29) {
+            vt->pen.attr &= ~VT_ATTR_STRIKE;
+        } else if (p >= 30 && p <= 37) {
+            vt->pen.fg = VT_COLOR_INDEX | (p - 30);
+        } else if (p == 38) {
+            if (parse_color(vt, &i, &vt->pen.fg) < 0) {
+                desync(vt);
+                return;
+            }
+        } else if (p == 39) {
+            vt->pen.fg = 0;
+        } else if (p >= 40 && p <= 47) {
+            vt->pen.bg = VT_COLOR_INDEX | (p - 40);
+        } else if (p == 48) {
+            if (parse_color(vt, &i, &vt->pen.bg) < 0) {
+                desync(vt);
+                return;
+            }
+        } else if (p == 49) {
+            vt->pen.bg = 0;
+        } else if (p >= 90 && p <= 97) {
+            vt->pen.fg = VT_COLOR_INDEX | (p - 90 + 8);
+        } else if (p >= 100 && p <= 107) {
+            vt->pen.bg = VT_COLOR_INDEX | (p - 100 + 8);
+        }
+    }
+}
+
+static void
+save_cursor(struct vt_screen *vt) {
+    vt->saved_x = vt->x;
+    vt->saved_y = vt->y;
+    vt->saved_pen = vt->pen;
+}
+
+static void
+restore_cursor(struct vt_screen *vt) {
+    move_to(vt, vt->saved_x, vt->saved_y);
+    vt->pen = vt->saved_pen;
+}
+
+static void
+set_private_mode(struct vt_screen *vt, bool set) {
+    for (int i = 0; i < vt->nparams; i++) {
+        switch (vt->params[i]) {
+            case 25:
+                vt->cursor_hidden = !set;
+                break;
+            case 7:
+                vt->autowrap = set;
+                break;
+            case 47:
+            case 1047:
+            case 1049:
+                if (set && vt->active == 0) {
+                    if (vt->params[i] == 1049)
+                        save_cursor(vt);
+                    vt->active = 1;
+                    clear_grid(vt, 1);
+                } else if (!set && vt->active == 1) {
+                    vt->active = 0;
+                    if (vt->params[i] == 1049)
+                        restore_cursor(vt);
+                }
+                break;
+            case 1048:
+                if (set)
+                    save_cursor(vt);
+                else
+                    restore_cursor(vt);
+                break;
+            case 3:  // 132 column mode
+            case 5:  // reverse video
+            case 6:  // origin mode
+                if (set)
+                    desync(vt);
+                break;
+            default: // input, mouse and cursor style modes do not change the screen
+                break;
+        }
+    }
+}
+
+static void
+dispatch_csi(struct vt_screen *vt, char final) {
+    struct vt_cell *row = &CELL(vt, vt->active, 0, vt->y);
+    int n;
+
+    if (vt->prefix == '?') {
+        if (final == 'h' || final == 'l')
+            set_private_mode(vt, final == 'h');
+        return;
+    }
+    if (vt->prefix != 0 || vt->intermediate != 0) {
+        // DA2, xterm key modifiers, cursor style and the like
+        return;
+    }
+
+    switch (final) {
+        case '@':
+            n = param(vt, 0, 1);
+            if (n > vt->cols - vt->x)
+                n = vt->cols - vt->x;
+            split_wide(vt, vt->x, vt->y);
+            memmove(&row[vt->x + n], &row[vt->x], sizeof(struct vt_cell) * (vt->cols - vt->x - n));
+            blank(vt, &row[vt->x], n);
+            vt->wrap_pending = false;
+            break;
+        case 'A':
+            move_to(vt, vt->x, vt->y - param(vt, 0, 1));
+            break;
+        case 'B':
+        case 'e':
+            move_to(vt, vt->x, vt->y + param(vt, 0, 1));
+            break;
+        case 'C':
+        case 'a':
+            move_to(vt, vt->x + param(vt, 0, 1), vt->y);
+            break;
+        case 'D':
+            move_to(vt, vt->x - param(vt, 0, 1), vt->y);
+            break;
+        case 'E':
+            move_to(vt, 0, vt->y + param(vt, 0, 1));
+            break;
+        case 'F':
+            move_to(vt, 0, vt->y - param(vt, 0, 1));
+            break;
+        case 'G':
+        case '`':
+            move_to(vt, param(vt, 0, 1) - 1, vt->y);
+            break;
+        case 'H':
+        case 'f':
+            move_to(vt, param(vt, 1, 1) - 1, param(vt, 0, 1) - 1);
+            resync(vt, 2);
+            break;
+        case 'd':
+            move_to(vt, vt->x, param(vt, 0, 1) - 1);
+            break;
+        case 'J':
+            erase_display(vt, param(vt, 0, 0));
+            break;
+        case 'K':
+            erase_line(vt, param(vt, 0, 0));
+            break;
+        case 'L':
+        case 'M':
+            if (vt->y < vt->top || vt->y > vt->bottom)
+                break;
+            if (final == 'L')
+                scroll_down(vt, vt->y, vt->bottom, param(vt, 0, 1));
+            else
+                scroll_up(vt, vt->y, vt->bottom, param(vt, 0, 1));
+            vt->x = 0;
+            vt->wrap_pending = false;
+            break;
+        case 'P':
+            n = param(vt, 0, 1);
+            if (n > vt->cols - vt->x)
+                n = vt->cols - vt->x;
+            split_wide(vt, vt->x, vt->y);
+            memmove(&row[vt->x], &row[vt->x + n], sizeof(struct vt_cell) * (vt->cols - vt->x - n));
+            blank(vt, &row[vt->cols - n], n);
+            vt->wrap_pending = false;
+            break;
+        case 'X':
+            n = param(vt, 0, 1);
+            if (n > vt->cols - vt->x)
+                n = vt->cols - vt->x;
+            split_wide(vt, vt->x, vt->y);
+            blank(vt, &row[vt->x], n);
+            vt->wrap_pending = false;
+            break;
+        case 'S':
+            scroll_up(vt, vt->top, vt->bottom, param(vt, 0, 1));
+            break;
+        case 'T':
+            if (vt->nparams > 1) // mouse highlight tracking
+                break;
+            scroll_down(vt, vt->top, vt->bottom, param(vt, 0, 1));
+            break;
+        case 'Z':
+            n = param(vt, 0, 1);
+            while (n-- > 0 && vt->x > 0)
+                vt->x = (vt->x - 1) / 8 * 8;
+            vt->wrap_pending = false;
+            break;
+        case 'm':
+            set_attributes(vt);
+            break;
+        case 'r':
+            vt->top = param(vt, 0, 1) - 1;
+            vt->bottom = param(vt, 1, vt->rows) - 1;
+            if (vt->bottom >= vt->rows)
+                vt->bottom = vt->rows - 1;
+            if (vt->top >= vt->bottom) {
+                vt->top = 0;
+                vt->bottom = vt->rows - 1;
+            }
+            move_to(vt, 0, 0);
+            break;
+        case 's':
+            if (vt->nparams == 0)
+                save_cursor(vt);
+            break;
+        case 'u':
+            restore_cursor(vt);
+            break;
+        case 'h':
+        case 'l':
+            // insert and newline modes change how text is laid out
+            for (int i = 0; i < vt->nparams; i++) {
+                if (final == 'h' && (vt->params[i] == 4 || vt->params[i] == 20))
+                    desync(vt);
+            }
+            break;
+        case 'c': // device attributes
+        case 'n': // device status report
+        case 't': // window manipulation
+        case 'q': // load LEDs
+            break;
+        default:
+            desync(vt);
+            break;
+    }
+}
+
+static void
+reset(struct vt_screen *vt) {
+    memset(&vt->pen, 0, sizeof(vt->pen));
+    vt->active = 0;
+    clear_grid(vt, 0);
+    vt->x = vt->y = 0;
+    vt->wrap_pending = false;
+    vt->top = 0;
+    vt->bottom = vt->rows - 1;
+    vt->saved_x = vt->saved_y = 0;
+    memset(&vt->saved_pen, 0, sizeof(vt->saved_pen));
+    vt->cursor_hidden = false;
+    vt->autowrap = true;
+    vt->synced = true;
+    vt->resync = 0;
+    vt->state = VT_GROUND;
+}
+
+static void
+dispatch_esc(struct vt_screen *vt, char c) {
+    switch (c) {
+        case '[':
+            vt->state = VT_CSI;
+            vt->nparams = 0;
+            vt->prefix = 0;
+            vt->intermediate = 0;
+            memset(vt->params, 0, sizeof(vt->params));
+            return;
+        case ']':
+            vt->state = VT_OSC;
+            return;
+        case 'P':
+        case 'X':
+        case '^':
+        case '_':
+            vt->state = VT_STRING;
+            return;
+        case '(':
+            vt->state = VT_CHARSET;
+            return;
+        case ')':
+        case '*':
+        case '+':
+        case ' ':
+            vt->state = VT_IGNORE_ONE;
+            return;
+        case '#':
+            desync(vt);
+            vt->state = VT_IGNORE_ONE;
+            return;
+        case '7':
+            save_cursor(vt);
+            break;
+        case '8':
+            restore_cursor(vt);
+            break;
+        case 'D':
+            linefeed(vt);
+            break;
+        case 'E':
+            vt->x = 0;
+            linefeed(vt);
+            break;
+        case 'M':
+            reverse_index(vt);
+            break;
+        case 'c':
+            reset(vt);
+            break;
+        case '=':
+        case '>':
+        case '\\':
+            break;
+        default:
+            desync(vt);
+            break;
+    }
+    vt->state = VT_GROUND;
+}
+
+static void
+execute(struct vt_screen *vt, unsigned char c) {
+    switch (c) {
+        case '\b':
+            if (vt->x > 0)
+                vt->x--;
+            vt->wrap_pending = false;
+            break;
+        case '\t':
+            vt->x = (vt->x / 8 + 1) * 8;
+            if (vt->x >= vt->cols)
+                vt->x = vt->cols - 1;
+            vt->wrap_pending = false;
+            break;
+        case '\n':
+        case '\v':
+        case '\f':
+            linefeed(vt);
+            break;
+        case '\r':
+            vt->x = 0;
+            vt->wrap_pending = false;
+            break;
+        case 0x0e: // shift out
+            desync(vt);
+            break;
+        case 0x1b:
+            vt->state = VT_ESC;
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+feed_byte(struct vt_screen *vt, unsigned char c) {
+    switch (vt->state) {
+        case VT_UTF8:
+            if ((c & 0xc0) == 0x80) {
+                vt->cp = (vt->cp << 6) | (c & 0x3f);
+                if (--vt->utf8_left == 0) {
+                    vt->state = VT_GROUND;
+                    print(vt, vt->cp);
+                }
+                return;
+            }
+            vt->state = VT_GROUND;
+            print(vt, 0xfffd);
+            // fall through to handle the byte in ground state
+        case VT_GROUND:
+            if (c < 0x20) {
+                execute(vt, c);
+            } else if (c < 0x7f) {
+                print(vt, c);
+            } else if (c >= 0xc2 && c <= 0xf4) {
+                vt->utf8_left = c >= 0xf0 ? 3 : (c >= 0xe0 ? 2 : 1);
+                vt->cp = c & (0x3f >> vt->utf8_left);
+                vt->state = VT_UTF8;
+            } else if (c != 0x7f) {
+                print(vt, 0xfffd);
+            }
+            break;
+        case VT_ESC:
+            if (c < 0x20 && c != 0x1b) {
+                execute(vt, c);
+                return;
+            }
+            dispatch_esc(vt, (char) c);
+            break;
+        case VT_CSI:
+            if (c >= '0' && c <= '9') {
+                if (vt->nparams == 0)
+                    vt->nparams = 1;
+                int *p = &vt->params[vt->nparams - 1];
+                if (*p < 10000)
+                    *p = *p * 10 + (c - '0');
+            } else if (c == ';' || c == ':') {
+                if (vt->nparams == 0)
+                    vt->nparams = 1;
+                if (vt->nparams < (int) (sizeof(vt->params) / sizeof(vt->params[0])))
+                    vt->nparams++;
+            } else if (c >= '<' && c <= '?') {
+                vt->prefix = (char) c;
+            } else if (c >= 0x20 && c <= 0x2f) {
+                vt->intermediate = (char) c;
+            } else if (c >= 0x40 && c <= 0x7e) {
+                vt->state = VT_GROUND;
+                dispatch_csi(vt, (char) c);
+            } else if (c == 0x1b) {
+                vt->state = VT_ESC;
+            } else if (c < 0x20) {
+                execute(vt, c);
+            }
+            break;
+        case VT_OSC:
+            if (c == 0x07)
+                vt->state = VT_GROUND;
+            else if (c == 0x1b)
+                vt->state = VT_OSC_ESC;
+            break;
+        case VT_STRING:
+            if (c == 0x1b)
+                vt->state = VT_STRING_ESC;
+            break;
+        case VT_OSC_ESC:
+        case VT_STRING_ESC:
+            if (c == '\\') {
+                vt->state = VT_GROUND;
+            } else {
+                vt->state = VT_ESC;
+                feed_byte(vt, c);
+            }
+            break;
+        case VT_CHARSET:
+            if (c != 'B')
+                desync(vt);
+            vt->state = VT_GROUND;
+            break;
+        case VT_IGNORE_ONE:
+            vt->state = VT_GROUND;
+            break;
+        default:
+            vt->state = VT_GROUND;
+            break;
+    }
+}
+
+struct vt_screen *
+vt_new(int cols, int rows) {
+    struct vt_screen *vt = xmalloc(sizeof(struct vt_screen));
+    memset(vt, 0, sizeof(struct vt_screen));
+    vt->cols = cols > 0 ? cols : 80;
+    vt->rows = rows > 0 ? rows : 24;
+    vt->grid[0] = xmalloc(sizeof(struct vt_cell) * vt->cols * vt->rows);
+    vt->grid[1] = xmalloc(sizeof(struct vt_cell) * vt->cols * vt->rows);
+    clear_grid(vt, 1);
+    reset(vt);
+    // the client screen content is unknown until the program clears it
+    desync(vt);
+    return vt;
+}
+
+void
+vt_free(struct vt_screen *vt) {
+    if (vt == NULL)
+        return;
+    free(vt->grid[0]);
+    free(vt->grid[1]);
+    free(vt);
+}
+
+void
+vt_resize(struct vt_screen *vt, int cols, int rows) {
+    if (cols <= 0 || rows <= 0 || (cols == vt->cols && rows == vt->rows))
+        return;
+    for (int g = 0; g < 2; g++) {
+        struct vt_cell *grid = xmalloc(sizeof(struct vt_cell) * cols * rows);
+        struct vt_cell pen = vt->pen;
+        memset(&vt->pen, 0, sizeof(vt->pen));
+        blank(vt, grid, cols * rows);
+        vt->pen = pen;
+        for (int y = 0; y < rows && y < vt->rows; y++) {
+            memcpy(&grid[y * cols], &vt->grid[g][y * vt->cols],
+                   sizeof(struct vt_cell) * (cols < vt->cols ? cols : vt->cols));
+            // a wide glyph cut in half at the right edge
+            if (cols < vt->cols && (grid[y * cols + cols - 1].attr & VT_CELL_WIDE)) {
+                grid[y * cols + cols - 1].ch = ' ';
+                grid[y * cols + cols - 1].attr &= ~VT_CELL_WIDE;
+            }
+        }
+        free(vt->grid[g]);
+        vt->grid[g] = grid;
+    }
+    vt->cols = cols;
+    vt->rows = rows;
+    vt->top = 0;
+    vt->bottom = rows - 1;
+    move_to(vt, vt->x, vt->y);
+    if (vt->saved_x >= cols)
+        vt->saved_x = cols - 1;
+    if (vt->saved_y >= rows)
+        vt->saved_y = rows - 1;
+}
+
+void
+vt_feed(struct vt_screen *vt, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        feed_byte(vt, (unsigned char) buf[i]);
+}
+
+void
+vt_invalidate(struct vt_screen *vt) {
+    desync(vt);
+}
+
+bool
+vt_renderable(const struct vt_screen *vt) {
+    return vt->synced && vt->state == VT_GROUND;
+}
+
+struct render_buf {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+static void
+emit(struct render_buf *rb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+emit(struct render_buf *rb, const char *fmt, ...) {
+    if (rb->overflow)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(rb->buf + rb->len, rb->size - rb->len, fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t) n >= rb->size - rb->len)
+        rb->overflow = true;
+    else
+        rb->len += n;
+}
+
+static void
+emit_char(struct render_buf *rb, uint32_t cp) {
+    char s[5];
+    if (cp < 0x80) {
+        s[0] = (char) cp;
+        s[1] = '\0';
+    } else if (cp < 0x800) {
+        s[0] = (char) (0xc0 | (cp >> 6));
+        s[1] = (char) (0x80 | (cp & 0x3f));
+        s[2] = '\0';
+    } else if (cp < 0x10000) {
+        s[0] = (char) (0xe0 | (cp >> 12));
+        s[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+        s[2] = (char) (0x80 | (cp & 0x3f));
+        s[3] = '\0';
+    } else {
+        s[0] = (char) (0xf0 | (cp >> 18));
+        s[1] = (char) (0x80 | ((cp >> 12) & 0x3f));
+        s[2] = (char) (0x80 | ((cp >> 6) & 0x3f));
+        s[3] = (char) (0x80 | (cp & 0x3f));
+        s[4] = '\0';
+    }
+    emit(rb, "%s", s);
+}
+
+static void
+emit_color(struct render_buf *rb, uint32_t color, int base) {
+    if (color == 0) {
+        emit(rb, ";%d", base + 9);
+    } else if (color & VT_COLOR_RGB) {
+        emit(rb, ";%d;2;%u;%u;%u", base + 8, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+    } else if ((color & 0xff) < 8) {
+        emit(rb, ";%d", base + (color & 0xff));
+    } else if ((color & 0xff) < 16) {
+        emit(rb, ";%d", base + 60 + (color & 0xff) - 8);
+    } else {
+        emit(rb, ";%d;5;%u", base + 8, color & 0xff);
+    }
+}
+
+static void
+emit_attributes(struct render_buf *rb, const struct vt_cell *cell) {
+    static const int codes[] = {1, 2, 3, 4, 5, 7, 8, 9};
+    emit(rb, "\x1b[0");
+    for (int i = 0; i < 8; i++) {
+        if (cell->attr & (1 << i))
+            emit(rb, ";%d", codes[i]);
+    }
+    if (cell->fg != 0)
+        emit_color(rb, cell->fg, 30);
+    if (cell->bg != 0)
+        emit_color(rb, cell->bg, 40);
+    emit(rb, "m");
+}
+
+static bool
+same_attributes(const struct vt_cell *a, const struct vt_cell *b) {
+    return a->fg == b->fg && a->bg == b->bg &&
+           (a->attr & ~(VT_CELL_WIDE | VT_CELL_CONT)) == (b->attr & ~(VT_CELL_WIDE | VT_CELL_CONT));
+}
+
+static void
+render_grid(const struct vt_screen *vt, int g, struct render_buf *rb) {
+    struct vt_cell current;
+    memset(&current, 0, sizeof(current));
+
+    emit(rb, "\x1b[0m\x1b[H\x1b[2J");
+    for (int y = 0; y < vt->rows; y++) {
+        const struct vt_cell *row = &vt->grid[g][y * vt->cols];
+        int last = vt->cols - 1;
+        while (last >= 0 && row[last].ch == ' ' && row[last].bg == 0 &&
+               !(row[last].attr & (VT_ATTR_REVERSE | VT_ATTR_UNDERLINE | VT_ATTR_STRIKE)))
+            last--;
+        if (last < 0)
+            continue;
+        emit(rb, "\x1b[%d;1H", y + 1);
+        for (int x = 0; x <= last; x++) {
+            if (row[x].attr & VT_CELL_CONT)
+                continue;
+            if (!same_attributes(&row[x], &current)) {
+                emit_attributes(rb, &row[x]);
+                current = row[x];
+            }
+            emit_char(rb, row[x].ch);
+        }
+    }
+}
+
+size_t
+vt_render(const struct vt_screen *vt, char *buf, size_t size) {
+    struct render_buf rb = {buf, size, 0, false};
+
+    if (!vt_renderable(vt))
+        return 0;
+
+    emit(&rb, "\x1b[r\x1b[?7h");
+    // the client may have missed a switch between the screens, paint both of them
+    emit(&rb, "\x1b[?1049l");
+    render_grid(vt, 0, &rb);
+    emit(&rb, "\x1b[%d;%dH", vt->saved_y + 1, vt->saved_x + 1);
+    emit_attributes(&rb, &vt->saved_pen);
+    emit(&rb, "\x1b" "7");
+    if (vt->active == 1) {
+        emit(&rb, "\x1b[?1049h");
+        render_grid(vt, 1, &rb);
+    }
+
+    if (vt->top != 0 || vt->bottom != vt->rows - 1)
+        emit(&rb, "\x1b[%d;%dr", vt->top + 1, vt->bottom + 1);
+    if (vt->wrap_pending) {
+        // print the last glyph again so the client wraps on the next character
+        int x = vt->x;
+        if ((vt->grid[vt->active][vt->y * vt->cols + x].attr & VT_CELL_CONT) && x > 0)
+            x--;
+        const struct vt_cell *cell = &vt->grid[vt->active][vt->y * vt->cols + x];
+        emit(&rb, "\x1b[%d;%dH", vt->y + 1, x + 1);
+        emit_attributes(&rb, cell);
+        emit_char(&rb, cell->ch);
+    } else {
+        emit(&rb, "\x1b[%d;%dH", vt->y + 1, vt->x + 1);
+    }
+    emit_attributes(&rb, &vt->pen);
+    if (!vt->autowrap)
+        emit(&rb, "\x1b[?7l");
+    emit(&rb, vt->cursor_hidden ? "\x1b[?25l" : "\x1b[?25h");
+
+    return rb.overflow ? 0 : rb.len;
+}
@@ -0,0 +1,91 @@
+#ifndef TTYD_VT_H
+#define TTYD_VT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// cell attributes
+#define VT_ATTR_BOLD      (1 << 0)
+#define VT_ATTR_DIM       (1 << 1)
+#define VT_ATTR_ITALIC    (1 << 2)
+#define VT_ATTR_UNDERLINE (1 << 3)
+#define VT_ATTR_BLINK     (1 << 4)
+#define VT_ATTR_REVERSE   (1 << 5)
+#define VT_ATTR_INVISIBLE (1 << 6)
+#define VT_ATTR_STRIKE    (1 << 7)
+#define VT_CELL_WIDE      (1 << 8)  // first half of a double width glyph
+#define VT_CELL_CONT      (1 << 9)  // second half of a double width glyph
+
+// color encoding, 0 means the terminal default
+#define VT_COLOR_INDEX 0x01000000
+#define VT_COLOR_RGB   0x02000000
+
+struct vt_cell {
+    uint32_t ch;
+    uint32_t fg;
+    uint32_t bg;
+    uint16_t attr;
+};
+
+// A minimal model of the client side screen, it understands the subset of
+// xterm control sequences that full screen programs (top, htop, watch...)
+// use to redraw, anything else marks the model as out of sync until the
+// screen is cleared again.
+struct vt_screen {
+    int cols;
+    int rows;
+    struct vt_cell *grid[2];        // main and alternate screen
+    int active;                     // index of the active screen
+    int x, y;                       // cursor position
+    bool wrap_pending;
+    int top, bottom;                // scroll region
+    struct vt_cell pen;             // current attributes
+    int saved_x, saved_y;
+    struct vt_cell saved_pen;
+    bool cursor_hidden;
+    bool autowrap;
+    bool synced;                    // whether the model matches the client screen
+    int resync;
+
+    // parser
+    int state;
+    int params[16];
+    int nparams;
+    char prefix;
+    char intermediate;
+    uint32_t cp;
+    int utf8_left;
+};
+
+// Create a screen model with the given size
+struct vt_screen *
+vt_new(int cols, int rows);
+
+// Free the screen model
+void
+vt_free(struct vt_screen *vt);
+
+// Resize the screen, keep the content in the top left corner
+void
+vt_resize(struct vt_screen *vt, int cols, int rows);
+
+// Feed pty output to the model
+void
+vt_feed(struct vt_screen *vt, const char *buf, size_t len);
+
+// Mark the model out of sync, e.g. when some output is lost
+void
+vt_invalidate(struct vt_screen *vt);
+
+// Whether the model can be rendered: it is in sync with the client and the parser
+// is not in the middle of a sequence
+bool
+vt_renderable(const struct vt_screen *vt);
+
+// Render the sequence that repaints the whole screen into buf,
+// returns the length written or 0 if it does not fit
+size_t
+vt_render(const struct vt_screen *vt, char *buf, size_t size);
+
+#endif //TTYD_VT_H